@@ -0,0 +1,439 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+/**
+ * \file twWsTest.c
+ * \brief Websocket frame layer tests
+ *
+ * Runs a websocket over an in-process pipe against a minimal server on a
+ * second thread, so framing can be checked byte for byte without a network,
+ * and checks the masking, UTF-8 and handshake helpers directly.
+ *
+ * Build with the SDK sources and link with pthreads.  Prints each failed
+ * check and exits non-zero if there were any.
+*/
+#include "twOSPort.h"
+#include "twWebsocket.h"
+#include "twWsTransport.h"
+#include "twWsSimd.h"
+#include "twWsHandshake.h"
+#include "twErrors.h"
+#include "tomcrypt.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define CHECK(c) do { if (!(c)) { failures++; printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #c); } } while (0)
+
+/* Big enough that a frame needs the 64 bit length */
+#define TEST_LARGE_SIZE 70000
+/* Needs several frames at the default send frame limit */
+#define TEST_FRAGMENTED_SIZE 40000
+#define TEST_TIMEOUT 5000
+
+static int failures = 0;
+
+/**
+* Server side of the pipe
+**/
+typedef struct testFrame {
+	char fin;
+	unsigned char opcode;
+	char masked;
+	unsigned char lengthBytes;            /* 0, 2 or 8 extended length bytes */
+	uint32_t length;
+	char * payload;
+} testFrame;
+
+static twWsTransport * server = NULL;
+static char * large = NULL;
+static char * fragmented = NULL;
+
+static int readAll(char * buf, uint32_t length) {
+	uint32_t got = 0;
+	while (got < length) {
+		int res = twWsTransport_Read(server, buf + got, length - got, TEST_TIMEOUT);
+		if (res <= 0) return -1;
+		got += res;
+	}
+	return 0;
+}
+
+static int writeFrame(char fin, unsigned char opcode, const char * payload, uint32_t length) {
+	char header[10];
+	uint32_t headerLength = 2;
+	header[0] = (fin ? 0x80 : 0x00) | opcode;
+	if (length < 126) header[1] = (char)length;
+	else if (length <= 0xffff) {
+		header[1] = 126;
+		header[2] = (char)(length >> 8);
+		header[3] = (char)length;
+		headerLength = 4;
+	} else {
+		int i = 0;
+		header[1] = 127;
+		for (i = 0; i < 8; i++) header[2 + i] = i < 4 ? 0 : (char)(length >> (8 * (7 - i)));
+		headerLength = 10;
+	}
+	if (twWsTransport_Write(server, header, headerLength, TEST_TIMEOUT) != (int)headerLength) return -1;
+	if (length && twWsTransport_Write(server, payload, length, TEST_TIMEOUT) != (int)length) return -1;
+	return 0;
+}
+
+/* Reads a client frame and unmasks it.  The caller frees the payload. */
+static int readFrame(testFrame * f) {
+	unsigned char header[8];
+	unsigned char key[4];
+	uint32_t i = 0;
+	memset(f, 0, sizeof(testFrame));
+	if (readAll((char *)header, 2)) return -1;
+	f->fin = (header[0] & 0x80) != 0;
+	f->opcode = header[0] & 0x0f;
+	f->masked = (header[1] & 0x80) != 0;
+	f->length = header[1] & 0x7f;
+	if (f->length == 126) f->lengthBytes = 2;
+	else if (f->length == 127) f->lengthBytes = 8;
+	if (f->lengthBytes) {
+		if (readAll((char *)header, f->lengthBytes)) return -1;
+		f->length = 0;
+		for (i = 0; i < f->lengthBytes; i++) f->length = (f->length << 8) | header[i];
+	}
+	if (f->masked && readAll((char *)key, 4)) return -1;
+	f->payload = (char *)malloc(f->length + 1);
+	if (!f->payload || readAll(f->payload, f->length)) return -1;
+	/* Unmask by hand rather than with the code under test */
+	if (f->masked) for (i = 0; i < f->length; i++) f->payload[i] ^= key[i & 3];
+	return 0;
+}
+
+static int sendResponse(const char * request, const char * frames, uint32_t framesLength) {
+	const char * keyHeader = strstr(request, "Sec-WebSocket-Key: ");
+	char key[80];
+	unsigned char hash[20];
+	unsigned char accept[40];
+	unsigned long acceptLength = sizeof(accept);
+	char response[256];
+	uint32_t length = 0;
+	TW_SHA1_CTX sha;
+	if (!keyHeader) return -1;
+	keyHeader += strlen("Sec-WebSocket-Key: ");
+	memcpy(key, keyHeader, WS_HANDSHAKE_KEY_LENGTH);
+	strcpy(key + WS_HANDSHAKE_KEY_LENGTH, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	twSHA1_Init(&sha);
+	twSHA1_Update(&sha, (unsigned char *)key, strlen(key));
+	twSHA1_Final(hash, &sha);
+	memset(accept, 0, sizeof(accept));
+	base64_encode(hash, 20, accept, &acceptLength);
+	length = sprintf(response, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+	/* Frames in the same write as the headers must be left for the frame decoder */
+	memcpy(response + length, frames, framesLength);
+	return twWsTransport_Write(server, response, length + framesLength, TEST_TIMEOUT) < 0 ? -1 : 0;
+}
+
+static void * serverThread(void * arg) {
+	char request[4096];
+	uint32_t n = 0;
+	testFrame f;
+	char medium[300];
+	uint32_t got = 0;
+	int frames = 0;
+	(void)arg;
+	memset(medium, 'm', sizeof(medium));
+	/* The upgrade request */
+	while (n < 4 || memcmp(request + n - 4, "\r\n\r\n", 4)) {
+		if (n == sizeof(request) - 1 || readAll(request + n, 1)) {
+			CHECK(!"Incomplete upgrade request");
+			return NULL;
+		}
+		n++;
+	}
+	request[n] = 0;
+	/* A short frame, then 16 and 64 bit lengths */
+	CHECK(sendResponse(request, "\x81\x05short", 7) == 0);
+	CHECK(writeFrame(TRUE, 0x01, medium, sizeof(medium)) == 0);
+	CHECK(writeFrame(TRUE, 0x02, large, TEST_LARGE_SIZE) == 0);
+	/* A fragmented message with a ping between fragments and a code point split across them */
+	CHECK(writeFrame(FALSE, 0x01, "caf\xc3", 4) == 0);
+	CHECK(writeFrame(TRUE, 0x09, "p", 1) == 0);
+	CHECK(writeFrame(FALSE, 0x00, "\xa9 au ", 5) == 0);
+	CHECK(writeFrame(TRUE, 0x00, "lait", 4) == 0);
+
+	/* What the client sends back */
+	if (readFrame(&f)) {
+		CHECK(!"Missing short frame");
+		return NULL;
+	}
+	CHECK(f.fin && f.opcode == 0x01 && f.masked && f.lengthBytes == 0 && f.length == 5 && !memcmp(f.payload, "short", 5));
+	free(f.payload);
+	if (readFrame(&f)) {
+		CHECK(!"Missing 16 bit frame");
+		return NULL;
+	}
+	CHECK(f.fin && f.opcode == 0x01 && f.masked && f.lengthBytes == 2 && f.length == sizeof(medium) && !memcmp(f.payload, medium, sizeof(medium)));
+	free(f.payload);
+	if (readFrame(&f)) {
+		CHECK(!"Missing 64 bit frame");
+		return NULL;
+	}
+	CHECK(f.fin && f.opcode == 0x02 && f.masked && f.lengthBytes == 8 && f.length == TEST_LARGE_SIZE && !memcmp(f.payload, large, TEST_LARGE_SIZE));
+	free(f.payload);
+	/* Split at the default send frame limit */
+	do {
+		if (readFrame(&f)) {
+			CHECK(!"Missing fragment");
+			return NULL;
+		}
+		CHECK(f.opcode == (frames ? 0x00 : 0x02) && f.masked);
+		CHECK(got + f.length <= TEST_FRAGMENTED_SIZE && !memcmp(f.payload, fragmented + got, f.length));
+		got += f.length;
+		frames++;
+		free(f.payload);
+	} while (!f.fin && got < TEST_FRAGMENTED_SIZE);
+	CHECK(f.fin && got == TEST_FRAGMENTED_SIZE && frames > 1);
+	return NULL;
+}
+
+/**
+* Client callbacks
+**/
+static int texts = 0;
+static int binaries = 0;
+static int pings = 0;
+static char lastText[512];
+static size_t lastTextLength = 0;
+static char largeOk = FALSE;
+
+static int onText(twWs * ws, const char * at, size_t length) {
+	(void)ws;
+	texts++;
+	lastTextLength = length < sizeof(lastText) ? length : sizeof(lastText);
+	memcpy(lastText, at, lastTextLength);
+	if (texts == 1) CHECK(length == 5 && !memcmp(at, "short", 5));
+	if (texts == 2) CHECK(length == 300 && at[0] == 'm' && at[299] == 'm');
+	return 0;
+}
+
+static int onBinary(twWs * ws, const char * at, size_t length) {
+	(void)ws;
+	binaries++;
+	largeOk = length == TEST_LARGE_SIZE && !memcmp(at, large, TEST_LARGE_SIZE);
+	return 0;
+}
+
+static int onPing(twWs * ws, const char * at, size_t length) {
+	(void)ws;
+	pings++;
+	CHECK(length == 1 && at[0] == 'p');
+	return 0;
+}
+
+/**
+* Tests
+**/
+static void testFraming() {
+	twWsTransport * client = NULL;
+	twWs * ws = NULL;
+	pthread_t thread;
+	char medium[300];
+	int i = 0;
+	memset(medium, 'm', sizeof(medium));
+	large = (char *)malloc(TEST_LARGE_SIZE);
+	fragmented = (char *)malloc(TEST_FRAGMENTED_SIZE);
+	for (i = 0; i < TEST_LARGE_SIZE; i++) large[i] = (char)(i * 7);
+	for (i = 0; i < TEST_FRAGMENTED_SIZE; i++) fragmented[i] = (char)(i * 13);
+
+	CHECK(twWsTransport_CreatePipe(0, &client, &server) == TW_OK);
+	CHECK(twWs_CreateWithTransport(client, "pipe", 0, "/Thingworx/WS", "key", NULL, TEST_LARGE_SIZE, TEST_LARGE_SIZE, &ws) == TW_OK);
+	if (!ws) return;
+	twWs_RegisterTextMessageCallback(ws, onText);
+	twWs_RegisterBinaryMessageCallback(ws, onBinary);
+	twWs_RegisterPingCallback(ws, onPing);
+	pthread_create(&thread, NULL, serverThread, NULL);
+
+	CHECK(twWs_Connect(ws, TEST_TIMEOUT) == TW_OK);
+	for (i = 0; i < 100 && texts < 3; i++) CHECK(twWs_Receive(ws, 50) == TW_OK);
+	CHECK(texts == 3 && binaries == 1 && pings == 1 && largeOk);
+	CHECK(lastTextLength == 13 && !memcmp(lastText, "caf\xc3\xa9 au lait", 13));
+
+	CHECK(twWs_SendMessage(ws, "short", 5, TRUE) == TW_OK);
+	CHECK(twWs_SendMessage(ws, medium, sizeof(medium), TRUE) == TW_OK);
+	/* Force the whole message into one frame */
+	CHECK(twWs_SetSendFrameLimit(ws, TEST_LARGE_SIZE) == TW_OK);
+	CHECK(twWs_SendMessage(ws, large, TEST_LARGE_SIZE, FALSE) == TW_OK);
+	CHECK(twWs_SetSendFrameLimit(ws, 0) == TW_OK);
+	CHECK(twWs_SendMessage(ws, fragmented, TEST_FRAGMENTED_SIZE, FALSE) == TW_OK);
+
+	pthread_join(thread, NULL);
+	twWs_Delete(ws);
+	twWsTransport_Delete(server);
+	server = NULL;
+	free(large);
+	free(fragmented);
+}
+
+static void testMask() {
+	const unsigned char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	char src[130];
+	char dst[130];
+	char whole[130];
+	uint32_t offset = 0;
+	uint32_t length = 0;
+	uint32_t i = 0;
+	for (i = 0; i < sizeof(src); i++) src[i] = (char)(i * 31 + 5);
+	/* Unaligned sources and every offset against the byte at a time definition */
+	for (offset = 0; offset < 8; offset++) {
+		for (length = 0; length < 100; length++) {
+			char ok = TRUE;
+			twWsSimd_Mask(dst, src + 1, length, key, offset);
+			for (i = 0; i < length; i++) if (dst[i] != (char)(src[1 + i] ^ key[(offset + i) & 3])) ok = FALSE;
+			CHECK(ok);
+		}
+	}
+	/* Masking in pieces at odd offsets matches masking in one go */
+	twWsSimd_Mask(whole, src, sizeof(src), key, 0);
+	for (offset = 0; offset < sizeof(src); offset += length) {
+		length = offset % 7 + 3;
+		if (offset + length > sizeof(src)) length = sizeof(src) - offset;
+		twWsSimd_Mask(dst + offset, src + offset, length, key, offset);
+	}
+	CHECK(!memcmp(dst, whole, sizeof(src)));
+	/* In place, and masking twice gives back the original */
+	memcpy(dst, whole, sizeof(src));
+	twWsSimd_Mask(dst + 3, dst + 3, sizeof(src) - 3, key, 3);
+	CHECK(!memcmp(dst + 3, src + 3, sizeof(src) - 3));
+}
+
+/* Validates a message in two pieces split at every position */
+static char validateSplit(const char * s, uint32_t length) {
+	uint32_t split = 0;
+	char result = TRUE;
+	for (split = 0; split <= length; split++) {
+		uint32_t state = 0;
+		char valid = twWsSimd_ValidateUtf8(&state, s, split) && twWsSimd_ValidateUtf8(&state, s + split, length - split) && state == 0;
+		if (split == 0) result = valid;
+		else if (valid != result) {
+			printf("Validation of a split message depended on where it was split (%u)\n", split);
+			return 2;
+		}
+	}
+	return result;
+}
+
+/* Validates a message a byte at a time */
+static char validateBytes(const char * s, uint32_t length) {
+	uint32_t state = 0;
+	uint32_t i = 0;
+	for (i = 0; i < length; i++) if (!twWsSimd_ValidateUtf8(&state, s + i, 1)) return FALSE;
+	return state == 0;
+}
+
+static void testUtf8() {
+	static const char * valid[] = {
+		"",
+		"plain ascii",
+		"\xc2\xa9",                                     /* U+00A9 */
+		"\xe2\x82\xac",                                 /* U+20AC */
+		"\xed\x9f\xbf",                                 /* U+D7FF, below the surrogates */
+		"\xee\x80\x80",                                 /* U+E000, above them */
+		"\xf0\x9d\x84\x9e",                             /* U+1D11E */
+		"\xf4\x8f\xbf\xbf",                             /* U+10FFFF */
+		"a long enough run of ascii to fill vectors \xe2\x82\xac then more ascii after it \xf0\x9f\x98\x80"
+	};
+	static const char * invalid[] = {
+		"\x80",                                         /* Stray continuation */
+		"\xc0\xaf",                                     /* Overlong '/' */
+		"\xc1\xbf",
+		"\xe0\x80\xaf",
+		"\xe0\x9f\xbf",                                 /* Overlong U+07FF */
+		"\xf0\x80\x80\xaf",
+		"\xf0\x8f\xbf\xbf",                             /* Overlong U+FFFF */
+		"\xed\xa0\x80",                                 /* U+D800 */
+		"\xed\xbf\xbf",                                 /* U+DFFF */
+		"\xf4\x90\x80\x80",                             /* U+110000 */
+		"\xf5\x80\x80\x80",
+		"\xff",
+		"\xe2\x82",                                     /* Truncated */
+		"\xe2\x82\xe2\x82\xac",                         /* Interrupted */
+		"a long enough run of ascii to fill vectors before \xed\xa0\x80 a surrogate"
+	};
+	uint32_t i = 0;
+	uint32_t state = 0;
+	for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+		CHECK(validateSplit(valid[i], strlen(valid[i])) == TRUE);
+		CHECK(validateBytes(valid[i], strlen(valid[i])));
+	}
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		CHECK(validateSplit(invalid[i], strlen(invalid[i])) == FALSE);
+		CHECK(!validateBytes(invalid[i], strlen(invalid[i])));
+	}
+	/* Embedded NULs are valid */
+	CHECK(twWsSimd_ValidateUtf8(&state, "a\0b", 3) && state == 0);
+	/* A truncated code point is only invalid once the message ends */
+	state = 0;
+	CHECK(twWsSimd_ValidateUtf8(&state, "\xf0\x9d", 2) && state != 0);
+}
+
+typedef struct testHeaders {
+	int count;
+	char upgrade;
+	char accept;
+} testHeaders;
+
+static int32_t onHeader(void * arg, char * name, char * value) {
+	testHeaders * h = (testHeaders *)arg;
+	h->count++;
+	if (!strcmp(name, "upgrade") && !strcmp(value, "websocket")) h->upgrade = TRUE;
+	if (!strcmp(name, "sec-websocket-accept") && !strcmp(value, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")) h->accept = TRUE;
+	return 0;
+}
+
+static void testHandshake() {
+	static const char response[] = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade:   websocket  \r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+		"\r\n"
+		"\x81\x02hi";
+	uint32_t headersLength = strlen(response) - 4;
+	uint32_t consumed = 0;
+	uint32_t i = 0;
+	int res = WS_HANDSHAKE_INCOMPLETE;
+	twWsHandshake h;
+	testHeaders headers;
+	/* A byte at a time, completing on exactly the last byte of the headers */
+	memset(&headers, 0, sizeof(headers));
+	twWsHandshake_Reset(&h);
+	for (i = 0; i < headersLength; i++) {
+		res = twWsHandshake_Parse(&h, response + i, 1, &consumed, onHeader, &headers);
+		CHECK(consumed == 1);
+		CHECK(res == (i == headersLength - 1 ? WS_HANDSHAKE_COMPLETE : WS_HANDSHAKE_INCOMPLETE));
+	}
+	CHECK(headers.count == 3 && headers.upgrade && headers.accept);
+	/* The frame that follows is left alone */
+	CHECK(twWsHandshake_Parse(&h, response + headersLength, 4, &consumed, onHeader, &headers) == WS_HANDSHAKE_COMPLETE && consumed == 0);
+	/* In one go, stopping at the frame */
+	memset(&headers, 0, sizeof(headers));
+	twWsHandshake_Reset(&h);
+	CHECK(twWsHandshake_Parse(&h, response, sizeof(response) - 1, &consumed, onHeader, &headers) == WS_HANDSHAKE_COMPLETE);
+	CHECK(consumed == headersLength && headers.count == 3);
+	/* Failures */
+	twWsHandshake_Reset(&h);
+	CHECK(twWsHandshake_Parse(&h, "HTTP/1.1 403 Forbidden\r\n\r\n", 26, &consumed, onHeader, &headers) == WS_HANDSHAKE_FAILED);
+	twWsHandshake_Reset(&h);
+	CHECK(twWsHandshake_Parse(&h, "HTTP/1.1 101 OK\r\nNo value\r\n\r\n", 29, &consumed, onHeader, &headers) == WS_HANDSHAKE_FAILED);
+}
+
+int main() {
+	testMask();
+	testUtf8();
+	testHandshake();
+	testFraming();
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}
@@ -6,6 +6,13 @@
 
 #include "twOSPort.h"
 #include "twWebsocket.h"
+#include "twWsSimd.h"
+#include "twWsTrace.h"
+#include "twWsHandshake.h"
+#include "twWsReconnect.h"
+#include "twWsSession.h"
+#include "twWsTransport.h"
+#include "twWsSlab.h"
 #include "twDefaultSettings.h"
 #include "twErrors.h"
 #include "twTls.h"
@@ -16,14 +23,25 @@
 #include <string.h>
 #include <stdlib.h> 
 #include <stdio.h>
+#ifndef WIN32
+#include <time.h>
+#endif
+#if defined(_MSC_VER)
+#include <windows.h>
+#endif
 
 #define NOT_SET -1
 #define TW_TRUE 1
 #define TW_FALSE 0
 
-#define WS_VERSION "13"
 #define WS_HEADER_MAX_SIZE 10
 #define WS_HEADER_MIN_SIZE 2
+/* Client frames carry a 4 byte mask key after the length */
+#define WS_SEND_HEADER_MAX_SIZE 14
+
+/* Data frames fill the send buffer by default, so control frames never wait long for a frame boundary */
+#define WS_SEND_FRAME_DEFAULT(ws) ((ws)->sendBufferSize - WS_SEND_HEADER_MAX_SIZE)
+
 #define KEY_LENGTH 16
 /* Base 64 encoded key - add the last 1 byte for null termination */
 #define ENCODED_KEY_LENGTH (KEY_LENGTH * 2)
@@ -37,32 +55,163 @@
 #define READ_TEXT_FRAME 2
 #define READ_BINARY_FRAME 3
 
+/* Progress reported by receiveFrame */
+#define FRAME_WOULD_BLOCK 0
+#define FRAME_PENDING 1
+#define FRAME_CONSUMED 2
+#define FRAME_DISPATCHED 3
+
+/*
+Pool of loaned message buffers.  Reference counts and the free list are
+guarded by mtx since buffers are usually released on another thread.
+*/
+typedef struct twWsBufferPool {
+	TW_MUTEX mtx;
+	twWsBuffer * freeList;
+	uint32_t freeCount;
+	uint32_t maxFree;
+	uint32_t maxBufferSize;
+	uint32_t outstanding;
+	char closed;
+} twWsBufferPool;
+
+/* Size of the per connection read-ahead buffer the socket is drained into */
+#ifndef WS_READ_AHEAD_SIZE
+#define WS_READ_AHEAD_SIZE 8192
+#endif
+
+/* Receive buffers start this small and double as bigger frames arrive */
+#ifndef WS_BUFFER_MIN_SIZE
+#define WS_BUFFER_MIN_SIZE 512
+#endif
+
+/* Time (in milliseconds) without a data message after which buffers are released, 0 to keep them */
+#ifndef WS_BUFFER_IDLE_TIME
+#define WS_BUFFER_IDLE_TIME 30000
+#endif
+
+/* Default limit on the size of a reassembled message */
+#ifndef WS_MAX_MESSAGE_SIZE
+#define WS_MAX_MESSAGE_SIZE 16777216
+#endif
+
+/* Largest payload that is coalesced with its header into a single write */
+#ifndef WS_SEND_BUFFER_SIZE
+#define WS_SEND_BUFFER_SIZE 16384
+#endif
+
+/* Inflated data is handed to a fragment callback in chunks of this size */
+#ifndef WS_INFLATE_CHUNK_SIZE
+#define WS_INFLATE_CHUNK_SIZE 16384
+#endif
+
+/* Keepalive pings carry this and their send time in hex, so the pong tells us the round trip time */
+#define WS_PING_PREFIX "twping:"
+#define WS_PING_PREFIX_LENGTH 7
+#define WS_KEEPALIVE_DEFAULT_MISSES 3
+
+/* Most queued messages packed into the send buffer per pass of the writer */
+#ifndef WS_ASYNC_SEND_BATCH
+#define WS_ASYNC_SEND_BATCH 64
+#endif
+
+/*
+Counters are bumped with relaxed atomics - they only need to be tear free
+for readers on other threads, not ordered with anything else
+*/
+#if defined(_MSC_VER)
+#define WS_STAT_ADD(ws, field, n) InterlockedExchangeAdd64((volatile LONGLONG *)&(ws)->stats.field, (LONGLONG)(n))
+#define WS_STAT_LOAD(p) ((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0))
+#define WS_STAT_STORE(p, v) InterlockedExchange64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#define WS_CAS_PTR(p, desired) (InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(desired), NULL) == NULL)
+#define WS_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#else
+#define WS_STAT_ADD(ws, field, n) __atomic_fetch_add(&(ws)->stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define WS_STAT_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define WS_STAT_STORE(p, v) __atomic_store_n(p, (uint64_t)(v), __ATOMIC_RELAXED)
+#define WS_CAS_PTR(p, desired) __extension__ ({ void * expected = NULL; \
+	__atomic_compare_exchange_n((void **)(p), &expected, (void *)(desired), FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define WS_LOAD_PTR(p) __atomic_load_n((void **)(p), __ATOMIC_ACQUIRE)
+#endif
+
+/* Live websockets, and the totals of deleted ones, for twWs_GetAggregateStats */
+static TW_MUTEX statsRegistryMutex = NULL;
+static twWs * statsRegistryHead = NULL;
+static twWsStats statsRetired;
+
 signed char isLittleEndian = NOT_SET;
 
 /**
 * Websocket helper functions
 **/
 int sendCtlFrame(twWs * ws, unsigned char type, char * msg);
-int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, char isFinal, char isText);
+int sendDataFrame(twWs * ws, char * msg, uint32_t length, char isContinuation, char isFinal, char isText, char isCompressed);
+int stageDataFrame(twWs * ws, char * msg, uint32_t length, char isContinuation, char isFinal, char isText, char isCompressed);
+int stageMessage(twWs * ws, char * buf, uint32_t length, char isText, uint32_t * framesSent);
+void drainSendQueue(void * arg);
+void beginDataSend(twWs * ws);
+void endDataSend(twWs * ws);
+int sendControlLane(twWs * ws);
+void resetKeepalive(twWs * ws);
+void recordPong(twWs * ws, const char * payload, uint32_t length);
+void lockSendFrame(twWs * ws);
+void countRead(twWs * ws, int32_t bytesRead, uint32_t requested);
+void readStats(const twWsStats * src, twWsStats * dst, char add);
+TW_MUTEX statsRegistry();
+void closeSendQueue(twWs * ws);
+int connectSocket(twWs * ws, uint32_t timeout);
+int connectTransport(twWs * ws, const char * addr, uint32_t timeout);
+void resetSocket(twWs * ws);
+void resetReceive(twWs * ws);
+void scheduleReconnect(twWs * ws);
+void reconnectLater(twWs * ws);
+int buildRequest(twWs * ws);
+int flushSendBuffer(twWs * ws);
+void flushExpiredCork(twWs * ws);
 int validateAcceptKey(twWs * ws, const char * header_value);
+int32_t readAheadFill(twWs * ws, uint32_t timeout);
+uint32_t readAheadTake(twWs * ws, char * dst, uint32_t length);
+void resetReceiveState(twWs * ws);
+int parseFrameHeader(twWs * ws);
+void pauseReceive(twWs * ws);
+int dispatchFrame(twWs * ws, char * status);
+int inflateFrame(twWs * ws, char * status);
+int receiveFrame(twWs * ws, uint32_t timeout, char * status);
+int growMessageBuffer(twWs * ws, uint32_t size);
+uint32_t growthSize(uint32_t size, uint32_t first, uint32_t needed, uint32_t max);
+int growFrameBuffer(twWs * ws, uint32_t size);
+void checkIdle(twWs * ws);
+void trimBuffers(twWs * ws);
+int failConnection(twWs * ws, enum close_status code, char * reason);
+twWsBufferPool * createBufferPool(uint32_t maxFree, uint32_t maxBufferSize);
+void closeBufferPool(twWsBufferPool * pool);
+twWsBuffer * acquireBuffer(twWsBufferPool * pool, uint32_t size);
+int growBuffer(twWsBuffer * buffer, uint32_t size, uint32_t max);
+void formatCloseMessage(char * msg, enum close_status code, char * reason);
+int writeFrame(twWs * ws, char * header, uint32_t headerLength, char * payload, uint32_t length);
+void nextMaskKey(twWs * ws, unsigned char * key);
+void seedMaskKeys(twWs * ws);
+uint64_t wsGetMicros();
 
 /**
 * Header callbacks
 **/
 
-int32_t ws_on_header_value(twWs * ws, char * header_name, char * header_value) {
+int32_t ws_on_header_value(void * arg, char * header_name, char * header_value) {
+	twWs * ws = (twWs *)arg;
 	if (!ws || !header_name || !header_value) {
 		TW_LOG(TW_DEBUG,"ws_on_header_value: NULL ws or data value");
 		return 1;
 	}
 	TW_LOG(TW_TRACE,"ws_on_header_value: Header->%s : %s", header_name, header_value);
 	if (strcmp(header_name, "upgrade") == 0) {
-		if (strcmp(header_value, "websocket") != 0) {
+		if (!twWsHandshake_HasToken(header_value, "websocket")) {
 			TW_LOG(TW_ERROR, "ws_on_header_value: Invalid 'upgrade' header: %s", header_value);
 			ws->connect_state = -1;
 		} else ws->connect_state |= RCVD_UPGRADE_HEADER;
 	} else if (strcmp(header_name, "connection") == 0) {
-		if (strcmp(header_value, "upgrade") != 0) {
+		/* A list of tokens, any of which may be capitalised */
+		if (!twWsHandshake_HasToken(header_value, "upgrade")) {
 			TW_LOG(TW_ERROR, "ws_on_header_value: Invalid 'connection' header: %s", header_value);
 			ws->connect_state = -1;
 		} else ws->connect_state |= RCVD_CONNECTION_HEADER;
@@ -71,7 +220,13 @@ int32_t ws_on_header_value(twWs * ws, char * header_name, char * header_value) {
 			TW_LOG(TW_ERROR, "ws_on_header_value: Invalid 'sec-websocket-accept' header: %s", header_value);
 			ws->connect_state = -1;
 		} else ws->connect_state |= VALID_WS_ACCEPT_KEY;
-	} 
+	} else if (strcmp(header_name, "sec-websocket-extensions") == 0) {
+		/* The server may only accept what we offered */
+		if (!ws->compressionEnabled || twWsDeflate_ParseResponse(&ws->deflateOffer, header_value, &ws->deflateAccepted)) {
+			TW_LOG(TW_ERROR, "ws_on_header_value: Invalid 'sec-websocket-extensions' header: %s", header_value);
+			ws->connect_state = -1;
+		} else ws->compressionAccepted = TRUE;
+	}
 	return 0;
 }
 int32_t ws_on_headers_complete(twWs * ws) {
@@ -82,8 +237,23 @@ int32_t ws_on_headers_complete(twWs * ws) {
 	}
 	state = ws->connect_state;
 	if (state != -1 && state & RCVD_UPGRADE_HEADER && state & RCVD_CONNECTION_HEADER && state & VALID_WS_ACCEPT_KEY) {
+		/* The context has to exist before anything can be received.  One kept from an earlier connection is reset rather than re-created. */
+		if (ws->compressionAccepted) {
+			int res = ws->deflateIdle ? twWsDeflate_Reset(ws->deflateIdle, &ws->deflateAccepted, ws->compressionMemLevel) :
+				twWsDeflate_Create(&ws->deflateAccepted, ws->compressionMemLevel, &ws->deflateIdle);
+			if (res) {
+				TW_LOG(TW_ERROR,"ws_on_headers_complete: Error creating compression context");
+				twWsDeflate_Delete(ws->deflateIdle);
+				ws->deflateIdle = NULL;
+				ws->isConnected = -1;
+				return 1;
+			}
+			ws->deflate = ws->deflateIdle;
+			ws->deflateIdle = NULL;
+		}
+		/* twWs_Connect marks us connected once the rest of its state is ready */
 		TW_LOG(TW_DEBUG,"ws_on_headers_complete: Websocket connected!");
-		ws->isConnected = TRUE;
+		resetKeepalive(ws);
 		return 0;
 	}
 	TW_LOG(TW_ERROR,"ws_on_headers_complete: Websocket connection failed.");
@@ -94,44 +264,169 @@ int32_t ws_on_headers_complete(twWs * ws) {
 /**
 * Helper functions
 **/
-int restartSocket(twWs * ws) {
-	/* Tear down the socket and create a new one */ 
-	int res = 0;
+void restartSocket(twWs * ws) {
+	/* 
+	Drop the connection after an error.  Callers may hold the send mutexes
+	but not recvMutex, so only the transport is touched here.  A receiver
+	may still be using the receive state, which is cleared under recvMutex
+	by the receive path, or by the next twWs_Connect, which also connects
+	the new socket.
+	*/
+	WS_STAT_ADD(ws, restarts, 1);
+	ws->isConnected = FALSE;
+	ws->receiveStale = TRUE;
+	twWsTransport_Close(ws->transport);
+	reconnectLater(ws);
+}
+
+int connectSocket(twWs * ws, uint32_t timeout) {
+	/*
+	Tear down the socket and connect a new one, to the cached address if
+	there is a policy.  TLS is always given the host name, which it needs
+	for SNI and to check the server's certificate, and does its own lookup.
+	*/
+	char addr[WS_RECONNECT_ADDRESS_SIZE];
+	int res = TW_OK;
+	resetSocket(ws);
+	if (!ws->reconnect || ws->connection) return connectTransport(ws, ws->host, timeout);
+	twWsReconnect_Resolve(ws->reconnect, ws->host, ws->port, addr, sizeof(addr));
+	res = connectTransport(ws, addr, timeout);
+	if (res) twWsReconnect_Forget(ws->reconnect, ws->host, ws->port);
+	return res;
+}
+
+int connectTransport(twWs * ws, const char * addr, uint32_t timeout) {
+	/*
+	Over TLS, offer the server the last session it gave any websocket for
+	this host and port, or failing that the last one it gave us, so it can
+	skip the full handshake.  Sessions are kept when an attempt fails -
+	while a server is down is exactly when they will be wanted.
+	*/
+#ifdef WS_TLS_RESUMPTION
+	char session[WS_SESSION_MAX_SIZE];
+	uint32_t offered = 0;
+	uint32_t length = 0;
+	int res = TW_OK;
+	if (!ws->connection) return twWsTransport_Connect(ws->transport, addr, ws->port, timeout);
+	offered = twWsSession_Load(ws->host, ws->port, session, sizeof(session));
+	if (!offered && ws->sessionLength) {
+		memcpy(session, ws->session, ws->sessionLength);
+		offered = ws->sessionLength;
+	}
+	ws->sessionResumed = FALSE;
+	WS_TLS_SET_SESSION(ws->connection, session, offered);
+	res = twWsTransport_Connect(ws->transport, addr, ws->port, timeout);
+	if (res) return res;
+	ws->sessionResumed = offered && WS_TLS_SESSION_RESUMED(ws->connection, session, offered);
+	length = WS_TLS_GET_SESSION(ws->connection, session, sizeof(session));
+	/* Connections without TLS have no session and count as neither */
+	if (ws->sessionResumed) WS_STAT_ADD(ws, tlsResumed, 1);
+	else if (length) WS_STAT_ADD(ws, tlsFullHandshakes, 1);
+	if (length) {
+		twWsSession_Store(ws->host, ws->port, session, length);
+		if (!ws->session) ws->session = (char *)TW_CALLOC(WS_SESSION_MAX_SIZE, 1);
+		if (ws->session) {
+			memcpy(ws->session, session, length);
+			ws->sessionLength = length;
+		}
+		TW_LOG(TW_DEBUG,"connectTransport: %s TLS session with %s:%d", ws->sessionResumed ? "Resumed" : "Started new", ws->host, ws->port);
+	}
+	return TW_OK;
+#else
+	return twWsTransport_Connect(ws->transport, addr, ws->port, timeout);
+#endif
+}
+
+void scheduleReconnect(twWs * ws) {
+	uint32_t delay = twWsReconnect_Backoff(ws->reconnect, ws->reconnectFailures);
+	ws->nextReconnect = wsGetMicros() + (uint64_t)delay * 1000;
+	TW_LOG(TW_DEBUG,"scheduleReconnect: Next attempt to connect to %s:%d in %u msec", ws->host, ws->port, delay);
+}
+
+void reconnectLater(twWs * ws) {
+	/*
+	A policy managed connection has dropped, however it happened.  Hold the
+	next twWs_Connect back by the jittered backoff, so a server that restarts
+	doesn't have its whole fleet back at once.  Failures during twWs_Connect
+	were scheduled when the attempt started.
+	*/
+	if (ws->reconnect && ws->nextReconnect <= wsGetMicros()) scheduleReconnect(ws);
+}
+
+void resetSocket(twWs * ws) {
+	/* Forget everything about the old connection.  Caller must hold recvMutex and sendMessageMutex. */
+	WS_STAT_ADD(ws, restarts, 1);
 	ws->connect_state = 0;
 	ws->isConnected = FALSE;
-    res = twTlsClient_Reconnect(ws->connection, ws->host, ws->port);
-	ws->frameBufferPtr = ws->frameBuffer;
-	ws->headerPtr = ws->ws_header;
-    return res;
+	resetReceive(ws);
+	/* Anything still staged belongs to the old connection.  A sender may be writing it out. */
+	twMutex_Lock(ws->sendFrameMutex);
+	ws->sendBufferUsed = 0;
+	twMutex_Unlock(ws->sendFrameMutex);
+	twMutex_Lock(ws->ctlMutex);
+	ws->ctlCount = 0;
+	twMutex_Unlock(ws->ctlMutex);
+}
+
+void resetReceive(twWs * ws) {
+	/* Forget the message in progress and anything read ahead.  Caller must hold recvMutex. */
+	resetReceiveState(ws);
+	ws->messageType = READ_HEADER;
+	ws->messageLength = 0;
+	twWsGovernor_Release(&ws->receiveClaim);
+	ws->messageCompressed = FALSE;
+	ws->fragmentStarted = FALSE;
+	ws->utf8State = 0;
+	if (ws->loanedBuffer) {
+		twWs_ReleaseBuffer(ws->loanedBuffer);
+		ws->loanedBuffer = NULL;
+	}
+	ws->readHead = 0;
+	ws->readCount = 0;
+	ws->receiveStale = FALSE;
 }
 
 /**
 *	Context manipulation functions
 **/
-int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, char * gatewayName, uint32_t messageChunkSize, uint16_t frameSize, twWs ** entity) {
+int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, char * gatewayName, uint32_t messageChunkSize, uint32_t frameSize, twWs ** entity) {
 	int err = TW_UNKNOWN_ERROR;
+	twWsTransport * transport = NULL;
+
+	/* Validate our host/port */
+	if (!host || !port || !resource || !api_key || !entity) {
+		TW_LOG(TW_ERROR, "twWs_Create: Missing required parameters");
+		return TW_INVALID_PARAM;
+	}
+	/* Create our connection  */
+	err = twWsTransport_CreateTls(host, port, &transport);
+	if (err) {
+		TW_LOG(TW_ERROR, "twWs_Create: Error creating BSD socket to be used for the websocket");
+		return err;
+	}
+	return twWs_CreateWithTransport(transport, host, port, resource, api_key, gatewayName, messageChunkSize, frameSize, entity);
+}
+
+int twWs_CreateWithTransport(struct twWsTransport * transport, char * host, uint16_t port, char * resource, char * api_key, char * gatewayName, uint32_t messageChunkSize, uint32_t frameSize, twWs ** entity) {
 	twWs * ws = NULL;
 
 	TW_LOG(TW_DEBUG, "twWs_Create: Initializing Websocket Client for %s:%d/%s", host, port, resource);
 
 	/* Validate our host/port */
-	if (!host || !port || !resource || !api_key || !entity) {
+	if (!transport || !host || !resource || !api_key || !entity) {
 		TW_LOG(TW_ERROR, "twWs_Create: Missing required parameters");
+		twWsTransport_Delete(transport);
 		return TW_INVALID_PARAM;
 	}
 	ws = (twWs *)TW_CALLOC(sizeof(twWs), 1);
 	if (!ws) {
 		TW_LOG(TW_ERROR, "twWs_Create: Error allocating websocket struct");
+		twWsTransport_Delete(transport);
 		return TW_ERROR_ALLOCATING_MEMORY;
 	}
 	ws->isConnected = FALSE;
-	/* Create our connection  */
-	err = twTlsClient_Create(host, port, 0, &ws->connection);
-	if (err) {
-		TW_LOG(TW_ERROR, "twWs_Create: Error creating BSD socket to be used for the websocket");
-		twWs_Delete(ws);
-		return err;
-	}
+	ws->transport = transport;
+	ws->connection = transport->tls;
 	ws->port = port;
 	/* Create copies of any strings passed in */
 	ws->host = duplicateString(host);
@@ -164,7 +459,9 @@ int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, cha
 	ws->sendMessageMutex = twMutex_Create();
 	ws->sendFrameMutex = twMutex_Create();
 	ws->recvMutex = twMutex_Create();
-	if (!ws->sendMessageMutex || !ws->recvMutex || !ws->sendFrameMutex) {
+	ws->ctlMutex = twMutex_Create();
+	ws->keepaliveMutex = twMutex_Create();
+	if (!ws->sendMessageMutex || !ws->recvMutex || !ws->sendFrameMutex || !ws->ctlMutex || !ws->keepaliveMutex) {
 		TW_LOG(TW_ERROR, "Error allocating or creating mutex");
 		twWs_Delete(ws);
 		return TW_ERROR_CREATING_MTX;
@@ -177,14 +474,32 @@ int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, cha
 	}	
 	ws->messageChunkSize = messageChunkSize;
 	ws->frameSize = frameSize;
-	ws->frameBuffer = (char *)TW_CALLOC((frameSize + WS_HEADER_MAX_SIZE + 1), 1);
-	if (!ws->frameBuffer) {
-		TW_LOG(TW_ERROR, "twWs_Create: Error allocating frame buffer storage for websocket");
-		twWs_Delete(ws);
-		return TW_ERROR_ALLOCATING_MEMORY;
-	}	
-	ws->frameBufferPtr = ws->frameBuffer;
+	/* 
+	Buffers are allocated when traffic first needs them, not here, and
+	released again once the connection goes quiet, so idle connections
+	cost next to nothing
+	*/
+	ws->messageType = READ_HEADER;
+	ws->maxMessageSize = frameSize > WS_MAX_MESSAGE_SIZE ? frameSize : WS_MAX_MESSAGE_SIZE;
+	ws->readBufferSize = WS_READ_AHEAD_SIZE;
+	ws->sendBufferSize = (frameSize < WS_SEND_BUFFER_SIZE ? frameSize : WS_SEND_BUFFER_SIZE) + WS_SEND_HEADER_MAX_SIZE;
+	ws->sendFrameLimit = WS_SEND_FRAME_DEFAULT(ws);
+	ws->bufferIdleTime = WS_BUFFER_IDLE_TIME;
+	ws->lastDataReceived = wsGetMicros();
+	ws->headerPtr = ws->ws_header;
 	ws->bytesNeeded = WS_HEADER_MIN_SIZE;
+	seedMaskKeys(ws);
+	/* Register for the aggregate counters */
+	if (!statsRegistry()) {
+		TW_LOG(TW_ERROR, "twWs_Create: Error creating statistics mutex");
+		twWs_Delete(ws);
+		return TW_ERROR_CREATING_MTX;
+	}
+	twMutex_Lock(statsRegistry());
+	ws->statsNext = statsRegistryHead;
+	if (statsRegistryHead) statsRegistryHead->statsPrev = ws;
+	statsRegistryHead = ws;
+	twMutex_Unlock(statsRegistry());
 	*entity = ws;
 	return TW_OK;
 }
@@ -194,35 +509,56 @@ int twWs_Delete(twWs * ws) {
 		TW_LOG(TW_ERROR, "twWs_Delete: NULL ws pointer"); 
 		return TW_INVALID_PARAM; 
 	}
-	if (ws->connection) {
-		twTlsClient_Delete(ws->connection); 
+	/* Stop the writer before anything it uses goes away */
+	if (ws->sendQueue) closeSendQueue(ws);
+	/* Fold our counters into the totals of deleted websockets */
+	if (WS_LOAD_PTR(&statsRegistryMutex)) {
+		twMutex_Lock(statsRegistry());
+		if (ws->statsPrev || statsRegistryHead == ws) {
+			if (ws->statsPrev) ws->statsPrev->statsNext = ws->statsNext;
+			else statsRegistryHead = ws->statsNext;
+			if (ws->statsNext) ws->statsNext->statsPrev = ws->statsPrev;
+			readStats(&ws->stats, &statsRetired, TRUE);
+		}
+		twMutex_Unlock(statsRegistry());
 	}
+	twWsTransport_Delete(ws->transport);
+	twWsGovernor_Release(&ws->receiveClaim);
 	TW_FREE(ws->api_key);
 	TW_FREE(ws->host);
-	TW_FREE(ws->frameBuffer);
-/*TW_FREE(ws->messageBuffer); */
+	twWsSlab_Free(ws->frameBuffer);
+	twWsSlab_Free(ws->readBuffer);
+	twWsSlab_Free(ws->sendBuffer);
+	TW_FREE(ws->session);
+	twWsSlab_Free(ws->messageBuffer);
+	if (ws->loanedBuffer) twWs_ReleaseBuffer(ws->loanedBuffer);
+	/* Buffers still loaned out keep the pool alive until they are released */
+	if (ws->bufferPool) closeBufferPool(ws->bufferPool);
+	twWsDeflate_Delete(ws->deflate);
+	twWsDeflate_Delete(ws->deflateIdle);
 	TW_FREE(ws->resource);
 /*TW_FREE(ws->parser); */
 /*TW_FREE(ws->settings); */
 	TW_FREE(ws->security_key);
+	twWsSlab_Free(ws->request);
 	if (ws->gatewayName) TW_FREE(ws->gatewayName);
 	if (ws->gatewayType) TW_FREE(ws->gatewayType);
 	twMutex_Delete(ws->sendMessageMutex);
 	twMutex_Delete(ws->sendFrameMutex);
 	twMutex_Delete(ws->recvMutex);
+	twMutex_Delete(ws->ctlMutex);
+	twMutex_Delete(ws->keepaliveMutex);
 	TW_FREE(ws);
 	return TW_OK;
 }
 
-#define REQ_SIZE 512
 int twWs_Connect(twWs * ws, uint32_t timeout) {
 
 	int32_t i = 0;
 	int32_t bytesWritten = 0;
 	int32_t bytesRead = 0;
+	int res = WS_HANDSHAKE_INCOMPLETE;
 	char key[KEY_LENGTH];
-	char * req = NULL;
-	char max_frame_size[16];
 	DATETIME timeouttime = 0;
 	DATETIME now = 0;
 	unsigned long encodedlen = ENCODED_KEY_LENGTH;
@@ -236,9 +572,41 @@ int twWs_Connect(twWs * ws, uint32_t timeout) {
 		return TW_OK; 
 	}
 
+	/*
+	Receivers are held off until the connection is ready for them - the
+	handshake is read through the same buffers they use.  recvMutex comes
+	first, as it does when a message callback sends.
+	*/
+	twMutex_Lock(ws->recvMutex);
 	twMutex_Lock(ws->sendMessageMutex);
+	if (ws->reconnect) {
+		/* Hold off until the backoff has passed and the budget has room */
+		uint32_t wait = 0;
+		if (wsGetMicros() < ws->nextReconnect) {
+			twMutex_Unlock(ws->sendMessageMutex);
+			twMutex_Unlock(ws->recvMutex);
+			return TW_WEBSOCKET_RECONNECT_BACKOFF;
+		}
+		if (!twWsReconnect_TakeAttempt(ws->reconnect, &wait)) {
+			TW_LOG(TW_DEBUG,"twWs_Connect: Reconnect budget spent.  Next attempt in %u msec", wait);
+			ws->nextReconnect = wsGetMicros() + (uint64_t)wait * 1000;
+			twMutex_Unlock(ws->sendMessageMutex);
+			twMutex_Unlock(ws->recvMutex);
+			return TW_WEBSOCKET_RECONNECT_BACKOFF;
+		}
+		/* Assume this attempt fails, so every way out of here leaves the next one scheduled */
+		scheduleReconnect(ws);
+		ws->reconnectFailures++;
+	}
+	WS_STAT_ADD(ws, connectAttempts, 1);
 	ws->connect_state = 0;
-	ws->read_state = READ_HEADER;
+	/* Compression is renegotiated on every connection, but the context is kept to be reset if it is accepted again */
+	if (ws->deflate) {
+		twWsDeflate_Delete(ws->deflateIdle);
+		ws->deflateIdle = ws->deflate;
+		ws->deflate = NULL;
+	}
+	ws->compressionAccepted = FALSE;
 
 	/* Create the random key */
 	now = twGetSystemTime(TRUE);
@@ -251,188 +619,131 @@ int twWs_Connect(twWs * ws, uint32_t timeout) {
 	if (!ws->security_key) {
 		TW_LOG(TW_ERROR,"twWs_Connect: Error allocating security key buffer");
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		return TW_ERROR_ALLOCATING_MEMORY;
 	} 
 	base64_encode((const unsigned char *)key, KEY_LENGTH, ws->security_key, &encodedlen);
+	/* Fresh mask keys for every connection */
+	seedMaskKeys(ws);
 
-	/* Form the HTTP request */
-	req = (char *)TW_CALLOC(REQ_SIZE, 1);
-	if (!req) {
-		TW_LOG(TW_ERROR,"twWs_Connect: Error allocating request buffer");
+	/* The request only changes with the key, so it is built once and the key dropped in */
+	if (!ws->requestLength && buildRequest(ws)) {
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		return TW_ERROR_ALLOCATING_MEMORY;
-	} 
-	strncpy(req,"GET ", REQ_SIZE - 1);
-	strncat(req, ws->resource, REQ_SIZE - strlen(req) - 1);
-	strncat(req, " HTTP/1.1\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "User-Agent: ThingWorx C SDK\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Upgrade: websocket\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Connection: Upgrade\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Host: ", REQ_SIZE - strlen(req) - 1);
-	strncat(req, ws->host, REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Sec-WebSocket-Version: ", REQ_SIZE - strlen(req) - 1);
-	strncat(req, WS_VERSION, REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Sec-WebSocket-Key: ", REQ_SIZE - strlen(req) - 1);
-	strncat(req, (const char *)ws->security_key, REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "Max-Frame-Size: ", REQ_SIZE - strlen(req) - 1);
-        sprintf(max_frame_size, "%u", ws->frameSize);
-	strncat(req, max_frame_size, REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "appKey: ", REQ_SIZE - strlen(req) - 1);
-	strncat(req, ws->api_key, REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
-	strncat(req, "\r\n", REQ_SIZE - strlen(req) - 1);
+	}
+	memcpy(ws->request + ws->requestKeyOffset, ws->security_key, WS_HANDSHAKE_KEY_LENGTH);
 	
 	/* Connect the underlying socket and send the request */
-	if (restartSocket(ws)) {
+	if (connectSocket(ws, timeout)) {
 		TW_LOG(TW_ERROR,"twWs_Connect: Error restarting socket.  Error %d", twSocket_GetLastError());
-		TW_FREE (req);
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		return TW_SOCKET_INIT_ERROR;
 	}
-	bytesWritten = twTlsClient_Write(ws->connection, req, strlen(req), 100);
+	bytesWritten = twWsTransport_Write(ws->transport, ws->request, ws->requestLength, 100);
 	if (bytesWritten > 0) TW_LOG(TW_TRACE, "twWs_Connect: Connected to %s:%d", ws->host, ws->port);
 	else {
 		TW_LOG(TW_ERROR,"twWs_Connect: No bytes written.  Error %d", twSocket_GetLastError());
-		TW_FREE (req);
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		restartSocket(ws);
 		return TW_ERROR_WRITING_TO_SOCKET;
 	} 
-	/* Done with the request */
-	TW_LOG(TW_TRACE, "twWs_Connect: Sent request:\n%s", req);
-	TW_FREE(req);
-	/* Get the response */
+	TW_LOG(TW_TRACE, "twWs_Connect: Sent request:\n%s", ws->request);
+	/* 
+	Get the response.  It is read into the read-ahead buffer and parsed in
+	place, so anything the server sends after the headers is already where
+	the frame decoder looks for it.
+	*/
+	twWsHandshake_Reset(&ws->handshake);
 	timeouttime = twGetSystemTime(TRUE);
 	timeouttime = twAddMilliseconds(timeouttime,timeout);
 	now = twGetSystemTime(TRUE);
-	while (ws->connect_state >= 0 && ws->isConnected == FALSE && twTimeGreaterThan(timeouttime, now)) {
-		bytesRead = twTlsClient_Read(ws->connection, ws->frameBufferPtr, ws->frameSize - (ws->frameBufferPtr - ws->frameBuffer), twcfg.socket_read_timeout);
+	while (res == WS_HANDSHAKE_INCOMPLETE && twTimeGreaterThan(timeouttime, now)) {
+		bytesRead = readAheadFill(ws, twcfg.socket_read_timeout);
 		if (bytesRead < 0) {
 			/* Something is wrong with the socket - give up */
-			ws->frameBufferPtr = ws->frameBuffer;
 			TW_LOG(TW_ERROR,"twWs_Connect: Error reading from socket.  Error: %d", twSocket_GetLastError());
 			twMutex_Unlock(ws->sendMessageMutex);
+			twMutex_Unlock(ws->recvMutex);
 			return TW_ERROR_INITIALIZING_WEBSOCKET;
 		}
-		/* Try to parse the response */
-		if (bytesRead) {
-			char respCode[8];
-			char * header_name = NULL;
-			char * header_value = NULL;
-			char * line = NULL;
-			char * headEnd = NULL;
-			char gotName = FALSE;
-			memset(respCode, 0, 8);
-			TW_LOG(TW_TRACE,"twWs_Connect: Got Response from Server:\n\n%s\n", ws->frameBuffer);
-			/* Increment our pointer and check for overrun */
-			ws->frameBufferPtr = ws->frameBufferPtr + bytesRead;
-			if (ws->frameBufferPtr - ws->frameBuffer > ws->frameSize) {
-				ws->frameBufferPtr = ws->frameBuffer;
-				TW_LOG(TW_ERROR,"twWs_Connect: Connect response too big. Websocket connect failed");
-				twMutex_Unlock(ws->sendMessageMutex);
-				return TW_ERROR_INITIALIZING_WEBSOCKET;
-			}
-			/* Check to see if we got the entire header */
-			headEnd = strstr(ws->frameBuffer, "\r\n\r\n");
-			if (!headEnd) {
-				TW_LOG(TW_TRACE,"twWs_Connect: Didn't get the entire header - attempting to read more");
-				continue;
-			}
-			/* Look for the Switching Protocols response */
-			strncpy(respCode, &ws->frameBuffer[9], 3);
-			if (strcmp(respCode, "101") != 0) {
-				/* Something is wrong with the socket - give up */
-				ws->frameBufferPtr = ws->frameBuffer;
-				TW_LOG(TW_ERROR,"twWs_Connect: Error initializing web socket.  Response code: %s", respCode);
-				twMutex_Unlock(ws->sendMessageMutex);
-				return TW_ERROR_INITIALIZING_WEBSOCKET;
-			}
-			/* Look for the required headers.  Beginning of headers is after first \r\n */
-			line = strstr(ws->frameBuffer, "\r\n");
-			line += 2;
-			headEnd += 2;
-			/* 
-			Walk through the line separate name from value.  While we are
-			at it, convert the name to lowercase, and remove whitespace.
-			*/
-			header_name = line;
-			while (line < headEnd) {
-				if (!gotName) {
-					/* Convert to lower case */
-					if (*line >= 'A' && *line <= 'Z') *line = *line + 32;
-					/* Find the end of the header name - either whitespace or : */
-					if (*line == ' ' || *line == '\t' || *line == ':') {
-						*line = 0x00;
-						gotName = TRUE;
-					}
-					line++;
-					continue;
-				} else {
-					/* Get rid of any leading whitespace*/
-					if (!header_value && (*line == '\r' || *line == '\n' || *line == ' ' || *line == '\t')) {
-						*line = 0x00;
-						line++;
-						continue;
-					} 
-					/* Mark the begininng of the value */
-					if (!header_value) {
-						header_value = line; 
-					} 
-					/* Fine the end of the value */
-					if (*line == '\r' || *line == '\n') {
-						*line = 0x00;
-						/* Process this name/value pair */
-						if (ws_on_header_value(ws, header_name, header_value)) {
-							ws->frameBufferPtr = ws->frameBuffer;
-							TW_LOG(TW_WARN,"twWs_Connect: Error in HTTP response header: %s : %s.", header_name, header_value);
-							twMutex_Unlock(ws->sendMessageMutex);
-							return TW_ERROR_INITIALIZING_WEBSOCKET;
-						}	
-						/* Advance to the next line */
-						while (line < headEnd && (*line == 0x00 || *line == '\r' || *line == '\n' || *line == ' ' || *line == '\t')) line++;
-						gotName = FALSE;
-						header_name = line;
-						header_value = NULL;
-					} else {
-						/* Advance to the next character */
-						line++;
-					}
-					continue;
-				}
-			}
-			/* Reset the frame buffer pointer now */
-			ws->frameBufferPtr = ws->frameBuffer;
-			/* See if we got what we needed */
-			if (ws_on_headers_complete(ws)) {
-				TW_LOG(TW_WARN,"twWs_Connect: Error in HTTP response headers. Websocket connection failed");
-				twMutex_Unlock(ws->sendMessageMutex);
-				return TW_ERROR_INITIALIZING_WEBSOCKET;
-			}
+		/* Parse what we have, a contiguous piece of the ring at a time */
+		while (res == WS_HANDSHAKE_INCOMPLETE && ws->readCount) {
+			uint32_t consumed = 0;
+			uint32_t chunk = ws->readBufferSize - ws->readHead;
+			if (chunk > ws->readCount) chunk = ws->readCount;
+			res = twWsHandshake_Parse(&ws->handshake, ws->readBuffer + ws->readHead, chunk, &consumed, ws_on_header_value, ws);
+			ws->readHead = (ws->readHead + consumed) % ws->readBufferSize;
+			ws->readCount -= consumed;
+			if (!ws->readCount) ws->readHead = 0;
 		}
 		now = twGetSystemTime(TRUE);
 	}
-	if (twTimeGreaterThan(now, timeouttime)) {
+	if (res == WS_HANDSHAKE_FAILED) {
+		TW_LOG(TW_WARN,"twWs_Connect: Error in HTTP response. Websocket connection failed");
+		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
+		restartSocket(ws);
+		return TW_ERROR_INITIALIZING_WEBSOCKET;
+	}
+	if (res != WS_HANDSHAKE_COMPLETE) {
 		/* We timed out */
 		TW_LOG(TW_ERROR,"twWs_Connect: Timed out trying to connect");
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		return TW_TIMEOUT_INITIALIZING_WEBSOCKET;
 	}
-	if (!(ws->isConnected == TRUE)) {
-		TW_LOG(TW_ERROR,"twWs_Connect: Error trying to connect");
+	/* See if we got what we needed */
+	if (ws_on_headers_complete(ws)) {
+		TW_LOG(TW_WARN,"twWs_Connect: Error in HTTP response headers. Websocket connection failed");
 		twMutex_Unlock(ws->sendMessageMutex);
+		twMutex_Unlock(ws->recvMutex);
 		restartSocket(ws);
 		return TW_ERROR_INITIALIZING_WEBSOCKET;
 	}
+	if (ws->readCount) TW_LOG(TW_DEBUG,"twWs_Connect: Server sent %u bytes of frames with its response", ws->readCount);
 	TW_LOG(TW_FORCE,"twWs_Connect: Websocket connected!");
+	WS_STAT_ADD(ws, connects, 1);
+	ws->reconnectFailures = 0;
+	ws->nextReconnect = 0;
+	/* Only now can receivers go ahead, and they may have to for the callback to get the replies it is waiting on */
+	ws->isConnected = TRUE;
+	twMutex_Unlock(ws->recvMutex);
 	if (ws->on_ws_connected) (ws->on_ws_connected)(ws);
 	twMutex_Unlock(ws->sendMessageMutex);
-	ws->headerPtr = ws->ws_header;
-	ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-	ws->read_state = READ_HEADER;
+	return TW_OK;
+}
+
+int buildRequest(twWs * ws) {
+	/* Size the request, then write it.  Caller must hold sendMessageMutex. */
+	char extensions[128];
+	char * ext = NULL;
+	char * tmp = NULL;
+	uint32_t length = 0;
+	if (ws->compressionEnabled && twWsDeflate_FormatOffer(&ws->deflateOffer, extensions, sizeof(extensions)) == TW_OK) ext = extensions;
+	length = twWsHandshake_FormatRequest(NULL, 0, ws->resource, ws->host, ws->frameSize, ext, ws->api_key, NULL);
+	tmp = (char *)twWsSlab_Realloc(ws->request, 0, length + 1, NULL);
+	if (!tmp) {
+		TW_LOG(TW_ERROR,"twWs_Connect: Error allocating request buffer");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	ws->request = tmp;
+	ws->requestLength = twWsHandshake_FormatRequest(ws->request, length + 1, ws->resource, ws->host, ws->frameSize, ext, ws->api_key, &ws->requestKeyOffset);
+	return TW_OK;
+}
+
+int twWs_SetReconnectPolicy(twWs * ws, twWsReconnect * policy) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_SetReconnectPolicy: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->sendMessageMutex);
+	ws->reconnect = policy;
+	ws->reconnectFailures = 0;
+	ws->nextReconnect = 0;
+	twMutex_Unlock(ws->sendMessageMutex);
 	return TW_OK;
 }
 
@@ -440,8 +751,57 @@ char twWs_IsConnected(twWs * ws) {
 	return ((ws && ws->isConnected == TRUE) ? TRUE : FALSE); 
 }
 
+void formatCloseMessage(char * msg, enum close_status code, char * reason) {
+	/* Close frame payload - 2 byte status code followed by the reason.  msg must hold 64 bytes */
+	msg[0] = 0x03;
+	switch (code) {
+		case NORMAL_CLOSE:
+			strncpy(msg + 2,"Normal Close",60);
+			msg[1] = (char)0xE8;
+			break;
+		case GOING_TO_SLEEP:
+			strncpy(msg + 2,"Going to Sleep",60);
+			msg[1] = (char)0xE9;
+			break;
+		case PROTOCOL_ERROR:
+			strncpy(msg + 2,"Protocol Error",60);
+			msg[1] = (char)0xEA;
+			break;
+		case UNSUPPORTED_DATA_TYPE:
+			strncpy(msg + 2,"Unsupported Data Type",60);
+			msg[1] = (char)0xEB;
+			break;
+		case INVALID_DATA:
+			strncpy(msg + 2,"Invalid Data",60);
+			msg[1] = (char)0xEF;
+			break;
+		case POLICY_VIOLATION:
+			strncpy(msg + 2,"Policy Violation",60);
+			msg[1] = (char)0xF0;
+			break;
+		case FRAME_TOO_LARGE:
+			strncpy(msg + 2,"Frame too large",60);
+			msg[1] = (char)0xF1;
+			break;
+		case NO_EXTENSION_FOUND:
+			strncpy(msg + 2,"No extension found",60);
+			msg[1] = (char)0xF2;
+			break;
+		case UNEXPECTED_CONDITION:
+		default:
+			strncpy(msg + 2,"Unexpected Condition", 60);
+			msg[1] = (char)0xF3;
+			break;
+	}
+	if (reason) {
+		strncat(msg + 2, " ", 61 - strlen(msg + 2));
+		strncat(msg + 2, reason, 61 - strlen(msg + 2));
+	}
+}
+
 int twWs_Disconnect(twWs * ws, enum close_status code, char * reason) {
 	char msg[64];
+	msg[0] = 0x00;
 	if (!ws) { 
 		TW_LOG(TW_ERROR, "twWs_Disconnect: NULL ws pointer"); 
 		return TW_INVALID_PARAM; 
@@ -450,52 +810,12 @@ int twWs_Disconnect(twWs * ws, enum close_status code, char * reason) {
 	TW_LOG(TW_DEBUG, "Disconnect called.  Code: %d, Reason: %s", code, reason);
 	if (code != SERVER_CLOSED) {
 		/* Send a close to the server */
-		msg[0] = 0x03;
-		switch (code) {
-			case NORMAL_CLOSE:
-				strncpy(msg + 2,"Normal Close",60);
-				msg[1] = (char)0xE8;
-				break;
-			case GOING_TO_SLEEP:
-				strncpy(msg + 2,"Going to Sleep",60);
-				msg[1] = (char)0xE9;
-				break;
-			case PROTOCOL_ERROR:
-				strncpy(msg + 2,"Protocol Error",60);
-				msg[1] = (char)0xEA;
-				break;
-			case UNSUPPORTED_DATA_TYPE:
-				strncpy(msg + 2,"Unsupported Data Type",60);
-				msg[1] = (char)0xEB;
-				break;
-			case INVALID_DATA:
-				strncpy(msg + 2,"Invalid Data",60);
-				msg[1] = (char)0xEF;
-				break;
-			case POLICY_VIOLATION:
-				strncpy(msg + 2,"Policy Violation",60);
-				msg[1] = (char)0xF0;
-				break;
-			case FRAME_TOO_LARGE:
-				strncpy(msg + 2,"Frame too large",60);
-				msg[1] = (char)0xF1;
-				break;
-			case NO_EXTENSION_FOUND:
-				strncpy(msg + 2,"No extension found",60);
-				msg[1] = (char)0xF2;
-				break;
-			case UNEXPECTED_CONDITION:
-			default:
-				strncpy(msg + 2,"Unexpected Condition", 60);
-				msg[1] = (char)0xF3;
-				break;
-		}
-		strncat(msg + 2, " ", 60);
-		strncat(msg + 2, reason, 60);
+		formatCloseMessage(msg, code, reason);
 		sendCtlFrame(ws, 0x08, msg);
 	}
 	ws->isConnected = FALSE;
-	twTlsClient_Close(ws->connection);
+	twWsTransport_Close(ws->transport);
+	reconnectLater(ws);
 	if (ws && ws->on_ws_close && msg[0] == 0x03) ws->on_ws_close(ws, msg + 2, strlen(msg + 2));
 	return TW_OK;
 }
@@ -554,257 +874,253 @@ int twWs_RegisterPongCallback(twWs * ws, ws_data_cb cb) {
 	return TW_OK;
 }
 
+int twWs_RegisterFragmentCallback(twWs * ws, ws_fragment_cb cb) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_RegisterFragmentCallback: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->recvMutex);
+	ws->on_ws_fragment = cb;
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
+}
+
+int twWs_EnableLoanedBuffers(twWs * ws, ws_buffer_cb cb, uint32_t maxPooled) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_EnableLoanedBuffers: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->recvMutex);
+	if (cb && !ws->bufferPool) {
+		/* Buffers that grew past a frame are freed rather than pooled */
+		ws->bufferPool = createBufferPool(maxPooled, ws->frameSize);
+		if (!ws->bufferPool) {
+			TW_LOG(TW_ERROR, "twWs_EnableLoanedBuffers: Error allocating buffer pool");
+			twMutex_Unlock(ws->recvMutex);
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+	}
+	if (ws->bufferPool) {
+		twMutex_Lock(ws->bufferPool->mtx);
+		ws->bufferPool->maxFree = maxPooled;
+		twMutex_Unlock(ws->bufferPool->mtx);
+	}
+	ws->on_ws_buffer = cb;
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
+}
+
+int twWs_RetainBuffer(twWsBuffer * buffer) {
+	if (!buffer || !buffer->pool) { 
+		TW_LOG(TW_ERROR, "twWs_RetainBuffer: NULL buffer pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(buffer->pool->mtx);
+	buffer->refCount++;
+	twMutex_Unlock(buffer->pool->mtx);
+	return TW_OK;
+}
+
+int twWs_ReleaseBuffer(twWsBuffer * buffer) {
+	twWsBufferPool * pool = NULL;
+	char freePool = FALSE;
+	if (!buffer || !buffer->pool) { 
+		TW_LOG(TW_ERROR, "twWs_ReleaseBuffer: NULL buffer pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	pool = buffer->pool;
+	twMutex_Lock(pool->mtx);
+	if (--buffer->refCount > 0) {
+		twMutex_Unlock(pool->mtx);
+		return TW_OK;
+	}
+	pool->outstanding--;
+	if (!pool->closed && pool->freeCount < pool->maxFree && buffer->size <= pool->maxBufferSize) {
+		buffer->next = pool->freeList;
+		pool->freeList = buffer;
+		pool->freeCount++;
+		buffer = NULL;
+	}
+	freePool = pool->closed && !pool->outstanding;
+	twMutex_Unlock(pool->mtx);
+	if (buffer) {
+		twWsSlab_Free(buffer->data);
+		TW_FREE(buffer);
+	}
+	if (freePool) {
+		twMutex_Delete(pool->mtx);
+		TW_FREE(pool);
+	}
+	return TW_OK;
+}
+
+int twWs_SetMaxMessageSize(twWs * ws, uint32_t size) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_SetMaxMessageSize: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (size < ws->frameSize) {
+		TW_LOG(TW_ERROR, "twWs_SetMaxMessageSize: Max message size MUST be greater than or equal to max websocket frame size");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(ws->recvMutex);
+	ws->maxMessageSize = size;
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
+}
+
+int twWs_SetSendFrameLimit(twWs * ws, uint32_t limit) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_SetSendFrameLimit: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (limit > ws->frameSize) {
+		TW_LOG(TW_ERROR, "twWs_SetSendFrameLimit: Send frame limit MUST be less than or equal to max websocket frame size");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(ws->sendMessageMutex);
+	ws->sendFrameLimit = limit ? limit : WS_SEND_FRAME_DEFAULT(ws);
+	twMutex_Unlock(ws->sendMessageMutex);
+	return TW_OK;
+}
+
+int twWs_SetBufferIdleTime(twWs * ws, uint32_t idleTime) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_SetBufferIdleTime: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->recvMutex);
+	ws->bufferIdleTime = idleTime;
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
+}
+
+int twWs_CheckIdle(twWs * ws) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_CheckIdle: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (ws->isConnected != TRUE) return TW_WEBSOCKET_NOT_CONNECTED;
+	twMutex_Lock(ws->recvMutex);
+	checkIdle(ws);
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
+}
+
+int twWs_EnableCompression(twWs * ws, int8_t windowBits, char noContextTakeover, int memLevel, uint32_t threshold) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_EnableCompression: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+#ifndef ENABLE_WS_COMPRESSION
+	if (windowBits) {
+		TW_LOG(TW_ERROR, "twWs_EnableCompression: Websocket compression requires ENABLE_WS_COMPRESSION");
+		return TW_INVALID_PARAM;
+	}
+#endif
+	/* zlib can't compress with an 8 bit window */
+	if (windowBits && (windowBits < 9 || windowBits > 15)) {
+		TW_LOG(TW_ERROR, "twWs_EnableCompression: Window bits MUST be between 9 and 15");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(ws->sendMessageMutex);
+	ws->compressionEnabled = windowBits ? TRUE : FALSE;
+	ws->deflateOffer.clientMaxWindowBits = windowBits;
+	ws->deflateOffer.serverMaxWindowBits = windowBits;
+	ws->deflateOffer.clientNoContextTakeover = noContextTakeover ? TRUE : FALSE;
+	ws->deflateOffer.serverNoContextTakeover = noContextTakeover ? TRUE : FALSE;
+	ws->compressionMemLevel = memLevel;
+	ws->compressionThreshold = threshold;
+	/* Nothing to keep a context for once compression is off */
+	if (!windowBits) {
+		twWsDeflate_Delete(ws->deflateIdle);
+		ws->deflateIdle = NULL;
+	}
+	/* The offer is part of the request */
+	ws->requestLength = 0;
+	twMutex_Unlock(ws->sendMessageMutex);
+	return TW_OK;
+}
+
 /* Receive function for single threaded environments - does not return the data */
 int twWs_Receive(twWs * ws, uint32_t timeout) {
-	int32_t bytesRead = 0;
-	char savedState = READ_HEADER;
+	return twWs_ReceiveBudget(ws, timeout, 1, 0, NULL);
+}
+
+int twWs_ReceiveBudget(twWs * ws, uint32_t timeout, uint32_t maxMessages, uint32_t maxMicros, uint32_t * messagesDispatched) {
+	int res = TW_OK;
+	char status = FRAME_WOULD_BLOCK;
+	uint32_t dispatched = 0;
+	uint64_t start = 0;
+	if (messagesDispatched) *messagesDispatched = 0;
 	if (!ws) { 
-		TW_LOG(TW_ERROR, "twWs_Receive: NULL ws pointer"); 
+		TW_LOG(TW_ERROR, "twWs_ReceiveBudget: NULL ws pointer"); 
 		return TW_INVALID_PARAM; 
 	}
 	if (!ws->isConnected) { 
-		TW_LOG(TW_DEBUG, "twWs_Receive: Not connected"); 
+		/* A sender that dropped the connection leaves its receive state, and share of the receive budget, for us */
+		if (ws->receiveStale) {
+			twMutex_Lock(ws->recvMutex);
+			if (!ws->isConnected && ws->receiveStale) resetReceive(ws);
+			twMutex_Unlock(ws->recvMutex);
+		}
+		TW_LOG(TW_DEBUG, "twWs_ReceiveBudget: Not connected"); 
 		return TW_WEBSOCKET_NOT_CONNECTED; 
 	}
+	/* We are called regularly, so this is where corked frames get their hold time enforced */
+	if (ws->corked && ws->sendBufferUsed) flushExpiredCork(ws);
+	/* ... and where keepalive pings go out */
+	if (ws->keepaliveInterval) {
+		res = twWs_CheckKeepalive(ws);
+		if (res) return res;
+	}
 	twMutex_Lock(ws->recvMutex);
 	/**** 
-	// We never want to read past frame data into another frame
-	// so read only the maximum size of a ws header first and then
-	// receive whatever remaining bytes are left in the frame.  The
-	// reamining bytes are held in the parser's content_length field 
-
-	// If we are not already receiving the frame content read just enough for the header
-	// else read the number of bytes left in the frame content
+	// Headers and bodies are parsed out of the read-ahead buffer so a single
+	// read from the socket can carry several frames.  The socket is only
+	// touched when the buffer can't satisfy what the state machine needs.
 	****/
 	/* Are we asking for more bytes than we have left in the frame buffer? */
-	if (ws->bytesNeeded > ws->frameSize - (ws->frameBufferPtr - ws->frameBuffer)) {
+	if (ws->read_state != READ_HEADER && ws->bodyBuffer == ws->frameBuffer && ws->bytesNeeded > ws->frameBufferSize - (ws->frameBufferPtr - ws->frameBuffer)) {
 		TW_LOG(TW_ERROR,"twWs_Receive: BUFFER OVERRUN!  Something has gone terribly wrong.  Resetting buffer");
-		ws->frameBufferPtr = ws->frameBuffer;
-		ws->read_state = READ_HEADER;
-		ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-		ws->headerPtr = &ws->ws_header[0];
-	}
-	while (ws->read_state == READ_HEADER) {
-		int cnt = 0;
-		bytesRead = twTlsClient_Read(ws->connection, ws->headerPtr, ws->bytesNeeded, timeout);
-		if (bytesRead > 0) {
-			char opcode = 0xff;
-			TW_LOG(TW_TRACE,"twWs_Receive: Read %d bytes into header buffer", bytesRead);
-			ws->headerPtr += bytesRead;
-			ws->bytesNeeded = ws->bytesNeeded - bytesRead;
-			/* Do we still need more bytes? */
-			if (ws->bytesNeeded > 0) {
-				TW_LOG(TW_TRACE,"twWs_Receive: Don't have a full header yet. Still need %d bytes. Will try again", ws->bytesNeeded);
-				twMutex_Unlock(ws->recvMutex);
-				return TW_OK;
-			} else if (ws->bytesNeeded < 0) {
-				/* Something is very wrong */
-				TW_LOG(TW_WARN,"twWs_Receive: bytesNeed less than zero");
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
-			/* Parse what we have */
-			cnt = ws->headerPtr - ws->ws_header;
-			if (ws->ws_header[1] == 127) {
-				/* We aren't handling frames this large */
-				TW_LOG(TW_ERROR,"twWs_Receive: Incoming frame is too large to receive");
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			} else if (ws->ws_header[1] == 126) {
-				if (cnt < 4) {
-					/* Need more bytes for the size */
-					ws->bytesNeeded = 4 - cnt;
-					continue;
-				} else {
-					/* We have the entire header */
-					TW_LOG(TW_TRACE,"twWs_Receive: Got 2 byte length. 0x%x 0x%x", ws->ws_header[2], ws->ws_header[3] );
-					ws->bytesNeeded = (ws->ws_header[2] * 256) + ws->ws_header[3];
-					/* Make sure we can handle this */
-					if (ws->bytesNeeded > ws->frameSize) {
-						TW_LOG(TW_ERROR,"twWs_Receive: Incoming frame is too large to receive.  Size: %d, Max Frame Size: %d", ws->bytesNeeded, ws->frameSize);
-						ws->isConnected = FALSE;
-						if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-						twMutex_Unlock(ws->recvMutex);
-						restartSocket(ws);
-						return TW_ERROR_READING_FROM_WEBSOCKET;
-					}
-				}
-			} else {
-				/* Length < 126 */
-				ws->bytesNeeded = ws->ws_header[1];
-			}
-			/* We have the entire header */
-			opcode = 0xff;
-			TW_LOG(TW_TRACE,"twWs_Receive: Got Header: Body length = %d",ws->bytesNeeded);
-			TW_LOG_HEX(ws->ws_header, "twWs_Receive: Header Data:\n", ws->headerPtr - ws->ws_header);
-			/* Check the op code */
-			opcode = ws->ws_header[0] & 0x0f;
-			switch(opcode) {
-			case 0x00:
-				/* Continuation frame */
-				break;
-			case 0x01:
-				/* Text frame */
-				ws->read_state = READ_TEXT_FRAME;
-				break;
-			case 0x02:
-				/* Binary frame */
-				ws->read_state = READ_BINARY_FRAME;
-				break;
-			case 0x08:
-			case 0x09:
-			case 0x0a:
-				savedState = ws->read_state;
-				ws->read_state = READ_CONTROL_FRAME;
-				break;
-			default:
-				TW_LOG(TW_ERROR,"twWs_Receive: Error reading from websocket. Unknown opcode: %d", opcode);
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
-			/* Sanity check - do we need any data */
-			if (!ws->bytesNeeded) {
-				TW_LOG(TW_WARN,"twWs_Receive: Got header, but frame size is 0");
-				ws->read_state = READ_HEADER;
-				ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-				ws->headerPtr = ws->ws_header;
-				twMutex_Unlock(ws->recvMutex);
-				return TW_OK;
-			}
-		} else {
-			if (bytesRead < 0) {
-				TW_LOG(TW_DEBUG,"twWs_Receive: Read returned an error value of %d", bytesRead);
-				TW_LOG(TW_WARN,"twWs_Receive: Error reading from socket.  Error: %d", twSocket_GetLastError());
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
+		resetReceiveState(ws);
+	}
+	if (maxMicros) start = wsGetMicros();
+	while (TRUE) {
+		res = receiveFrame(ws, timeout, &status);
+		if (res) {
+			ws->isConnected = FALSE;
+			if (ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
+			resetReceive(ws);
 			twMutex_Unlock(ws->recvMutex);
-			return TW_OK;
+			restartSocket(ws);
+			if (messagesDispatched) *messagesDispatched = dispatched;
+			return res;
 		}
-	} 
-	if (ws->bytesNeeded && (ws->read_state == READ_CONTROL_FRAME || ws->read_state == READ_TEXT_FRAME || ws->read_state == READ_BINARY_FRAME)) { /* READ_BODY */
-		bytesRead = twTlsClient_Read(ws->connection, ws->frameBufferPtr, ws->bytesNeeded, timeout);
-		if (bytesRead > 0) {
-			char opcode = 0xff;
-			TW_LOG(TW_TRACE,"twWs_Receive: Read %d bytes into Frame buffer", bytesRead);
-			ws->frameBufferPtr = ws->frameBufferPtr + bytesRead;
-			ws->bytesNeeded = ws->bytesNeeded - bytesRead;
-			/* Do we still need more bytes? */
-			if (ws->bytesNeeded > 0) {
-				TW_LOG(TW_TRACE,"twWs_Receive: Don't have a full frame yet. Still need %d bytes. Will try again", ws->bytesNeeded);
-				twMutex_Unlock(ws->recvMutex);
-				return TW_OK;
-			} else if (ws->bytesNeeded < 0) {
-				TW_LOG(TW_ERROR,"twWs_Receive: Error reading from websocket.  Too much data read");
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
-			/* Check the FIN bit */
-			TW_LOG_HEX(ws->frameBuffer, "twWs_Receive: Got Body:\n", ws->frameBufferPtr - ws->frameBuffer);
-			if ((ws->ws_header[0] & 0x80) == 0x00) {
-				/* The is more data to come for this message */
-				TW_LOG(TW_TRACE,"twWs_Receive: Don't have a full message yet. Will try again");
-				memset(ws->ws_header,0,16);
-				ws->read_state = READ_HEADER;
-				ws->headerPtr = ws->ws_header;
-				ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-				ws->frameBufferPtr = ws->frameBuffer;
-				twMutex_Unlock(ws->recvMutex);
-				return TW_OK;
-			}
-			/* Check the op code */
-			opcode = ws->ws_header[0] & 0x0f;
-			if (opcode == 0x00) {
-				/* Continuation frame */
-				TW_LOG(TW_TRACE,"twWs_Receive: Received Continuation Frame");
-				if (ws->read_state == READ_TEXT_FRAME) {
-					TW_LOG(TW_TRACE,"twWs_Receive: Received Multiframe Text Message");
-					if (ws->on_ws_textMessage) (*ws->on_ws_textMessage)(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-				} else {
-					TW_LOG(TW_TRACE,"twWs_Receive: Received Multiframe Binary Message");
-					if (ws->on_ws_binaryMessage) (*ws->on_ws_binaryMessage)(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-				}
-			} else if (opcode == 0x01) {
-				/* Text Message in single Frame */
-				TW_LOG(TW_TRACE,"twWs_Receive: Received Text Message in Single Frame");
-				if (ws->on_ws_textMessage) (*ws->on_ws_textMessage)(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-			} else if (opcode == 0x02) {
-				/* Binary message in single frame */
-				TW_LOG(TW_TRACE,"twWs_Receive: Received Binary Message in Single Frame");
-				if (ws->on_ws_binaryMessage) (*ws->on_ws_binaryMessage)(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-			} else if (opcode == 0x08) {
-				/* Connection close */
-				TW_LOG(TW_WARN,"twWs_Receive: Websocket closed!");
-				ws->isConnected = FALSE;
-				if (ws->on_ws_close) ws->on_ws_close(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-				ws->read_state = savedState;
-			} else if (opcode == 0x09) {
-				/* Ping */
-				TW_LOG(TW_TRACE,"twWs_Receive: Received Ping");
-				if (ws->on_ws_ping) ws->on_ws_ping(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-				ws->read_state = savedState;
-			} else if (opcode == 0x0a) {
-				/* Pong */
-				TW_LOG(TW_TRACE,"twWs_Receive: Received Pong");
-				if (ws->on_ws_pong) ws->on_ws_pong(ws, ws->frameBuffer, ws->frameBufferPtr - ws->frameBuffer);
-				ws->read_state = savedState;
-			} else {
-				TW_LOG(TW_ERROR,"twWs_Receive: Error reading from websocket. Unknown opcode: %d", opcode);
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
-			/* Reset for the next message */
-			memset(ws->ws_header,0,16);
-			ws->read_state = READ_HEADER;
-			ws->headerPtr = ws->ws_header;
-			ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-			ws->frameBufferPtr = ws->frameBuffer;
-			twMutex_Unlock(ws->recvMutex);
-			return TW_OK;
-		} else {
-			if (bytesRead < 0) {
-				TW_LOG(TW_DEBUG,"twWs_Receive: Read returned an error value of %d", bytesRead);
-				TW_LOG(TW_WARN,"twWs_Receive: Error reading from socket.  Error: %d", twSocket_GetLastError());
-				ws->isConnected = FALSE;
-				if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
-				twMutex_Unlock(ws->recvMutex);
-				restartSocket(ws);
-				return TW_ERROR_READING_FROM_WEBSOCKET;
-			}
-			twMutex_Unlock(ws->recvMutex);
-			return TW_OK;
+		if (status == FRAME_DISPATCHED) {
+			dispatched++;
+			WS_STAT_ADD(ws, messagesReceived, 1);
 		}
-	} 
-	TW_LOG(TW_WARN,"twWs_Receive: resd_state is %d, but bytesNeeded is %d.", ws->read_state, ws->bytesNeeded);
-	ws->read_state = READ_HEADER;
-	ws->bytesNeeded = WS_HEADER_MIN_SIZE;
-	ws->headerPtr = ws->ws_header;
+		/* Stop when the socket would block, the server closed, or the budget is spent */
+		if (status == FRAME_WOULD_BLOCK || ws->isConnected != TRUE) break;
+		if (maxMessages && dispatched >= maxMessages) break;
+		if (maxMicros && wsGetMicros() - start >= maxMicros) break;
+		/* Only the first read is allowed to wait */
+		timeout = 0;
+	}
+	/* Quiet calls are where idle buffers get noticed */
+	if (!dispatched) checkIdle(ws);
 	twMutex_Unlock(ws->recvMutex);
+	if (messagesDispatched) *messagesDispatched = dispatched;
 	return TW_OK;
-	
 }
 
 int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
 	char * ptr = buf;
 	char framesSent = 0;
+	char isCompressed = FALSE;
+	uint32_t messageLength = length;
+	uint32_t frameLimit = 0;
 	int res = -1;
 
 	/* Do some status checks */
@@ -827,27 +1143,41 @@ int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
 	}
 
 	twMutex_Lock(ws->sendMessageMutex);
+	if (ws->deflate && length >= ws->compressionThreshold) {
+		/* The compressed message is framed the same way, with RSV1 set on the first frame */
+		res = twWsDeflate_Compress(ws->deflate, buf, length, &ptr, &length);
+		if (res) {
+			TW_LOG(TW_ERROR, "twWs_SendMessage: Error compressing message. Error code: %d", res);
+			twMutex_Unlock(ws->sendMessageMutex);
+			return res;
+		}
+		isCompressed = TRUE;
+	}
+	frameLimit = ws->sendFrameLimit;
+	beginDataSend(ws);
 	while (length > 0) {
-		if (length > ws->frameSize) {
-			if (framesSent) res = sendDataFrame(ws, ptr, length, 1, 0, isText); /* Continuation, not Final */
+		if (length > frameLimit) {
+			if (framesSent) res = sendDataFrame(ws, ptr, frameLimit, 1, 0, isText, FALSE); /* Continuation, not Final */
 			else {
-				res = sendDataFrame(ws, ptr, length, 0, 0, isText); /* Not Continuation, not Final */
+				res = sendDataFrame(ws, ptr, frameLimit, 0, 0, isText, isCompressed); /* Not Continuation, not Final */
 			}
 			if (res != 0) {
 				TW_LOG(TW_ERROR, "twWs_SendMessage: Error sending frame %d. Error code: %d", framesSent, twSocket_GetLastError());
+				endDataSend(ws);
 				twMutex_Unlock(ws->sendMessageMutex);
 				return res;
 			}
 			framesSent++;
-			ptr = ptr + ws->frameSize;
-			length = length - ws->frameSize;
+			ptr = ptr + frameLimit;
+			length = length - frameLimit;
 		} else {
-			if (framesSent) res = sendDataFrame(ws, ptr, length, 1, 1, isText); /* Continuation, Final */
+			if (framesSent) res = sendDataFrame(ws, ptr, length, 1, 1, isText, FALSE); /* Continuation, Final */
 			else {
-				res = sendDataFrame(ws, ptr, length, 0, 1, isText); /* Not Continuation, not Final */
+				res = sendDataFrame(ws, ptr, length, 0, 1, isText, isCompressed); /* Not Continuation, not Final */
 			}
 			if (res != 0) {
 				TW_LOG(TW_ERROR, "twWs_SendMessage: Error sending frame %d. Error code: %d", framesSent, twSocket_GetLastError());
+				endDataSend(ws);
 				twMutex_Unlock(ws->sendMessageMutex);
 				return res;
 			}
@@ -856,17 +1186,273 @@ int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
 			length = 0;
 		}
 	}
-	TW_LOG(TW_DEBUG,"twWs_SendMessage: Sent %d bytes using %d frames.", ptr - buf, framesSent);
-	TW_LOG_HEX(buf, "Sent Message >>>>\n", ptr - buf);
+	endDataSend(ws);
+	WS_STAT_ADD(ws, messagesSent, 1);
+	WS_TRACE(WS_TRACE_MESSAGE_SENT, ws, framesSent, messageLength);
 	twMutex_Unlock(ws->sendMessageMutex);
 	return TW_OK;
 }
 
-int twWs_SendPing(twWs * ws, char * msg) {
-	char tmp[64];
-	memset(tmp, 0, 64);
-	if (!msg) {
-		twGetSystemTimeString(tmp, "%H:%M:%S", 63, 0, 0);
+int twWs_SendMessageBatch(twWs * ws, char ** bufs, uint32_t * lengths, uint32_t count, char isText) {
+	uint32_t i = 0;
+	uint32_t framesSent = 0;
+	int res = TW_OK;
+
+	/* Do some status checks */
+	if (!ws || !bufs || !lengths) { 
+		TW_LOG(TW_ERROR, "twWs_SendMessageBatch: NULL ws, bufs or lengths pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (!ws->isConnected) { 
+		TW_LOG(TW_WARN, "twWs_SendMessageBatch: Not connected"); 
+		return TW_WEBSOCKET_NOT_CONNECTED; 
+	}
+	/* Validate the whole batch up front so we don't send half of it */
+	for (i = 0; i < count; i++) {
+		if (!bufs[i]) { TW_LOG(TW_ERROR, "twWs_SendMessageBatch: NULL msg pointer at index %u", i); return TW_INVALID_PARAM; }
+		if (lengths[i] == 0) { TW_LOG(TW_ERROR, "twWs_SendMessageBatch: Message length at index %u is 0.  Not sending", i); return TW_INVALID_PARAM; }
+		if (ws->messageChunkSize < lengths[i]) { 
+			TW_LOG(TW_ERROR, "twWs_SendMessageBatch: Message of length %u at index %u is too large.  Max message chunk size is %u", 
+			lengths[i], i, ws->messageChunkSize); 
+			return TW_WEBSOCKET_FRAME_TOO_LARGE;
+		}
+	}
+
+	twMutex_Lock(ws->sendMessageMutex);
+	beginDataSend(ws);
+	lockSendFrame(ws);
+	for (i = 0; i < count && !res; i++) res = stageMessage(ws, bufs[i], lengths[i], isText, &framesSent);
+	if (!res && !ws->corked) res = flushSendBuffer(ws);
+	if (res) {
+		TW_LOG(TW_WARN,"twWs_SendMessageBatch: Error writing to socket.  Error: %d", twSocket_GetLastError());
+		ws->isConnected = FALSE;
+		twMutex_Unlock(ws->sendFrameMutex);
+		endDataSend(ws);
+		twMutex_Unlock(ws->sendMessageMutex);
+		restartSocket(ws);
+		return res;
+	}
+	WS_TRACE(WS_TRACE_BATCH_SENT, ws, framesSent, count);
+	twMutex_Unlock(ws->sendFrameMutex);
+	endDataSend(ws);
+	twMutex_Unlock(ws->sendMessageMutex);
+	return TW_OK;
+}
+
+int twWs_EnableAsyncSend(twWs * ws, uint32_t queueDepth, ws_send_cb cb, char startWriter) {
+	int res = TW_OK;
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_EnableAsyncSend: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (ws->sendQueue) {
+		if (twWsSendQueue_IsWriter(ws->sendQueue)) {
+			TW_LOG(TW_ERROR, "twWs_EnableAsyncSend: Can't be called from a completion callback");
+			return TW_INVALID_PARAM;
+		}
+		closeSendQueue(ws);
+	}
+	if (!queueDepth) return TW_OK;
+	if (!cb) {
+		TW_LOG(TW_ERROR, "twWs_EnableAsyncSend: NULL completion callback");
+		return TW_INVALID_PARAM;
+	}
+	res = twWsSendQueue_Create(queueDepth, &ws->sendQueue);
+	if (res) return res;
+	ws->on_ws_sent = cb;
+	if (startWriter) {
+		res = twWsSendQueue_StartWriter(ws->sendQueue, drainSendQueue, ws);
+		if (res) {
+			twWsSendQueue_Delete(ws->sendQueue);
+			ws->sendQueue = NULL;
+			return res;
+		}
+	}
+	return TW_OK;
+}
+
+int twWs_SendMessageAsync(twWs * ws, char * buf, uint32_t length, char isText, void * userData) {
+	twWsSendItem item;
+	int res = TW_OK;
+	if (!ws || !buf) { 
+		TW_LOG(TW_ERROR, "twWs_SendMessageAsync: NULL ws or msg pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (!ws->sendQueue) { 
+		TW_LOG(TW_ERROR, "twWs_SendMessageAsync: Asynchronous sending is not enabled"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (!ws->isConnected) { 
+		TW_LOG(TW_WARN, "twWs_SendMessageAsync: Not connected"); 
+		return TW_WEBSOCKET_NOT_CONNECTED; 
+	}
+	if (length == 0) { TW_LOG(TW_ERROR, "twWs_SendMessageAsync: Message length is 0.  Not sending"); return TW_INVALID_PARAM; }
+	if (ws->messageChunkSize < length) { 
+		TW_LOG(TW_ERROR, "twWs_SendMessageAsync: Message of length %u is too large.  Max message chunk size is %u", 
+		length, ws->messageChunkSize); 
+		return TW_WEBSOCKET_FRAME_TOO_LARGE;
+	}
+	item.buf = buf;
+	item.length = length;
+	item.isText = isText;
+	item.userData = userData;
+	res = twWsSendQueue_Push(ws->sendQueue, &item);
+	if (res) TW_LOG(TW_WARN, "twWs_SendMessageAsync: Send queue is full");
+	return res;
+}
+
+int twWs_DrainSendQueue(twWs * ws) {
+	if (!ws || !ws->sendQueue) { 
+		TW_LOG(TW_ERROR, "twWs_DrainSendQueue: NULL ws pointer or asynchronous sending not enabled"); 
+		return TW_INVALID_PARAM; 
+	}
+	drainSendQueue(ws);
+	return TW_OK;
+}
+
+int twWs_EnableKeepalive(twWs * ws, uint32_t interval, uint32_t missThreshold) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_EnableKeepalive: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->keepaliveMutex);
+	ws->keepaliveInterval = interval;
+	ws->keepaliveMisses = missThreshold ? missThreshold : WS_KEEPALIVE_DEFAULT_MISSES;
+	/* Give the connection a full allowance from now */
+	ws->lastPong = wsGetMicros();
+	ws->nextKeepalive = ws->lastPong + (uint64_t)interval * 1000;
+	twMutex_Unlock(ws->keepaliveMutex);
+	return TW_OK;
+}
+
+int twWs_CheckKeepalive(twWs * ws) {
+	uint64_t now = 0;
+	uint64_t silent = 0;
+	char dead = FALSE;
+	char due = FALSE;
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_CheckKeepalive: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (ws->isConnected != TRUE) return TW_WEBSOCKET_NOT_CONNECTED;
+	now = wsGetMicros();
+	twMutex_Lock(ws->keepaliveMutex);
+	if (ws->keepaliveInterval) {
+		silent = now - ws->lastPong;
+		if (silent > (uint64_t)ws->keepaliveInterval * ws->keepaliveMisses * 1000) dead = TRUE;
+		else if (now >= ws->nextKeepalive) {
+			due = TRUE;
+			ws->nextKeepalive = now + (uint64_t)ws->keepaliveInterval * 1000;
+		}
+	}
+	twMutex_Unlock(ws->keepaliveMutex);
+	if (dead) {
+		/* Treat it like a socket error */
+		TW_LOG(TW_WARN, "twWs_CheckKeepalive: No pong from %s:%d for %u ms.  Dropping connection", ws->host, ws->port, (uint32_t)(silent / 1000));
+		twMutex_Lock(ws->recvMutex);
+		ws->isConnected = FALSE;
+		if (ws->on_ws_close) ws->on_ws_close(ws, "Keepalive timeout", strlen("Keepalive timeout"));
+		resetReceive(ws);
+		twMutex_Unlock(ws->recvMutex);
+		restartSocket(ws);
+		return TW_ERROR_READING_FROM_WEBSOCKET;
+	}
+	if (due) return twWs_SendPing(ws, NULL);
+	return TW_OK;
+}
+
+int twWs_GetRtt(twWs * ws, twWsRtt * rtt) {
+	uint32_t sorted[WS_RTT_SAMPLES];
+	uint64_t total = 0;
+	uint32_t i = 0;
+	uint32_t j = 0;
+	if (!ws || !rtt) { 
+		TW_LOG(TW_ERROR, "twWs_GetRtt: NULL ws or rtt pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	memset(rtt, 0, sizeof(twWsRtt));
+	twMutex_Lock(ws->keepaliveMutex);
+	rtt->samples = ws->rttCount < WS_RTT_SAMPLES ? ws->rttCount : WS_RTT_SAMPLES;
+	if (rtt->samples) rtt->last = ws->rtt[(ws->rttCount - 1) % WS_RTT_SAMPLES];
+	memcpy(sorted, ws->rtt, rtt->samples * sizeof(uint32_t));
+	twMutex_Unlock(ws->keepaliveMutex);
+	if (!rtt->samples) return TW_OK;
+	/* Insertion sort - there are few enough samples */
+	for (i = 1; i < rtt->samples; i++) {
+		uint32_t v = sorted[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+	for (i = 0; i < rtt->samples; i++) total += sorted[i];
+	rtt->min = sorted[0];
+	rtt->avg = (uint32_t)(total / rtt->samples);
+	rtt->p99 = sorted[(rtt->samples * 99 + 99) / 100 - 1];
+	return TW_OK;
+}
+
+int twWs_GetStats(twWs * ws, twWsStats * stats) {
+	if (!ws || !stats) { 
+		TW_LOG(TW_ERROR, "twWs_GetStats: NULL ws or stats pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	readStats(&ws->stats, stats, FALSE);
+	return TW_OK;
+}
+
+int twWs_GetAggregateStats(twWsStats * stats) {
+	twWs * ws = NULL;
+	if (!stats) { 
+		TW_LOG(TW_ERROR, "twWs_GetAggregateStats: NULL stats pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	memset(stats, 0, sizeof(twWsStats));
+	if (!statsRegistry()) return TW_ERROR_CREATING_MTX;
+	twMutex_Lock(statsRegistry());
+	readStats(&statsRetired, stats, TRUE);
+	for (ws = statsRegistryHead; ws; ws = ws->statsNext) readStats(&ws->stats, stats, TRUE);
+	twMutex_Unlock(statsRegistry());
+	return TW_OK;
+}
+
+int twWs_Cork(twWs * ws, uint32_t maxHoldTime) {
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_Cork: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->sendFrameMutex);
+	ws->corked = TRUE;
+	ws->maxCorkTime = maxHoldTime;
+	twMutex_Unlock(ws->sendFrameMutex);
+	return TW_OK;
+}
+
+int twWs_Uncork(twWs * ws) {
+	int res = TW_OK;
+	if (!ws) { 
+		TW_LOG(TW_ERROR, "twWs_Uncork: NULL ws pointer"); 
+		return TW_INVALID_PARAM; 
+	}
+	twMutex_Lock(ws->sendFrameMutex);
+	ws->corked = FALSE;
+	if (ws->sendBufferUsed && ws->isConnected == TRUE) res = flushSendBuffer(ws);
+	if (res) {
+		TW_LOG(TW_WARN,"twWs_Uncork: Error writing to socket.  Error: %d", twSocket_GetLastError());
+		ws->isConnected = FALSE;
+		twMutex_Unlock(ws->sendFrameMutex);
+		restartSocket(ws);
+		return res;
+	}
+	twMutex_Unlock(ws->sendFrameMutex);
+	return TW_OK;
+}
+
+int twWs_SendPing(twWs * ws, char * msg) {
+	char tmp[64];
+	memset(tmp, 0, 64);
+	if (!msg) {
+		/* A monotonic timestamp we can measure the round trip time from when it comes back */
+		uint64_t now = wsGetMicros();
+		sprintf(tmp, WS_PING_PREFIX "%08x%08x", (uint32_t)(now >> 32), (uint32_t)now);
 		msg = tmp;
 	} 
 	return sendCtlFrame(ws, 0x09, msg);
@@ -881,10 +1467,8 @@ int twWs_SendPong(twWs * ws, char * msg) {
 **/
 int sendCtlFrame(twWs * ws, unsigned char type, char * msg) {
 	/* Send a control frame */
-	int bytesToWrite = 0;
-	int bytesWritten = 0;
 	int res = 0;
-	char frameHeader[128];
+	char frameHeader[6];
 	char typeStr[8] = "Unknown";
 	if (type == 0x08) strcpy(typeStr,"Close");
 	else if (type == 0x09) strcpy(typeStr,"Ping");
@@ -910,33 +1494,42 @@ int sendCtlFrame(twWs * ws, unsigned char type, char * msg) {
 		TW_LOG(TW_ERROR,"sendCtlFrame: Message too long.  Length = ", strlen(msg));
 		return TW_WEBSOCKET_MSG_TOO_LARGE;
 	}
-	twMutex_Lock(ws->sendFrameMutex);
-	TW_LOG(TW_DEBUG,"sendCtlFrame: >>>>> Sending %s. Msg: %s", typeStr, msg);
+	if (type != 0x08) {
+		/* Rather than wait behind a message being sent, slip in at its next frame boundary */
+		twMutex_Lock(ws->ctlMutex);
+		if (ws->sendingData && ws->ctlCount < WS_CTL_LANE_SIZE) {
+			twWsCtlFrame * frame = &ws->ctlLane[ws->ctlCount++];
+			frame->type = type;
+			frame->length = (unsigned char)strlen(msg);
+			memcpy(frame->payload, msg, frame->length);
+			twMutex_Unlock(ws->ctlMutex);
+			WS_TRACE(WS_TRACE_CONTROL_QUEUED, ws, type, strlen(msg));
+			return TW_OK;
+		}
+		twMutex_Unlock(ws->ctlMutex);
+	}
+	lockSendFrame(ws);
+	WS_TRACE(WS_TRACE_CONTROL_SENT, ws, type, strlen(msg));
+	WS_STAT_ADD(ws, controlFramesSent, 1);
 	memset(frameHeader,0,6);
 	frameHeader[0] = 0x80 + type;
 	frameHeader[1] = 0x80 + (char)strlen(msg);
-	/* Masking is set to 0x00 so nothing else to do */
-	strcpy(frameHeader + 6, msg);
-	bytesToWrite = strlen(msg) + 6;
-	bytesWritten = twTlsClient_Write(ws->connection, frameHeader, bytesToWrite, 100);
-
-	if (bytesWritten != bytesToWrite) {
+	/* writeFrame fills in the mask key */
+	res = writeFrame(ws, frameHeader, 6, msg, strlen(msg));
+	/* Control frames are never held - this also flushes anything corked ahead of us */
+	if (!res) res = flushSendBuffer(ws);
+	if (res) {
 		TW_LOG(TW_WARN,"sendCtlFrame: Error writing to socket.  Error: %d", twSocket_GetLastError());
 		ws->isConnected = FALSE;
 		restartSocket(ws);
-		res = TW_ERROR_WRITING_TO_WEBSOCKET;
 	}
 	twMutex_Unlock(ws->sendFrameMutex);
 	return res;
 }
 
-int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, char isFinal, char isText) {
+int sendDataFrame(twWs * ws, char * msg, uint32_t length, char isContinuation, char isFinal, char isText, char isCompressed) {
 
-	int bytesToWrite = 0;
-	int bytesWritten = 0;
-	char frameHeader[12];
-	unsigned char headerLength = 6;
-	char type = 0x02;  /* Default to Binary complete frame */
+	int res = TW_OK;
 
 	/* Do some status checks */
 	if (!ws) { 
@@ -951,41 +1544,263 @@ int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, c
 	/* Make sure we have a message and it fits in a frame */
 	if (!msg) { TW_LOG(TW_ERROR, "sendDataFrame: NULL msg pointer"); return -1; }
 	if (ws->frameSize < length) { 
-		TW_LOG(TW_WARN, "sendDataFrame: Frame of length %d is too large.  Max frame size is %u", 
+		TW_LOG(TW_WARN, "sendDataFrame: Frame of length %u is too large.  Max frame size is %u", 
 		length, ws->frameSize); 
 		return TW_WEBSOCKET_MSG_TOO_LARGE; 
 	}
 
+	lockSendFrame(ws);
+	res = stageDataFrame(ws, msg, length, isContinuation, isFinal, isText, isCompressed);
+	if (!res && !ws->corked) res = flushSendBuffer(ws);
+	if (res) {
+		TW_LOG(TW_WARN,"sendDataFrame: Error writing to socket.  Error: %d", twSocket_GetLastError());
+		ws->isConnected = FALSE;
+        twMutex_Unlock(ws->sendFrameMutex);
+		restartSocket(ws);
+		return res;
+	}
+	twMutex_Unlock(ws->sendFrameMutex);
+	return TW_OK;
+}
+
+int stageMessage(twWs * ws, char * buf, uint32_t length, char isText, uint32_t * framesSent) {
+	/* Compress if negotiated and split a message into frames.  Caller must hold both send mutexes. */
+	int res = TW_OK;
+	char * ptr = buf;
+	char isContinuation = FALSE;
+	char isCompressed = FALSE;
+	if (ws->deflate && length >= ws->compressionThreshold) {
+		/* Each message is staged before the next is compressed, so the context's buffer can be reused */
+		res = twWsDeflate_Compress(ws->deflate, buf, length, &ptr, &length);
+		isCompressed = TRUE;
+	}
+	while (length > 0 && !res) {
+		uint32_t frameLength = length > ws->sendFrameLimit ? ws->sendFrameLimit : length;
+		res = stageDataFrame(ws, ptr, frameLength, isContinuation, frameLength == length, isText, isCompressed && !isContinuation);
+		isContinuation = TRUE;
+		ptr += frameLength;
+		length -= frameLength;
+		(*framesSent)++;
+	}
+	if (!res) WS_STAT_ADD(ws, messagesSent, 1);
+	return res;
+}
+
+void drainSendQueue(void * arg) {
+	/*
+	Pack everything queued into the send buffer, a batch at a time, then
+	report each message's fate.  Popping under sendMessageMutex keeps this
+	the queue's only consumer whoever calls it.
+	*/
+	twWs * ws = (twWs *)arg;
+	twWsSendItem items[WS_ASYNC_SEND_BATCH];
+	while (TRUE) {
+		uint32_t count = 0;
+		uint32_t framesSent = 0;
+		uint32_t i = 0;
+		char restart = FALSE;
+		int res = TW_OK;
+		twMutex_Lock(ws->sendMessageMutex);
+		while (count < WS_ASYNC_SEND_BATCH && twWsSendQueue_Pop(ws->sendQueue, &items[count])) count++;
+		if (!count) {
+			twMutex_Unlock(ws->sendMessageMutex);
+			return;
+		}
+		beginDataSend(ws);
+		lockSendFrame(ws);
+		if (ws->isConnected != TRUE) res = TW_WEBSOCKET_NOT_CONNECTED;
+		for (i = 0; i < count && !res; i++) res = stageMessage(ws, items[i].buf, items[i].length, items[i].isText, &framesSent);
+		if (!res && !ws->corked) res = flushSendBuffer(ws);
+		if (res && res != TW_WEBSOCKET_NOT_CONNECTED) {
+			TW_LOG(TW_WARN,"drainSendQueue: Error writing to socket.  Error: %d", twSocket_GetLastError());
+			ws->isConnected = FALSE;
+			restart = TRUE;
+		}
+		twMutex_Unlock(ws->sendFrameMutex);
+		endDataSend(ws);
+		twMutex_Unlock(ws->sendMessageMutex);
+		if (restart) restartSocket(ws);
+		if (!res) WS_TRACE(WS_TRACE_BATCH_SENT, ws, framesSent, count);
+		/* On an error we can't tell which messages made it out, so they all report it */
+		for (i = 0; i < count; i++) ws->on_ws_sent(ws, items[i].buf, items[i].length, items[i].userData, res);
+	}
+}
+
+void closeSendQueue(twWs * ws) {
+	/* Stop the writer and send, or fail, whatever it left behind */
+	twWsSendQueue_StopWriter(ws->sendQueue);
+	drainSendQueue(ws);
+	twWsSendQueue_Delete(ws->sendQueue);
+	ws->sendQueue = NULL;
+}
+
+void beginDataSend(twWs * ws) {
+	/* From here control frames wait in the priority lane.  Caller must hold sendMessageMutex. */
+	twMutex_Lock(ws->ctlMutex);
+	ws->sendingData = TRUE;
+	twMutex_Unlock(ws->ctlMutex);
+}
+
+void endDataSend(twWs * ws) {
+	/* Send whatever reached the priority lane after the last frame.  Caller must hold sendMessageMutex, not sendFrameMutex. */
+	int res = TW_OK;
+	uint32_t pending = 0;
+	twMutex_Lock(ws->ctlMutex);
+	ws->sendingData = FALSE;
+	pending = ws->ctlCount;
+	twMutex_Unlock(ws->ctlMutex);
+	if (!pending) return;
 	twMutex_Lock(ws->sendFrameMutex);
+	res = sendControlLane(ws);
+	if (res) {
+		TW_LOG(TW_WARN,"endDataSend: Error writing to socket.  Error: %d", twSocket_GetLastError());
+		ws->isConnected = FALSE;
+		twMutex_Unlock(ws->sendFrameMutex);
+		restartSocket(ws);
+		return;
+	}
+	twMutex_Unlock(ws->sendFrameMutex);
+}
+
+int sendControlLane(twWs * ws) {
+	/* Write out control frames waiting in the priority lane.  Caller must hold sendFrameMutex. */
+	twWsCtlFrame lane[WS_CTL_LANE_SIZE];
+	uint32_t count = 0;
+	uint32_t i = 0;
+	int res = TW_OK;
+	twMutex_Lock(ws->ctlMutex);
+	count = ws->ctlCount;
+	if (count) memcpy(lane, ws->ctlLane, count * sizeof(twWsCtlFrame));
+	ws->ctlCount = 0;
+	twMutex_Unlock(ws->ctlMutex);
+	if (!count || ws->isConnected != TRUE) return TW_OK;
+	WS_STAT_ADD(ws, controlFramesSent, count);
+	for (i = 0; i < count && !res; i++) {
+		char frameHeader[6];
+		memset(frameHeader, 0, 6);
+		frameHeader[0] = 0x80 + lane[i].type;
+		frameHeader[1] = 0x80 + lane[i].length;
+		res = writeFrame(ws, frameHeader, 6, lane[i].payload, lane[i].length);
+	}
+	/* Control frames are never held, even when corked */
+	if (!res) res = flushSendBuffer(ws);
+	return res;
+}
+
+int stageDataFrame(twWs * ws, char * msg, uint32_t length, char isContinuation, char isFinal, char isText, char isCompressed) {
+	/* Build the frame header and hand the frame to writeFrame.  Caller must hold sendFrameMutex. */
+	char frameHeader[WS_SEND_HEADER_MAX_SIZE];
+	unsigned char headerLength = 6;
+	char type = 0x02;  /* Default to Binary complete frame */
+	/* We are at a frame boundary, so any pings or pongs waiting can go first */
+	int res = sendControlLane(ws);
+	if (res) return res;
+	WS_STAT_ADD(ws, framesSent, 1);
 	/* Figure out the type */
 	if (isText) type = 0x01;
 	if (isContinuation) type = 0x00;
 	if (isFinal) type = type | 0x80;
+	/* RSV1 marks the first frame of a compressed message */
+	if (isCompressed) type = type | 0x40;
 	/* Prep the header */
-	memset(frameHeader,0,12);
+	memset(frameHeader,0,WS_SEND_HEADER_MAX_SIZE);
 	frameHeader[0] = type;
 	/* Set up the length */
 	if (length < 126) frameHeader[1] = 0x80 + length;
-	else {
+	else if (length <= 0xFFFF) {
 		headerLength = 8;
 		frameHeader[1] = (char)0xFE; /* (char)(0x80 + 126); */
 		frameHeader[2] = (char)(length / 0x100);
 		frameHeader[3] = (char)(length % 0x100);
+	} else {
+		/* 64-bit length - our lengths are 32-bit so the top four bytes stay zero */
+		headerLength = 14;
+		frameHeader[1] = (char)0xFF; /* (char)(0x80 + 127); */
+		frameHeader[6] = (char)(length >> 24);
+		frameHeader[7] = (char)(length >> 16);
+		frameHeader[8] = (char)(length >> 8);
+		frameHeader[9] = (char)length;
 	} 
-	/* Masking is set to 0x00 so nothing else to do */
-	bytesToWrite = headerLength + length;
-	bytesWritten += twTlsClient_Write(ws->connection, frameHeader, headerLength, 100);
-	bytesWritten += twTlsClient_Write(ws->connection, msg, length, 100);
+	WS_TRACE(WS_TRACE_FRAME_SENT, ws, (unsigned char)type, length);
+	/* writeFrame fills in the mask key */
+	return writeFrame(ws, frameHeader, headerLength, msg, length);
+}
 
-	if (bytesWritten != bytesToWrite) {
-		TW_LOG(TW_WARN,"sendDataFrame: Error writing to socket.  Error: %d", twSocket_GetLastError());
+int writeFrame(twWs * ws, char * header, uint32_t headerLength, char * payload, uint32_t length) {
+	/*
+	Append the header and masked payload to the staging buffer so frames go
+	out in as few writes, and so TLS records, as possible.  The last 4 bytes
+	of the header are the mask key, which is filled in here.  The buffer is
+	flushed when the frame doesn't fit, and after every frame unless we are
+	corked.  Payloads too big for the buffer are masked through it a buffer
+	at a time - the caller's buffer is never modified.
+	Caller must hold sendFrameMutex.
+	*/
+	int res = TW_OK;
+	uint32_t masked = 0;
+	unsigned char * key = (unsigned char *)header + headerLength - 4;
+	if (!ws->sendBuffer) {
+		ws->sendBuffer = (char *)twWsSlab_Alloc(ws->sendBufferSize, NULL);
+		if (!ws->sendBuffer) {
+			TW_LOG(TW_ERROR,"writeFrame: Error allocating send buffer storage");
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+	}
+	nextMaskKey(ws, key);
+	if (ws->sendBufferUsed + headerLength + length > ws->sendBufferSize) {
+		res = flushSendBuffer(ws);
+		if (res) return res;
+	}
+	if (ws->corked && !ws->sendBufferUsed) ws->corkDeadline = wsGetMicros() + (uint64_t)ws->maxCorkTime * 1000;
+	memcpy(ws->sendBuffer + ws->sendBufferUsed, header, headerLength);
+	ws->sendBufferUsed += headerLength;
+	while (TRUE) {
+		uint32_t chunk = ws->sendBufferSize - ws->sendBufferUsed;
+		if (chunk > length - masked) chunk = length - masked;
+		twWsSimd_Mask(ws->sendBuffer + ws->sendBufferUsed, payload + masked, chunk, key, masked);
+		ws->sendBufferUsed += chunk;
+		masked += chunk;
+		if (masked == length) break;
+		res = flushSendBuffer(ws);
+		if (res) return res;
+	}
+	if (ws->corked && ws->maxCorkTime && wsGetMicros() >= ws->corkDeadline) return flushSendBuffer(ws);
+	return TW_OK;
+}
+
+int flushSendBuffer(twWs * ws) {
+	/* Write out everything staged.  Caller must hold sendFrameMutex. */
+	int bytesWritten = 0;
+	if (!ws->sendBufferUsed) return TW_OK;
+	bytesWritten = twWsTransport_Write(ws->transport, ws->sendBuffer, ws->sendBufferUsed, 100);
+	WS_STAT_ADD(ws, writeCalls, 1);
+	if (bytesWritten > 0) WS_STAT_ADD(ws, bytesSent, bytesWritten);
+	if (bytesWritten != (int)ws->sendBufferUsed) {
+		WS_TRACE(WS_TRACE_WRITE_BLOCKED, ws, ws->sendBufferUsed, (int64_t)bytesWritten);
+		WS_STAT_ADD(ws, writeErrors, 1);
+		ws->sendBufferUsed = 0;
+		return TW_ERROR_WRITING_TO_WEBSOCKET;
+	}
+	WS_TRACE(WS_TRACE_WRITE, ws, bytesWritten, 0);
+	ws->sendBufferUsed = 0;
+	return TW_OK;
+}
+
+void flushExpiredCork(twWs * ws) {
+	/* Flush corked frames that have been held longer than maxCorkTime */
+	int res = TW_OK;
+	twMutex_Lock(ws->sendFrameMutex);
+	if (ws->corked && ws->maxCorkTime && ws->sendBufferUsed && wsGetMicros() >= ws->corkDeadline) {
+		res = flushSendBuffer(ws);
+	}
+	if (res) {
+		TW_LOG(TW_WARN,"flushExpiredCork: Error writing to socket.  Error: %d", twSocket_GetLastError());
 		ws->isConnected = FALSE;
-        twMutex_Unlock(ws->sendFrameMutex);
+		twMutex_Unlock(ws->sendFrameMutex);
 		restartSocket(ws);
-		return TW_ERROR_WRITING_TO_WEBSOCKET;
+		return;
 	}
 	twMutex_Unlock(ws->sendFrameMutex);
-	return TW_OK;
 }
 
 int validateAcceptKey(twWs * ws, const char * val) {
@@ -1012,3 +1827,839 @@ int validateAcceptKey(twWs * ws, const char * val) {
 	return TW_OK;
 }
 
+
+/**
+* Receive helper functions.  All of these expect the caller to hold recvMutex.
+**/
+int32_t readAheadFill(twWs * ws, uint32_t timeout) {
+	/* Read as much as fits into the contiguous free space at the tail of the ring */
+	uint32_t tail = 0;
+	uint32_t space = 0;
+	int32_t bytesRead = 0;
+	if (ws->readCount == ws->readBufferSize) return 0;
+	if (!ws->readBuffer) {
+		ws->readBuffer = (char *)twWsSlab_Alloc(ws->readBufferSize, NULL);
+		if (!ws->readBuffer) {
+			TW_LOG(TW_ERROR,"readAheadFill: Error allocating read-ahead buffer storage");
+			return -1;
+		}
+		ws->readHead = 0;
+	}
+	tail = (ws->readHead + ws->readCount) % ws->readBufferSize;
+	if (tail >= ws->readHead) space = ws->readBufferSize - tail;
+	else space = ws->readHead - tail;
+	bytesRead = twWsTransport_Read(ws->transport, ws->readBuffer + tail, space, timeout);
+	countRead(ws, bytesRead, space);
+	if (bytesRead > 0) {
+		ws->readCount += bytesRead;
+	} else if (bytesRead < 0) {
+		TW_LOG(TW_WARN,"readAheadFill: Error reading from socket.  Error: %d", twSocket_GetLastError());
+	}
+	return bytesRead;
+}
+
+uint32_t readAheadTake(twWs * ws, char * dst, uint32_t length) {
+	/* Copy up to length buffered bytes out of the ring, handling wrap around */
+	uint32_t taken = 0;
+	while (taken < length && ws->readCount) {
+		uint32_t chunk = ws->readBufferSize - ws->readHead;
+		if (chunk > ws->readCount) chunk = ws->readCount;
+		if (chunk > length - taken) chunk = length - taken;
+		memcpy(dst + taken, ws->readBuffer + ws->readHead, chunk);
+		taken += chunk;
+		ws->readHead = (ws->readHead + chunk) % ws->readBufferSize;
+		ws->readCount -= chunk;
+	}
+	/* Keep the free space contiguous when the ring drains */
+	if (!ws->readCount) ws->readHead = 0;
+	return taken;
+}
+
+void resetReceiveState(twWs * ws) {
+	/* Nothing is held between messages, or at all when frames are streamed out as they arrive */
+	if (ws->messageType == READ_HEADER || ws->on_ws_fragment) twWsGovernor_Release(&ws->receiveClaim);
+	ws->receivePaused = FALSE;
+	memset(ws->ws_header,0,16);
+	ws->read_state = READ_HEADER;
+	ws->headerPtr = ws->ws_header;
+	ws->bytesNeeded = WS_HEADER_MIN_SIZE;
+	ws->frameBufferPtr = ws->frameBuffer;
+	ws->bodyBuffer = ws->frameBuffer;
+}
+
+int parseFrameHeader(twWs * ws) {
+	/* Called each time the bytes asked for by READ_HEADER have arrived */
+	int cnt = ws->headerPtr - ws->ws_header;
+	char opcode = 0xff;
+	if (ws->ws_header[1] == 127) {
+		if (cnt < 10) {
+			/* Need more bytes for the size */
+			ws->bytesNeeded = 10 - cnt;
+			return TW_OK;
+		}
+		/* Anything that needs the top four bytes is well past any frame size we accept */
+		if (ws->ws_header[2] || ws->ws_header[3] || ws->ws_header[4] || ws->ws_header[5]) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Incoming frame is too large to receive");
+			return TW_ERROR_READING_FROM_WEBSOCKET;
+		}
+		ws->bytesNeeded = ((uint32_t)ws->ws_header[6] << 24) | ((uint32_t)ws->ws_header[7] << 16) | ((uint32_t)ws->ws_header[8] << 8) | ws->ws_header[9];
+		/* Make sure we can handle this */
+		if (ws->bytesNeeded > ws->frameSize) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Incoming frame is too large to receive.  Size: %u, Max Frame Size: %u", ws->bytesNeeded, ws->frameSize);
+			return TW_ERROR_READING_FROM_WEBSOCKET;
+		}
+	} else if (ws->ws_header[1] == 126) {
+		if (cnt < 4) {
+			/* Need more bytes for the size */
+			ws->bytesNeeded = 4 - cnt;
+			return TW_OK;
+		}
+		ws->bytesNeeded = (ws->ws_header[2] * 256) + ws->ws_header[3];
+		/* Make sure we can handle this */
+		if (ws->bytesNeeded > ws->frameSize) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Incoming frame is too large to receive.  Size: %u, Max Frame Size: %u", ws->bytesNeeded, ws->frameSize);
+			return TW_ERROR_READING_FROM_WEBSOCKET;
+		}
+	} else {
+		/* Length < 126 */
+		ws->bytesNeeded = ws->ws_header[1];
+	}
+	/* We have the entire header */
+	if (!ws->receivePaused) WS_TRACE(WS_TRACE_FRAME_HEADER, ws, ws->ws_header[0] | (ws->ws_header[1] << 8), ws->bytesNeeded);
+	/* Check the op code */
+	opcode = ws->ws_header[0] & 0x0f;
+	/* RSV1 is only meaningful on the first frame of a message, and only once permessage-deflate is negotiated */
+	if (ws->ws_header[0] & 0x30) {
+		TW_LOG(TW_ERROR,"twWs_Receive: Received frame with reserved bits set: 0x%x", ws->ws_header[0]);
+		return failConnection(ws, PROTOCOL_ERROR, "Reserved bits set");
+	}
+	if ((ws->ws_header[0] & 0x40) && (!ws->deflate || (opcode != 0x01 && opcode != 0x02))) {
+		TW_LOG(TW_ERROR,"twWs_Receive: Received unexpected compressed frame. Opcode: %d", opcode);
+		return failConnection(ws, PROTOCOL_ERROR, "Unexpected RSV1");
+	}
+	switch(opcode) {
+	case 0x00:
+		/* Continuation frame - carries on the fragmented message in progress */
+		if (ws->messageType == READ_HEADER) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Received continuation frame without a message in progress");
+			return failConnection(ws, PROTOCOL_ERROR, "Unexpected continuation");
+		}
+		ws->read_state = ws->messageType;
+		break;
+	case 0x01:
+	case 0x02:
+		/* Text or Binary frame - starts a new message */
+		if (ws->messageType != READ_HEADER) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Received new message before fragmented message was complete");
+			return failConnection(ws, PROTOCOL_ERROR, "Expected continuation");
+		}
+		ws->read_state = (opcode == 0x01) ? READ_TEXT_FRAME : READ_BINARY_FRAME;
+		ws->messageCompressed = (ws->ws_header[0] & 0x40) ? TRUE : FALSE;
+		ws->utf8State = 0;
+		if ((ws->ws_header[0] & 0x80) == 0x00) {
+			/* First of several fragments */
+			ws->messageType = ws->read_state;
+			ws->messageLength = 0;
+		}
+		break;
+	case 0x08:
+	case 0x09:
+	case 0x0a:
+		ws->read_state = READ_CONTROL_FRAME;
+		break;
+	default:
+		TW_LOG(TW_ERROR,"twWs_Receive: Error reading from websocket. Unknown opcode: %d", opcode);
+		return TW_ERROR_READING_FROM_WEBSOCKET;
+	}
+	/* Valid data frame bodies are reserved against the receive budget before room is made for them */
+	if (ws->read_state != READ_CONTROL_FRAME && !twWsGovernor_Reserve(&ws->receiveClaim, ws->bytesNeeded)) {
+		/* Parsed again from the top when the caller retries, so forget the message this frame would have started */
+		if (opcode) ws->messageType = READ_HEADER;
+		ws->read_state = READ_HEADER;
+		pauseReceive(ws);
+		ws->bytesNeeded = 0;
+		return TW_OK;
+	}
+	ws->receivePaused = FALSE;
+	if (ws->read_state != READ_CONTROL_FRAME && ws->messageCompressed) {
+		/* Compressed bodies are read into the frame buffer and inflated to wherever the message is going */
+	} else if (ws->read_state != READ_CONTROL_FRAME && ws->on_ws_buffer && !ws->on_ws_fragment) {
+		/* Loaned buffer mode - every data frame goes into the buffer the application will own */
+		if (ws->bytesNeeded > ws->maxMessageSize - ws->messageLength) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Incoming message is too large to receive.  Size: %u+, Max Message Size: %u", ws->messageLength + ws->bytesNeeded, ws->maxMessageSize);
+			return failConnection(ws, FRAME_TOO_LARGE, NULL);
+		}
+		if (!ws->loanedBuffer) ws->loanedBuffer = acquireBuffer(ws->bufferPool, ws->bytesNeeded);
+		if (!ws->loanedBuffer || growBuffer(ws->loanedBuffer, ws->messageLength + ws->bytesNeeded, ws->maxMessageSize)) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Error allocating loaned buffer storage");
+			return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+		}
+		ws->bodyBuffer = ws->loanedBuffer->data + ws->messageLength;
+		ws->frameBufferPtr = ws->bodyBuffer;
+	} else if (ws->read_state != READ_CONTROL_FRAME && ws->messageType != READ_HEADER && !ws->on_ws_fragment) {
+		/* Fragments are read straight onto the end of the message buffer, unless they are being streamed */
+		if (ws->bytesNeeded > ws->maxMessageSize - ws->messageLength) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Incoming message is too large to receive.  Size: %u+, Max Message Size: %u", ws->messageLength + ws->bytesNeeded, ws->maxMessageSize);
+			return failConnection(ws, FRAME_TOO_LARGE, NULL);
+		}
+		if (growMessageBuffer(ws, ws->messageLength + ws->bytesNeeded)) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Error allocating message buffer storage");
+			return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+		}
+		ws->bodyBuffer = ws->messageBuffer + ws->messageLength;
+		ws->frameBufferPtr = ws->bodyBuffer;
+	}
+	/* Anything else is read into the frame buffer, which is only as big as the frames so far have needed */
+	if (ws->bodyBuffer == ws->frameBuffer && growFrameBuffer(ws, ws->bytesNeeded + 1)) {
+		TW_LOG(TW_ERROR,"twWs_Receive: Error allocating frame buffer storage");
+		return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+	}
+	return TW_OK;
+}
+
+void pauseReceive(twWs * ws) {
+	/* The receive budget is spent.  The governor isn't asked again until WS_RECEIVE_PAUSE_TIME has passed. */
+	if (!ws->receivePaused) WS_STAT_ADD(ws, receivePauses, 1);
+	ws->receivePaused = TRUE;
+	ws->receiveResume = wsGetMicros() + (uint64_t)WS_RECEIVE_PAUSE_TIME * 1000;
+}
+
+int dispatchFrame(twWs * ws, char * status) {
+	/* Hand a complete frame body to the registered callback */
+	char opcode = 0xff;
+	uint32_t length = ws->frameBufferPtr - ws->bodyBuffer;
+	/* A frame that ran out of budget part way through inflating carries on where it stopped */
+	if (ws->receivePaused) return inflateFrame(ws, status);
+	*status = FRAME_CONSUMED;
+	WS_STAT_ADD(ws, framesReceived, 1);
+	/* Check the op code */
+	opcode = ws->ws_header[0] & 0x0f;
+	WS_TRACE(WS_TRACE_FRAME_RECEIVED, ws, opcode, length);
+	/* Keepalive traffic doesn't keep buffers alive */
+	if (ws->read_state != READ_CONTROL_FRAME) ws->dataReceived = TRUE;
+	if (ws->read_state != READ_CONTROL_FRAME && ws->messageCompressed) {
+		return inflateFrame(ws, status);
+	}
+	/* Text is validated a frame at a time, so a bad message is failed before it is all buffered */
+	if (ws->read_state == READ_TEXT_FRAME) {
+		if (!twWsSimd_ValidateUtf8(&ws->utf8State, ws->bodyBuffer, length) || ((ws->ws_header[0] & 0x80) && ws->utf8State)) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Received text message that is not valid UTF-8");
+			return failConnection(ws, INVALID_DATA, "Invalid UTF-8");
+		}
+	}
+	if (ws->read_state != READ_CONTROL_FRAME && ws->on_ws_fragment) {
+		/* Streaming - hand over each frame as it completes */
+		char flags = 0;
+		if (opcode != 0x00) flags |= WS_FRAGMENT_FIRST;
+		if (ws->ws_header[0] & 0x80) flags |= WS_FRAGMENT_LAST;
+		ws->on_ws_fragment(ws, ws->bodyBuffer, length, ws->read_state == READ_TEXT_FRAME ? 0x01 : 0x02, flags);
+		resetReceiveState(ws);
+		if (flags & WS_FRAGMENT_LAST) {
+			ws->messageType = READ_HEADER;
+			*status = FRAME_DISPATCHED;
+		}
+		return TW_OK;
+	} else if (ws->read_state != READ_CONTROL_FRAME && ws->loanedBuffer) {
+		/* Loaned buffer mode - the message is already in place in the buffer */
+		twWsBuffer * buffer = ws->loanedBuffer;
+		ws->messageLength += length;
+		if ((ws->ws_header[0] & 0x80) == 0x00) {
+			WS_TRACE(WS_TRACE_FRAGMENT_RECEIVED, ws, ws->ws_header[0], ws->messageLength);
+			resetReceiveState(ws);
+			return TW_OK;
+		}
+		buffer->length = ws->messageLength;
+		buffer->isText = (ws->read_state == READ_TEXT_FRAME);
+		ws->loanedBuffer = NULL;
+		ws->messageType = READ_HEADER;
+		ws->messageLength = 0;
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, (buffer->isText ? 0x01 : 0x02) | 0x200, buffer->length);
+		/* The application now owns our reference */
+		if (ws->on_ws_buffer) ws->on_ws_buffer(ws, buffer);
+		else twWs_ReleaseBuffer(buffer);
+	} else if (ws->read_state != READ_CONTROL_FRAME && ws->messageType != READ_HEADER) {
+		/* Fragment of a multiframe message - already in place in the message buffer */
+		ws->messageLength += length;
+		/* Check the FIN bit */
+		if ((ws->ws_header[0] & 0x80) == 0x00) {
+			/* The is more data to come for this message */
+			WS_TRACE(WS_TRACE_FRAGMENT_RECEIVED, ws, ws->ws_header[0], ws->messageLength);
+			resetReceiveState(ws);
+			return TW_OK;
+		}
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, ws->messageType == READ_TEXT_FRAME ? 0x01 : 0x02, ws->messageLength);
+		if (ws->messageType == READ_TEXT_FRAME) {
+			if (ws->on_ws_textMessage) (*ws->on_ws_textMessage)(ws, ws->messageBuffer, ws->messageLength);
+		} else {
+			if (ws->on_ws_binaryMessage) (*ws->on_ws_binaryMessage)(ws, ws->messageBuffer, ws->messageLength);
+		}
+		/* Keep the buffer for the next one */
+		ws->messageType = READ_HEADER;
+		ws->messageLength = 0;
+	} else if (opcode == 0x01) {
+		/* Text Message in single Frame */
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, opcode, length);
+		if (ws->on_ws_textMessage) (*ws->on_ws_textMessage)(ws, ws->frameBuffer, length);
+	} else if (opcode == 0x02) {
+		/* Binary message in single frame */
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, opcode, length);
+		if (ws->on_ws_binaryMessage) (*ws->on_ws_binaryMessage)(ws, ws->frameBuffer, length);
+	} else if (opcode == 0x08) {
+		/* Connection close */
+		TW_LOG(TW_WARN,"twWs_Receive: Websocket closed!");
+		ws->isConnected = FALSE;
+		reconnectLater(ws);
+		if (ws->on_ws_close) ws->on_ws_close(ws, ws->frameBuffer, length);
+	} else if (opcode == 0x09) {
+		/* Ping */
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, opcode, length);
+		if (ws->on_ws_ping) ws->on_ws_ping(ws, ws->frameBuffer, length);
+	} else if (opcode == 0x0a) {
+		/* Pong */
+		WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, opcode, length);
+		recordPong(ws, ws->frameBuffer, length);
+		if (ws->on_ws_pong) ws->on_ws_pong(ws, ws->frameBuffer, length);
+	} else {
+		TW_LOG(TW_ERROR,"twWs_Receive: Error reading from websocket. Unknown opcode: %d", opcode);
+		return TW_ERROR_READING_FROM_WEBSOCKET;
+	}
+	/* Reset for the next message */
+	resetReceiveState(ws);
+	*status = FRAME_DISPATCHED;
+	return TW_OK;
+}
+
+int inflateFrame(twWs * ws, char * status) {
+	/*
+	Inflate a compressed frame body from the frame buffer to wherever the
+	message is being delivered - the loaned buffer, the reassembly arena, or
+	in chunks to the fragment callback.  The empty block the sender stripped
+	is fed back in after the last frame.  The inflated message is held to
+	maxMessageSize, except when streaming.  Room for the output is reserved
+	against the receive budget before it is made, and when there is none
+	the frame stops where it is, to be carried on by a later call.
+	*/
+	char * in = ws->bodyBuffer;
+	uint32_t inLength = ws->frameBufferPtr - ws->bodyBuffer;
+	char isFinal = (ws->ws_header[0] & 0x80) ? TRUE : FALSE;
+	char isText = (ws->read_state == READ_TEXT_FRAME);
+	char trailerFed = FALSE;
+	char done = FALSE;
+	uint32_t limit = 0;
+	uint32_t chunkSize = ws->maxMessageSize < WS_INFLATE_CHUNK_SIZE ? ws->maxMessageSize : WS_INFLATE_CHUNK_SIZE;
+	*status = FRAME_CONSUMED;
+	while (TRUE) {
+		char * out = NULL;
+		uint32_t space = 0;
+		uint32_t consumed = 0;
+		uint32_t produced = 0;
+		char probe = 0;
+		char atLimit = FALSE;
+		uint32_t grow = 0;
+		if (ws->on_ws_fragment) {
+			/* The arena holds one chunk, delivered each time it fills */
+			if (ws->messageBufferSize < chunkSize) grow = growthSize(ws->messageBufferSize, WS_BUFFER_MIN_SIZE, chunkSize, ws->maxMessageSize) - ws->messageBufferSize;
+			if (!twWsGovernor_Reserve(&ws->receiveClaim, grow)) break;
+			if (growMessageBuffer(ws, chunkSize)) {
+				TW_LOG(TW_ERROR,"twWs_Receive: Error allocating inflate buffer storage");
+				return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+			}
+			out = ws->messageBuffer + ws->messageLength;
+			space = chunkSize - ws->messageLength;
+		} else if (ws->on_ws_buffer) {
+			if (!ws->loanedBuffer) {
+				if (!twWsGovernor_Reserve(&ws->receiveClaim, chunkSize)) break;
+				ws->loanedBuffer = acquireBuffer(ws->bufferPool, chunkSize);
+			}
+			if (ws->loanedBuffer && ws->loanedBuffer->size == ws->messageLength && ws->messageLength < ws->maxMessageSize) {
+				grow = growthSize(ws->loanedBuffer->size, ws->messageLength + 1, ws->messageLength + 1, ws->maxMessageSize) - ws->loanedBuffer->size;
+				if (!twWsGovernor_Reserve(&ws->receiveClaim, grow)) break;
+				if (growBuffer(ws->loanedBuffer, ws->messageLength + 1, ws->maxMessageSize)) {
+					twWs_ReleaseBuffer(ws->loanedBuffer);
+					ws->loanedBuffer = NULL;
+				}
+			}
+			if (!ws->loanedBuffer) {
+				TW_LOG(TW_ERROR,"twWs_Receive: Error allocating loaned buffer storage");
+				return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+			}
+			/* Buffers can outlast a lower limit, so hold to the limit rather than their size */
+			limit = ws->loanedBuffer->size < ws->maxMessageSize ? ws->loanedBuffer->size : ws->maxMessageSize;
+			out = ws->loanedBuffer->data + ws->messageLength;
+			space = limit - ws->messageLength;
+		} else {
+			if (ws->messageBufferSize == ws->messageLength && ws->messageLength < ws->maxMessageSize) {
+				grow = growthSize(ws->messageBufferSize, WS_BUFFER_MIN_SIZE, ws->messageLength + 1, ws->maxMessageSize) - ws->messageBufferSize;
+				if (!twWsGovernor_Reserve(&ws->receiveClaim, grow)) break;
+				if (growMessageBuffer(ws, ws->messageLength + 1)) {
+					TW_LOG(TW_ERROR,"twWs_Receive: Error allocating message buffer storage");
+					return failConnection(ws, UNEXPECTED_CONDITION, NULL);
+				}
+			}
+			limit = ws->messageBufferSize < ws->maxMessageSize ? ws->messageBufferSize : ws->maxMessageSize;
+			out = ws->messageBuffer + ws->messageLength;
+			space = limit - ws->messageLength;
+		}
+		if (!space) {
+			/* At the size limit - only an error if there is more output to come */
+			out = &probe;
+			space = 1;
+			atLimit = TRUE;
+		}
+		if (twWsDeflate_Inflate(ws->deflate, in, inLength, out, space, &consumed, &produced) || (inLength && !consumed && !produced)) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Error inflating compressed message");
+			return failConnection(ws, INVALID_DATA, "Bad compressed data");
+		}
+		if (atLimit && produced) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Inflated message is too large to receive.  Max Message Size: %u", ws->maxMessageSize);
+			return failConnection(ws, FRAME_TOO_LARGE, NULL);
+		}
+		if (isText && !twWsSimd_ValidateUtf8(&ws->utf8State, out, produced)) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Received text message that is not valid UTF-8");
+			return failConnection(ws, INVALID_DATA, "Invalid UTF-8");
+		}
+		in += consumed;
+		inLength -= consumed;
+		ws->messageLength += produced;
+		if (ws->on_ws_fragment && ws->messageLength == chunkSize) {
+			ws->on_ws_fragment(ws, ws->messageBuffer, ws->messageLength, isText ? 0x01 : 0x02, ws->fragmentStarted ? 0 : WS_FRAGMENT_FIRST);
+			ws->fragmentStarted = TRUE;
+			ws->messageLength = 0;
+		}
+		/* Output that stops short of the space given means the input is used up */
+		if (inLength || produced == space) continue;
+		if (isFinal && !trailerFed) {
+			in = WS_DEFLATE_TRAILER;
+			inLength = WS_DEFLATE_TRAILER_LENGTH;
+			trailerFed = TRUE;
+			continue;
+		}
+		done = TRUE;
+		break;
+	}
+	if (!done) {
+		/* Out of budget.  A trailer that was next hasn't been fed yet, so the next call feeds it. */
+		ws->bodyBuffer = trailerFed ? ws->frameBufferPtr : in;
+		pauseReceive(ws);
+		*status = FRAME_WOULD_BLOCK;
+		return TW_OK;
+	}
+	ws->receivePaused = FALSE;
+	if (!isFinal) {
+		WS_TRACE(WS_TRACE_FRAGMENT_RECEIVED, ws, ws->ws_header[0], ws->messageLength);
+		resetReceiveState(ws);
+		return TW_OK;
+	}
+	twWsDeflate_EndMessage(ws->deflate);
+	if (isText && ws->utf8State) {
+		TW_LOG(TW_ERROR,"twWs_Receive: Received text message that ends part way through a UTF-8 sequence");
+		return failConnection(ws, INVALID_DATA, "Invalid UTF-8");
+	}
+	WS_TRACE(WS_TRACE_MESSAGE_RECEIVED, ws, (isText ? 0x01 : 0x02) | 0x100, ws->messageLength);
+	if (ws->on_ws_fragment) {
+		ws->on_ws_fragment(ws, ws->messageBuffer, ws->messageLength, isText ? 0x01 : 0x02, (ws->fragmentStarted ? 0 : WS_FRAGMENT_FIRST) | WS_FRAGMENT_LAST);
+	} else if (ws->on_ws_buffer) {
+		twWsBuffer * buffer = ws->loanedBuffer;
+		buffer->length = ws->messageLength;
+		buffer->isText = isText;
+		ws->loanedBuffer = NULL;
+		/* The application now owns our reference */
+		ws->on_ws_buffer(ws, buffer);
+	} else if (isText) {
+		if (ws->on_ws_textMessage) (*ws->on_ws_textMessage)(ws, ws->messageBuffer, ws->messageLength);
+	} else {
+		if (ws->on_ws_binaryMessage) (*ws->on_ws_binaryMessage)(ws, ws->messageBuffer, ws->messageLength);
+	}
+	ws->messageType = READ_HEADER;
+	ws->messageLength = 0;
+	ws->messageCompressed = FALSE;
+	ws->fragmentStarted = FALSE;
+	resetReceiveState(ws);
+	*status = FRAME_DISPATCHED;
+	return TW_OK;
+}
+
+int growMessageBuffer(twWs * ws, uint32_t size) {
+	/* Grow the reassembly arena geometrically so steady state traffic doesn't allocate */
+	uint32_t newSize = 0;
+	char * tmp = NULL;
+	if (size <= ws->messageBufferSize) return TW_OK;
+	newSize = growthSize(ws->messageBufferSize, WS_BUFFER_MIN_SIZE, size, ws->maxMessageSize);
+	tmp = (char *)twWsSlab_Realloc(ws->messageBuffer, ws->messageBufferSize, newSize, &ws->messageBufferSize);
+	if (!tmp) return TW_ERROR_ALLOCATING_MEMORY;
+	ws->messageBuffer = tmp;
+	return TW_OK;
+}
+
+uint32_t growthSize(uint32_t size, uint32_t first, uint32_t needed, uint32_t max) {
+	/* The size a buffer of size bytes doubles to, starting from first if it is empty, to hold needed bytes without passing max */
+	uint32_t newSize = size ? size : first;
+	while (newSize < needed) {
+		if (newSize > max / 2) return max;
+		newSize *= 2;
+	}
+	return newSize;
+}
+
+int growFrameBuffer(twWs * ws, uint32_t size) {
+	/* Double up to the largest frame we accept.  Only called between frames, so there is nothing to keep. */
+	uint32_t limit = ws->frameSize + 1;
+	uint32_t newSize = ws->frameBufferSize ? ws->frameBufferSize : WS_BUFFER_MIN_SIZE;
+	char * tmp = NULL;
+	if (size <= ws->frameBufferSize) return TW_OK;
+	if (limit < size) limit = size;
+	while (newSize < size && newSize < limit) newSize *= 2;
+	if (newSize > limit) newSize = limit;
+	tmp = (char *)twWsSlab_Realloc(ws->frameBuffer, 0, newSize, &ws->frameBufferSize);
+	if (!tmp) return TW_ERROR_ALLOCATING_MEMORY;
+	ws->frameBuffer = tmp;
+	ws->frameBufferPtr = tmp;
+	ws->bodyBuffer = tmp;
+	return TW_OK;
+}
+
+void checkIdle(twWs * ws) {
+	/* Caller must hold recvMutex */
+	uint64_t now = 0;
+	if (!ws->bufferIdleTime || (!ws->frameBuffer && !ws->messageBuffer && !ws->readBuffer && !ws->sendBuffer)) return;
+	now = wsGetMicros();
+	if (ws->dataReceived) {
+		ws->dataReceived = FALSE;
+		ws->lastDataReceived = now;
+	} else if (now - ws->lastDataReceived >= (uint64_t)ws->bufferIdleTime * 1000) {
+		trimBuffers(ws);
+	}
+}
+
+void trimBuffers(twWs * ws) {
+	/* 
+	Release the buffers of a quiet connection.  Only done between messages
+	with nothing read ahead, so there is nothing in them to lose.  They are
+	allocated again, small, when traffic resumes.
+	Caller must hold recvMutex.
+	*/
+	if (ws->read_state != READ_HEADER || ws->headerPtr != ws->ws_header || ws->readCount || ws->messageType != READ_HEADER || ws->loanedBuffer) return;
+	TW_LOG(TW_TRACE, "trimBuffers: Releasing buffers of idle websocket to %s:%d", ws->host, ws->port);
+	twWsSlab_Free(ws->frameBuffer);
+	ws->frameBuffer = NULL;
+	ws->frameBufferSize = 0;
+	twWsSlab_Free(ws->messageBuffer);
+	ws->messageBuffer = NULL;
+	ws->messageBufferSize = 0;
+	twWsSlab_Free(ws->readBuffer);
+	ws->readBuffer = NULL;
+	ws->readHead = 0;
+	resetReceiveState(ws);
+	twMutex_Lock(ws->sendFrameMutex);
+	if (!ws->sendBufferUsed) {
+		twWsSlab_Free(ws->sendBuffer);
+		ws->sendBuffer = NULL;
+	}
+	twMutex_Unlock(ws->sendFrameMutex);
+}
+
+twWsBufferPool * createBufferPool(uint32_t maxFree, uint32_t maxBufferSize) {
+	twWsBufferPool * pool = (twWsBufferPool *)TW_CALLOC(sizeof(twWsBufferPool), 1);
+	if (!pool) return NULL;
+	pool->mtx = twMutex_Create();
+	if (!pool->mtx) {
+		TW_FREE(pool);
+		return NULL;
+	}
+	pool->maxFree = maxFree;
+	pool->maxBufferSize = maxBufferSize;
+	return pool;
+}
+
+void closeBufferPool(twWsBufferPool * pool) {
+	/* Free what is pooled now.  The pool itself goes when the last loaned buffer comes back */
+	twWsBuffer * buffer = NULL;
+	char freePool = FALSE;
+	twMutex_Lock(pool->mtx);
+	pool->closed = TRUE;
+	buffer = pool->freeList;
+	pool->freeList = NULL;
+	pool->freeCount = 0;
+	freePool = !pool->outstanding;
+	twMutex_Unlock(pool->mtx);
+	while (buffer) {
+		twWsBuffer * next = buffer->next;
+		twWsSlab_Free(buffer->data);
+		TW_FREE(buffer);
+		buffer = next;
+	}
+	if (freePool) {
+		twMutex_Delete(pool->mtx);
+		TW_FREE(pool);
+	}
+}
+
+twWsBuffer * acquireBuffer(twWsBufferPool * pool, uint32_t size) {
+	/* Take a buffer from the pool, or make a new one, holding at least size bytes */
+	twWsBuffer * buffer = NULL;
+	twMutex_Lock(pool->mtx);
+	if (pool->freeList) {
+		buffer = pool->freeList;
+		pool->freeList = buffer->next;
+		pool->freeCount--;
+	}
+	pool->outstanding++;
+	twMutex_Unlock(pool->mtx);
+	if (!buffer) {
+		buffer = (twWsBuffer *)TW_CALLOC(sizeof(twWsBuffer), 1);
+		if (!buffer) {
+			twMutex_Lock(pool->mtx);
+			pool->outstanding--;
+			twMutex_Unlock(pool->mtx);
+			return NULL;
+		}
+		buffer->pool = pool;
+	}
+	buffer->next = NULL;
+	buffer->length = 0;
+	buffer->refCount = 1;
+	if (growBuffer(buffer, size ? size : 1, size ? size : 1)) {
+		twWs_ReleaseBuffer(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+int growBuffer(twWsBuffer * buffer, uint32_t size, uint32_t max) {
+	/* Geometric growth, capped at max */
+	uint32_t newSize = 0;
+	char * tmp = NULL;
+	if (size <= buffer->size) return TW_OK;
+	newSize = growthSize(buffer->size, size, size, max);
+	tmp = (char *)twWsSlab_Realloc(buffer->data, buffer->size, newSize, &buffer->size);
+	if (!tmp) return TW_ERROR_ALLOCATING_MEMORY;
+	buffer->data = tmp;
+	return TW_OK;
+}
+
+int failConnection(twWs * ws, enum close_status code, char * reason) {
+	/* 
+	Tell the server why before the caller tears the socket down.  Written
+	here rather than through sendCtlFrame, which restarts the socket if the
+	write fails - the caller is about to do that itself.
+	*/
+	char msg[64];
+	char frameHeader[6];
+	uint32_t length = 0;
+	int res = TW_OK;
+	formatCloseMessage(msg, code, reason);
+	if (!ws->isConnected) return TW_ERROR_READING_FROM_WEBSOCKET;
+	length = strlen(msg);
+	lockSendFrame(ws);
+	WS_TRACE(WS_TRACE_CONTROL_SENT, ws, 0x08, length);
+	WS_STAT_ADD(ws, controlFramesSent, 1);
+	memset(frameHeader, 0, 6);
+	frameHeader[0] = (char)0x88;
+	frameHeader[1] = 0x80 + (char)length;
+	res = writeFrame(ws, frameHeader, 6, msg, length);
+	if (!res) res = flushSendBuffer(ws);
+	if (res) TW_LOG(TW_WARN,"failConnection: Error writing close frame.  Error: %d", twSocket_GetLastError());
+	twMutex_Unlock(ws->sendFrameMutex);
+	return TW_ERROR_READING_FROM_WEBSOCKET;
+}
+
+int receiveFrame(twWs * ws, uint32_t timeout, char * status) {
+	/*
+	Drive the state machine from the read-ahead buffer until a frame has
+	been completed.  The socket is read at most once, and only when the
+	buffered bytes run out.  status reports FRAME_DISPATCHED or
+	FRAME_CONSUMED for a completed frame, FRAME_PENDING if the read
+	returned data but not enough of it, and FRAME_WOULD_BLOCK if it
+	returned nothing.
+	*/
+	int res = TW_OK;
+	int32_t bytesRead = 0;
+	char didRead = FALSE;
+	*status = FRAME_WOULD_BLOCK;
+	if (ws->receivePaused) {
+		/* Paused callers don't ask the governor again before it's time, however often they call */
+		uint64_t now = wsGetMicros();
+		if (now < ws->receiveResume) {
+			uint32_t wait = (uint32_t)((ws->receiveResume - now + 999) / 1000);
+			if (timeout < wait) {
+				if (timeout) twSleepMsec(timeout);
+				return TW_OK;
+			}
+			twSleepMsec(wait);
+			timeout -= wait;
+		}
+	}
+	while (TRUE) {
+		if (ws->read_state == READ_HEADER) {
+			uint32_t taken = readAheadTake(ws, (char *)ws->headerPtr, ws->bytesNeeded);
+			ws->headerPtr += taken;
+			ws->bytesNeeded -= taken;
+			if (!ws->bytesNeeded) {
+				res = parseFrameHeader(ws);
+				if (res) return res;
+				if (ws->receivePaused) {
+					/* Over the receive budget - leave the body in the socket and let the caller come back */
+					if (timeout) twSleepMsec(timeout < WS_RECEIVE_PAUSE_TIME ? timeout : WS_RECEIVE_PAUSE_TIME);
+					return TW_OK;
+				}
+				/* Either more length bytes or the body are needed now */
+				continue;
+			}
+			WS_TRACE(WS_TRACE_HEADER_INCOMPLETE, ws, 0, ws->bytesNeeded);
+		} else if (ws->read_state == READ_CONTROL_FRAME || ws->read_state == READ_TEXT_FRAME || ws->read_state == READ_BINARY_FRAME) { /* READ_BODY */
+			uint32_t taken = readAheadTake(ws, ws->frameBufferPtr, ws->bytesNeeded);
+			ws->frameBufferPtr += taken;
+			ws->bytesNeeded -= taken;
+			if (!ws->bytesNeeded) {
+				res = dispatchFrame(ws, status);
+				if (!res && ws->receivePaused && timeout) {
+					/* Over the receive budget part way through inflating - the rest waits in the frame buffer */
+					twSleepMsec(timeout < WS_RECEIVE_PAUSE_TIME ? timeout : WS_RECEIVE_PAUSE_TIME);
+				}
+				return res;
+			}
+			WS_TRACE(WS_TRACE_BODY_INCOMPLETE, ws, 0, ws->bytesNeeded);
+		} else {
+			TW_LOG(TW_WARN,"twWs_Receive: resd_state is %d, but bytesNeeded is %u.", ws->read_state, ws->bytesNeeded);
+			resetReceiveState(ws);
+			*status = FRAME_CONSUMED;
+			return TW_OK;
+		}
+		/* The buffer is empty - go to the socket, but only once per call */
+		if (didRead) {
+			*status = FRAME_PENDING;
+			return TW_OK;
+		}
+		didRead = TRUE;
+		if (ws->read_state != READ_HEADER && ws->bytesNeeded >= ws->readBufferSize) {
+			/* A body this large gains nothing from the ring, so read it in place */
+			bytesRead = twWsTransport_Read(ws->transport, ws->frameBufferPtr, ws->bytesNeeded, timeout);
+			countRead(ws, bytesRead, ws->bytesNeeded);
+			if (bytesRead > 0) {
+				ws->frameBufferPtr += bytesRead;
+				ws->bytesNeeded -= bytesRead;
+			} else if (bytesRead < 0) {
+				TW_LOG(TW_WARN,"twWs_Receive: Error reading from socket.  Error: %d", twSocket_GetLastError());
+			}
+		} else bytesRead = readAheadFill(ws, timeout);
+		if (bytesRead < 0) return TW_ERROR_READING_FROM_WEBSOCKET;
+		if (bytesRead == 0) return TW_OK;
+	}
+}
+
+void lockSendFrame(twWs * ws) {
+	/* Take sendFrameMutex, keeping track of how long senders queue for it */
+	uint64_t start = wsGetMicros();
+	uint64_t waited = 0;
+	twMutex_Lock(ws->sendFrameMutex);
+	waited = wsGetMicros() - start;
+	WS_STAT_ADD(ws, sendLockAcquires, 1);
+	WS_STAT_ADD(ws, sendLockWaitMicros, waited);
+	if (waited) WS_TRACE(WS_TRACE_LOCK_WAIT, ws, 0, waited);
+	/* Only updated with the mutex held, so no compare and swap needed */
+	if (waited > WS_STAT_LOAD(&ws->stats.sendLockWaitMax)) WS_STAT_STORE(&ws->stats.sendLockWaitMax, waited);
+}
+
+void countRead(twWs * ws, int32_t bytesRead, uint32_t requested) {
+	WS_STAT_ADD(ws, readCalls, 1);
+	if (bytesRead < 0) {
+		WS_TRACE(WS_TRACE_READ_ERROR, ws, requested, (int64_t)bytesRead);
+		WS_STAT_ADD(ws, readErrors, 1);
+	} else if (bytesRead == 0) {
+		WS_TRACE(WS_TRACE_READ_EMPTY, ws, requested, 0);
+		WS_STAT_ADD(ws, emptyReads, 1);
+	} else {
+		WS_TRACE(WS_TRACE_READ, ws, requested, bytesRead);
+		WS_STAT_ADD(ws, bytesReceived, bytesRead);
+		if ((uint32_t)bytesRead < requested) WS_STAT_ADD(ws, shortReads, 1);
+	}
+}
+
+void readStats(const twWsStats * src, twWsStats * dst, char add) {
+	/* Copy or sum counters.  Every field is a uint64_t, and the maximum is the one that doesn't add up. */
+	const uint64_t * from = (const uint64_t *)src;
+	uint64_t * to = (uint64_t *)dst;
+	uint32_t i = 0;
+	for (i = 0; i < sizeof(twWsStats) / sizeof(uint64_t); i++) {
+		uint64_t v = WS_STAT_LOAD(&from[i]);
+		if (!add) to[i] = v;
+		else if (&to[i] == &dst->sendLockWaitMax) to[i] = v > to[i] ? v : to[i];
+		else to[i] += v;
+	}
+}
+
+TW_MUTEX statsRegistry() {
+	/* Created by whichever thread gets here first */
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&statsRegistryMutex);
+	if (m) return m;
+	m = twMutex_Create();
+	if (!m) return NULL;
+	if (!WS_CAS_PTR(&statsRegistryMutex, m)) twMutex_Delete(m);
+	return (TW_MUTEX)WS_LOAD_PTR(&statsRegistryMutex);
+}
+
+void resetKeepalive(twWs * ws) {
+	/* A new connection starts with a full allowance and no round trip times */
+	twMutex_Lock(ws->keepaliveMutex);
+	ws->lastPong = wsGetMicros();
+	ws->nextKeepalive = ws->lastPong + (uint64_t)ws->keepaliveInterval * 1000;
+	ws->rttCount = 0;
+	twMutex_Unlock(ws->keepaliveMutex);
+}
+
+void recordPong(twWs * ws, const char * payload, uint32_t length) {
+	/* Any pong shows the server is alive, but only ours carry a timestamp to measure */
+	uint64_t now = wsGetMicros();
+	uint64_t sent = 0;
+	uint32_t i = 0;
+	char ours = length == WS_PING_PREFIX_LENGTH + 16 && !memcmp(payload, WS_PING_PREFIX, WS_PING_PREFIX_LENGTH);
+	for (i = WS_PING_PREFIX_LENGTH; ours && i < length; i++) {
+		char c = payload[i];
+		if (c >= '0' && c <= '9') sent = (sent << 4) | (uint64_t)(c - '0');
+		else if (c >= 'a' && c <= 'f') sent = (sent << 4) | (uint64_t)(c - 'a' + 10);
+		else ours = FALSE;
+	}
+	twMutex_Lock(ws->keepaliveMutex);
+	ws->lastPong = now;
+	/* Garbage that happens to parse could be from the future */
+	if (ours && sent <= now && now - sent < 0xFFFFFFFF) {
+		ws->rtt[ws->rttCount % WS_RTT_SAMPLES] = (uint32_t)(now - sent);
+		ws->rttCount++;
+	}
+	twMutex_Unlock(ws->keepaliveMutex);
+}
+
+void seedMaskKeys(twWs * ws) {
+	/* Mix the clock with the struct address so connections started together still differ */
+	ws->maskState = wsGetMicros() ^ ((uint64_t)(size_t)ws << 16) ^ (uint64_t)twGetSystemTime(TRUE);
+	if (!ws->maskState) ws->maskState = 0x9E3779B97F4A7C15ULL;
+}
+
+void nextMaskKey(twWs * ws, unsigned char * key) {
+	/* xorshift64* - a few cycles per frame, and the high bits are well mixed.  Caller must hold sendFrameMutex. */
+	uint64_t x = ws->maskState;
+	uint32_t r = 0;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	ws->maskState = x;
+	r = (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+	key[0] = (unsigned char)(r >> 24);
+	key[1] = (unsigned char)(r >> 16);
+	key[2] = (unsigned char)(r >> 8);
+	key[3] = (unsigned char)r;
+}
+
+uint64_t wsGetMicros() {
+	/* Monotonic clock for receive budgets - the system time is only millisecond resolution and can jump */
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
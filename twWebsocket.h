@@ -12,6 +12,10 @@
 
 #include "twOSPort.h"
 #include "twDefinitions.h"
+#include "twWsDeflate.h"
+#include "twWsSendQueue.h"
+#include "twWsHandshake.h"
+#include "twWsGovernor.h"
 
 #ifndef TW_WEBSOCKET_H
 #define TW_WEBSOCKET_H
@@ -32,8 +36,19 @@ Forward declarations of the struct and call back functions
 used by the http-parser library
 */
 struct twWs;
+struct twWsBuffer;
+struct twWsBufferPool;
 typedef int (*ws_cb) (struct twWs * ws);
 typedef int (*ws_data_cb) (struct twWs * ws, const char *at, size_t length);
+typedef int (*ws_fragment_cb) (struct twWs * ws, const char *at, size_t length, unsigned char opcode, char flags);
+typedef int (*ws_buffer_cb) (struct twWs * ws, struct twWsBuffer * buffer);
+typedef void (*ws_send_cb) (struct twWs * ws, char * buf, uint32_t length, void * userData, int result);
+
+/*
+Flags passed to a ws_fragment_cb
+*/
+#define WS_FRAGMENT_FIRST 0x01    /**< The fragment starts a new message. **/
+#define WS_FRAGMENT_LAST 0x02     /**< The fragment completes the message. **/
 
 /* 
 Helper macros 
@@ -59,19 +74,116 @@ enum close_status {
 	,UNEXPECTED_CONDITION   /**< 1011 - Unexpected condition. **/
 };
 
+/**
+ * \brief A reference counted message buffer loaned to the application.
+ *
+ * \note Only \p data, \p length and \p isText are for the application to
+ * read.  The buffer must be handed back with twWs_ReleaseBuffer().
+*/
+typedef struct twWsBuffer {
+	char * data;                            /**< The message payload. **/
+	uint32_t length;                        /**< Length of the message payload. **/
+	char isText;                            /**< TRUE if this is a text message, FALSE if binary. **/
+	uint32_t size;                          /**< Allocated size of data. **/
+	int32_t refCount;                       /**< Number of outstanding references. **/
+	struct twWsBufferPool * pool;           /**< The pool the buffer returns to when released. **/
+	struct twWsBuffer * next;               /**< Free list link while the buffer is in the pool. **/
+} twWsBuffer;
+
+/*
+Number of pings and pongs that can wait to be slipped in between the frames
+of a message being sent
+*/
+#define WS_CTL_LANE_SIZE 4
+
+/**
+ * \brief A control frame waiting in the priority lane.
+*/
+typedef struct twWsCtlFrame {
+	unsigned char type;                     /**< The control opcode. **/
+	unsigned char length;                   /**< Length of the payload. **/
+	char payload[125];                      /**< The unmasked payload. **/
+} twWsCtlFrame;
+
+/*
+Number of round trip times kept per connection for the keepalive statistics
+*/
+#define WS_RTT_SAMPLES 128
+
+/**
+ * \brief Round trip times measured by keepalive pings, in microseconds, over
+ * the last #WS_RTT_SAMPLES pongs.
+*/
+typedef struct twWsRtt {
+	uint32_t samples;                       /**< Number of samples the figures are drawn from, 0 if none yet. **/
+	uint32_t last;                          /**< The most recent round trip time. **/
+	uint32_t min;                           /**< The fastest round trip time. **/
+	uint32_t avg;                           /**< The mean round trip time. **/
+	uint32_t p99;                           /**< The 99th percentile round trip time. **/
+} twWsRtt;
+
+/**
+ * \brief Counters kept for each websocket.  All are totals since the
+ * websocket was created.
+*/
+typedef struct twWsStats {
+	uint64_t connectAttempts;               /**< Calls to twWs_Connect() on a disconnected websocket. **/
+	uint64_t connects;                      /**< Successful connections. **/
+	uint64_t tlsResumed;                    /**< TLS connections that resumed a cached session. **/
+	uint64_t tlsFullHandshakes;             /**< TLS connections that needed a full handshake. **/
+	uint64_t restarts;                      /**< Times the socket was torn down and recreated, on connecting and on errors. **/
+	uint64_t bytesSent;                     /**< Bytes written to the socket, frame headers included. **/
+	uint64_t bytesReceived;                 /**< Bytes read from the socket, frame headers included. **/
+	uint64_t framesSent;                    /**< Data frames sent. **/
+	uint64_t controlFramesSent;             /**< Close, ping and pong frames sent. **/
+	uint64_t framesReceived;                /**< Frames of any kind received. **/
+	uint64_t messagesSent;                  /**< Data messages sent. **/
+	uint64_t messagesReceived;              /**< Messages and control frames dispatched to callbacks. **/
+	uint64_t writeCalls;                    /**< Writes to the socket. **/
+	uint64_t writeErrors;                   /**< Writes that failed or came up short. **/
+	uint64_t readCalls;                     /**< Reads from the socket. **/
+	uint64_t emptyReads;                    /**< Reads that returned no data. **/
+	uint64_t shortReads;                    /**< Reads that returned less data than there was room for. **/
+	uint64_t readErrors;                    /**< Reads that failed. **/
+	uint64_t receivePauses;                 /**< Times reading stopped because the receive budget was spent (see twWsGovernor.h). **/
+	uint64_t sendLockAcquires;              /**< Times a sender took the frame mutex. **/
+	uint64_t sendLockWaitMicros;            /**< Total time (in microseconds) senders spent waiting for the frame mutex. **/
+	uint64_t sendLockWaitMax;               /**< Longest time (in microseconds) a sender waited for the frame mutex. **/
+} twWsStats;
+
 /**
  * \brief Websocket entity structure definition.
 */
 typedef struct twWs{
-	struct twTlsClient * connection;        /**< Pointer to a TLS client connection structure. **/
+	struct twTlsClient * connection;        /**< Pointer to a TLS client connection structure, or NULL if the transport isn't TLS. **/
+	struct twWsTransport * transport;       /**< The transport frames are sent over (see twWsTransport.h). **/
 	uint32_t messageChunkSize;              /**< Max size (in bytes) of multipart message chunk. **/
-	int32_t bytesNeeded;                    /**< How many bytes we should read next. **/
+	uint32_t bytesNeeded;                   /**< How many bytes we should read next. **/
 	char read_state;                        /**< READ_HEADER or READ_BODY. **/
-	uint16_t frameSize;                     /**< Max size of a websocket frame (not to be confused with max ThingWorx message size .**/
-	char * frameBuffer;                     /**< Pointer to a frame buffer. **/
+	uint32_t frameSize;                     /**< Max size of a websocket frame (not to be confused with max ThingWorx message size .**/
+	uint32_t sendFrameLimit;                /**< Largest data frame sent, no more than frameSize.  Defaults to the send buffer size. **/
+	char * frameBuffer;                     /**< Pointer to a frame buffer, allocated on demand and grown as bigger frames arrive. **/
+	uint32_t frameBufferSize;               /**< Allocated size of the frame buffer, 0 if there is none. **/
 	char * frameBufferPtr;                  /**< A pointer to the websocket's frame buffer.  **/
+	char * bodyBuffer;                      /**< Where the current frame body starts - the frame buffer, or the tail of the message buffer. **/
+	char * messageBuffer;                   /**< Growable arena fragmented messages are reassembled into.  Reused across messages. **/
+	uint32_t messageBufferSize;             /**< Allocated size of the message buffer. **/
+	uint32_t messageLength;                 /**< Bytes of the fragmented message received so far. **/
+	uint32_t maxMessageSize;                /**< Largest fragmented message that will be reassembled. **/
+	char messageType;                       /**< READ_TEXT_FRAME or READ_BINARY_FRAME while a fragmented message is in progress, READ_HEADER otherwise. **/
 	unsigned char ws_header[64];            /**< A buffer to receive websocket frame headers.  **/
 	unsigned char * headerPtr;              /**< Pointer to a the header buffer. **/
+	char * readBuffer;                      /**< Read-ahead ring buffer the socket is drained into.  Allocated on demand. **/
+	uint32_t readBufferSize;                /**< Size of the read-ahead ring buffer. **/
+	uint32_t readHead;                      /**< Offset of the first unconsumed byte in the read-ahead buffer. **/
+	uint32_t readCount;                     /**< Number of unconsumed bytes in the read-ahead buffer. **/
+	char * sendBuffer;                      /**< Staging buffer outgoing frame headers and payloads are coalesced into.  Allocated on demand. **/
+	uint32_t sendBufferSize;                /**< Size of the send staging buffer, once allocated. **/
+	uint32_t sendBufferUsed;                /**< Bytes staged in the send buffer that have not been written yet. **/
+	char corked;                            /**< TRUE while frames are being held in the send buffer. **/
+	uint32_t maxCorkTime;                   /**< Longest time (in milliseconds) corked frames are held, 0 for no limit. **/
+	uint64_t corkDeadline;                  /**< When held frames must be flushed, in wsGetMicros() time. **/
+	uint64_t maskState;                     /**< State of the generator outgoing frame mask keys are drawn from. **/
 	char * host;                            /**< The host name of the websocket server. **/
 	uint16_t port;                          /**< The port that the websocket server is listening on. **/
 	char * api_key;                         /**< The API key that will be used during an ensuing authentication process. **/
@@ -80,6 +192,10 @@ typedef struct twWs{
 	char * gatewayType;                     /**< An optional type if the SDK is being used to develop a gateway application which allows 
                                                multiple Things to connect through it.  If not NULL this is used during the binding process. **/
 	unsigned char * security_key;           /**< websocket security key. **/
+	char * request;                         /**< The upgrade request, with the key filled in on each connect. **/
+	uint32_t requestLength;                 /**< Length of the request, or 0 if it needs building. **/
+	uint32_t requestKeyOffset;              /**< Where the key goes in the request. **/
+	twWsHandshake handshake;                /**< Upgrade response parser state. **/
 	uint32_t sessionId;                     /**< Unique session ID. **/
 	char * resource;                        /**< The HTTP resource of the connection. **/
 	TW_MUTEX sendMessageMutex;              /**< A mutex for sending messages. **/
@@ -93,6 +209,50 @@ typedef struct twWs{
 	ws_data_cb on_ws_ping;                  /**< Pointer to a callback function registered to be called when a Ping is received. **/
 	ws_data_cb on_ws_pong;                  /**< Pointer to a callback function registered to be called when a Pong is received. **/
 	ws_data_cb on_ws_close;                 /**< Pointer to a callback function registered to be called when the server closes the websocket connection. **/
+	ws_fragment_cb on_ws_fragment;          /**< Pointer to a callback function registered to be called with each data frame as it arrives instead of reassembling messages. **/
+	ws_buffer_cb on_ws_buffer;              /**< Pointer to a callback function registered to be handed ownership of each complete message. **/
+	struct twWsBufferPool * bufferPool;     /**< Pool loaned message buffers are drawn from and released to. **/
+	twWsBuffer * loanedBuffer;              /**< The loaned buffer the current message is being received into. **/
+	char compressionEnabled;                /**< TRUE if permessage-deflate is offered when connecting. **/
+	twWsDeflateParams deflateOffer;         /**< The permessage-deflate parameters offered when connecting. **/
+	int compressionMemLevel;                /**< zlib memory level used for the compressor. **/
+	uint32_t compressionThreshold;          /**< Messages shorter than this are sent uncompressed. **/
+	char compressionAccepted;               /**< TRUE if the server accepted permessage-deflate on this connection. **/
+	twWsDeflateParams deflateAccepted;      /**< The permessage-deflate parameters the server accepted. **/
+	struct twWsDeflate * deflate;           /**< Compression context for this connection, NULL if not negotiated. **/
+	struct twWsDeflate * deflateIdle;       /**< An earlier connection's context, kept to be reset for the next one. **/
+	char messageCompressed;                 /**< TRUE while receiving a message that had RSV1 set on its first frame. **/
+	char fragmentStarted;                   /**< TRUE once the first inflated chunk of a message has gone to the fragment callback. **/
+	uint32_t utf8State;                     /**< UTF-8 validator state carried across the frames of a text message. **/
+	struct twWsSendQueue * sendQueue;       /**< Queue of messages waiting to be sent asynchronously, NULL if not enabled. **/
+	ws_send_cb on_ws_sent;                  /**< Pointer to a callback function registered to be called when an asynchronously sent message completes. **/
+	TW_MUTEX ctlMutex;                      /**< A mutex for the control frame priority lane.  Never held while taking another lock. **/
+	char sendingData;                       /**< TRUE while data frames are being sent, so control frames go in the priority lane. **/
+	uint32_t ctlCount;                      /**< Number of control frames waiting in the priority lane. **/
+	twWsCtlFrame ctlLane[WS_CTL_LANE_SIZE]; /**< Control frames to send at the next frame boundary. **/
+	TW_MUTEX keepaliveMutex;                /**< A mutex for the keepalive state and round trip times.  Never held while taking another lock. **/
+	uint32_t keepaliveInterval;             /**< Time (in milliseconds) between keepalive pings, 0 if keepalive is off. **/
+	uint32_t keepaliveMisses;               /**< Number of intervals without a pong before the connection is considered dead. **/
+	uint64_t nextKeepalive;                 /**< When the next keepalive ping is due, in wsGetMicros() time. **/
+	uint64_t lastPong;                      /**< When the last pong arrived, or the connection was made, in wsGetMicros() time. **/
+	uint32_t rtt[WS_RTT_SAMPLES];           /**< Ring of the most recent round trip times. **/
+	uint32_t rttCount;                      /**< Number of round trip times measured on this connection. **/
+	struct twWsReconnect * reconnect;       /**< Reconnect policy, or NULL to reconnect as soon as the socket fails. **/
+	uint32_t reconnectFailures;             /**< Connection attempts that have failed since the last success. **/
+	uint64_t nextReconnect;                 /**< When twWs_Connect() may next try, in wsGetMicros() time. **/
+	char * session;                         /**< This websocket's last TLS session, offered if the shared cache has none (see twWsSession.h). **/
+	uint32_t sessionLength;                 /**< Length of the session, 0 if there is none. **/
+	char sessionResumed;                    /**< TRUE if the current connection resumed a TLS session. **/
+	uint32_t bufferIdleTime;                /**< Time (in milliseconds) without a data message after which buffers are released, 0 to keep them. **/
+	uint64_t lastDataReceived;              /**< When a data message was last seen to have arrived, in wsGetMicros() time. **/
+	char dataReceived;                      /**< TRUE if a data frame has arrived since the last idle check. **/
+	twWsGovernorClaim receiveClaim;         /**< Bytes of the message in progress reserved against the process wide receive budget. **/
+	char receivePaused;                     /**< TRUE while a frame waits for its body, or room to inflate it, to fit in the receive budget. **/
+	uint64_t receiveResume;                 /**< When a paused frame next asks for room, in wsGetMicros() time. **/
+	char receiveStale;                      /**< TRUE once a connection dropped on sending has left receive state for the receive path to clear. **/
+	twWsStats stats;                        /**< Counters, updated with relaxed atomics.  Read with twWs_GetStats(). **/
+	struct twWs * statsPrev;                /**< Links in the list of live websockets twWs_GetAggregateStats() sums. **/
+	struct twWs * statsNext;
 } twWs;
 
 /**
@@ -115,7 +275,8 @@ typedef struct twWs{
  *                                   message chunk.
  * \param[in]     frameSize          The maximum websocket frame size (not to
  *                                   be confused with the maximum ThingWorx
- *                                   message size).
+ *                                   message size).  Frames larger than 64 KiB
+ *                                   use the 64-bit length encoding of RFC 6455.
  * \param[out]    entity             A pointer to the newly allocated ::twWs
  *                                   structure.
  *
@@ -127,7 +288,30 @@ typedef struct twWs{
  * responsible for freeing it via twWs_Delete().
 */
 int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, char * gatewayName,
-				   uint32_t messageChunkSize, uint16_t frameSize, twWs ** entity);
+				   uint32_t messageChunkSize, uint32_t frameSize, twWs ** entity);
+
+/**
+ * \brief Creates a new ::twWs structure that runs over a given transport
+ * rather than TLS.  See twWs_Create() for the other parameters.
+ *
+ * \param[in]     transport          The transport (see twWsTransport.h).
+ *                                   Plain TCP and Unix domain sockets suit
+ *                                   hops that need no encryption, an
+ *                                   in-process pipe suits tests.
+ * \param[in]     host               The host to connect to, or the path of
+ *                                   a Unix domain socket.  Also sent in the
+ *                                   Host header.
+ * \param[in]     port               The port to connect to.  Ignored by Unix
+ *                                   domain sockets and pipes.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The websocket owns \p transport from the call on, and deletes it
+ * along with itself, or straight away if creation fails.
+*/
+int twWs_CreateWithTransport(struct twWsTransport * transport, char * host, uint16_t port, char * resource, char * api_key, char * gatewayName,
+				   uint32_t messageChunkSize, uint32_t frameSize, twWs ** entity);
 
 /**
  * \brief Frees all memory associated with a ::twWs structure and all its owned
@@ -152,9 +336,35 @@ int twWs_Delete(twWs * ws);
  *
  * \return #TW_OK if successful, positive integral on error code (see
  * twErrors.h) if an error was encountered.
+ *
+ * \note With a reconnect policy, returns #TW_WEBSOCKET_RECONNECT_BACKOFF
+ * without touching the network until the policy allows another attempt.
+ * \note Safe to call while other threads are in twWs_Receive().  They wait
+ * for the connect to finish, and the websocket only reports itself
+ * connected once it is ready to receive.
+ * \note The connected callback runs with sendMessageMutex held, so other
+ * threads can't send until it returns, but not recvMutex.  It may send and
+ * wait for a reply that another thread receives.
 */
 int twWs_Connect(twWs * ws, uint32_t timeout);
 
+/**
+ * \brief Attaches a reconnect policy (see twWsReconnect.h).  From then on,
+ * whenever the connection drops, whether on a socket error, a close from
+ * the server or twWs_Disconnect(), twWs_Connect() waits out the policy's
+ * backoff and budget.
+ *
+ * \param[in]     ws        The ::twWs structure to configure.
+ * \param[in]     policy    The policy, or NULL to go back to connecting as
+ *                          soon as twWs_Connect() is called.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The policy must outlive the websocket, or be detached first.
+*/
+int twWs_SetReconnectPolicy(twWs * ws, struct twWsReconnect * policy);
+
 /**
  * \brief Disconnect a websocket connection from the server.
  *
@@ -222,6 +432,9 @@ int twWs_RegisterBinaryMessageCallback(twWs * ws, ws_data_cb cb);
  *
  * \return #TW_OK if successful, positive integral on error code (see
  * twErrors.h) if an error was encountered.
+ *
+ * \note Messages are validated as UTF-8 before they are delivered.  A
+ * message that isn't closes the connection with #INVALID_DATA.
 */
 int twWs_RegisterTextMessageCallback(twWs * ws, ws_data_cb cb);
 
@@ -249,6 +462,259 @@ int twWs_RegisterPingCallback(twWs * ws, ws_data_cb cb);
 */
 int twWs_RegisterPongCallback(twWs * ws, ws_data_cb cb);
 
+/**
+ * \brief Registers a function to be called with the payload of each text or
+ * binary frame as it arrives, instead of reassembling complete messages.
+ *
+ * \param[in]     ws        The ::twWs structure to register with.
+ * \param[in]     cb        A pointer to the function to register, or NULL to
+ *                          go back to reassembling messages.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The callback gets the opcode of the message (0x01 text, 0x02 binary)
+ * on every fragment, and #WS_FRAGMENT_FIRST / #WS_FRAGMENT_LAST flags marking
+ * where the message starts and ends.  A message sent in a single frame is
+ * delivered once with both flags set.
+ * \note While registered, the text and binary message callbacks are not
+ * called and there is no limit on message size.  At most one frame is
+ * buffered per connection.
+ * \note Register before connecting.  Switching modes part way through a
+ * message is not supported.
+ * \note Text fragments have been validated as UTF-8 so far, but a code point
+ * may be split between fragments.
+*/
+int twWs_RegisterFragmentCallback(twWs * ws, ws_fragment_cb cb);
+
+/**
+ * \brief Switches the websocket to loaned buffer mode, where each complete
+ * text or binary message is received into a reference counted buffer whose
+ * ownership passes to the application.
+ *
+ * \param[in]     ws           The ::twWs structure to register with.
+ * \param[in]     cb           A pointer to the function to hand each message
+ *                             to, or NULL to go back to the text and binary
+ *                             message callbacks.
+ * \param[in]     maxPooled    The number of released buffers to keep for
+ *                             reuse.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The callback owns the one reference the buffer arrives with.  It may
+ * queue the buffer for another thread without copying it, and must
+ * eventually call twWs_ReleaseBuffer().
+ * \note Buffers may be released after the websocket is deleted.
+ * \note Ignored while a fragment callback is registered.
+*/
+int twWs_EnableLoanedBuffers(twWs * ws, ws_buffer_cb cb, uint32_t maxPooled);
+
+/**
+ * \brief Takes an additional reference to a loaned buffer.
+ *
+ * \param[in]     buffer    The buffer to retain.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWs_RetainBuffer(twWsBuffer * buffer);
+
+/**
+ * \brief Drops a reference to a loaned buffer, returning it to its pool when
+ * the last reference is released.
+ *
+ * \param[in]     buffer    The buffer to release.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread.
+*/
+int twWs_ReleaseBuffer(twWsBuffer * buffer);
+
+/**
+ * \brief Sets the largest fragmented message the websocket will reassemble.
+ *
+ * \param[in]     ws        The ::twWs structure to configure.
+ * \param[in]     size      The maximum message size (in bytes).
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Fragmented messages are reassembled and delivered to the text or
+ * binary message callback in one piece.  A message that grows past \p size
+ * closes the connection with #FRAME_TOO_LARGE.
+ * \note \p size may not be smaller than the frame size.
+*/
+int twWs_SetMaxMessageSize(twWs * ws, uint32_t size);
+
+/**
+ * \brief Sets the largest data frame the websocket sends.  Longer messages
+ * are split into frames of this size.
+ *
+ * \param[in]     ws        The ::twWs structure to configure.
+ * \param[in]     limit     The largest frame (in bytes), or 0 for the
+ *                          default, which is the size of the send buffer
+ *                          (WS_SEND_BUFFER_SIZE, 16K unless changed, or the
+ *                          frame size if that is smaller).
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Pings and pongs are only sent between frames, so a smaller limit
+ * gets them out sooner while a large message is being sent, at the cost of
+ * more frames.  Frames bigger than the send buffer are written through it a
+ * buffer at a time.
+ * \note \p limit may not be bigger than the frame size.
+*/
+int twWs_SetSendFrameLimit(twWs * ws, uint32_t limit);
+
+/**
+ * \brief Sets how long a websocket may go without receiving a data message
+ * before its buffers are released.
+ *
+ * \param[in]     ws        The ::twWs structure to configure.
+ * \param[in]     idleTime  The idle time (in milliseconds), or 0 to keep
+ *                          buffers for the life of the websocket.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Frame, message, read-ahead and send buffers are allocated when
+ * traffic first needs them, starting small and doubling up to the frame and
+ * message size limits.  Releasing them when a connection goes quiet keeps
+ * memory in line with traffic rather than with the number of connections.
+ * Pings and pongs don't count as traffic.
+*/
+int twWs_SetBufferIdleTime(twWs * ws, uint32_t idleTime);
+
+/**
+ * \brief Releases the buffers of a websocket that has been idle for its
+ * buffer idle time.
+ *
+ * \param[in]     ws        The ::twWs structure to check.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Called by twWs_Receive() whenever it finds nothing to dispatch, and
+ * by a reactor's ping timer.  Only needed when the websocket may go a long
+ * time without either.
+*/
+int twWs_CheckIdle(twWs * ws);
+
+/**
+ * \brief Configures the permessage-deflate extension (RFC 7692) offered when
+ * the websocket connects.
+ *
+ * \param[in]     ws                 The ::twWs structure to configure.
+ * \param[in]     windowBits         The LZ77 window (9-15) offered for both
+ *                                   directions, or 0 to stop offering
+ *                                   compression.
+ * \param[in]     noContextTakeover  If #TRUE, both sides reset their
+ *                                   compressor after every message.  Costs
+ *                                   some ratio on repetitive traffic.
+ * \param[in]     memLevel           zlib memory level (1-9) for the
+ *                                   compressor, or 0 for the zlib default.
+ * \param[in]     threshold          Messages shorter than this (in bytes)
+ *                                   are sent uncompressed.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Takes effect on the next twWs_Connect().  The server may decline,
+ * in which case messages are sent and received uncompressed.
+ * \note A compression context costs roughly 2^(windowBits+2) +
+ * 2^(memLevel+9) bytes to compress plus 2^windowBits to inflate, so small
+ * windows and memory levels suit constrained devices.  Inflated messages are
+ * limited by twWs_SetMaxMessageSize().  The context is kept across
+ * reconnects and reset rather than re-created, and its memory comes from
+ * the websocket allocator (see twWsSlab.h).
+ * \note Requires the SDK to be built with ENABLE_WS_COMPRESSION and zlib.
+*/
+int twWs_EnableCompression(twWs * ws, int8_t windowBits, char noContextTakeover, int memLevel, uint32_t threshold);
+
+/**
+ * \brief Switches on automatic keepalive.  Pings carrying a timestamp are
+ * sent every \p interval, the round trip time is measured from each pong,
+ * and the connection is dropped if no pong arrives for \p missThreshold
+ * intervals.
+ *
+ * \param[in]     ws              The ::twWs structure to configure.
+ * \param[in]     interval        Time (in milliseconds) between pings, or 0
+ *                                to switch keepalive off.
+ * \param[in]     missThreshold   Number of intervals without a pong before
+ *                                the connection is dropped.  0 for the
+ *                                default of 3.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Keepalive runs from twWs_Receive(), or from a reactor's ping timer,
+ * so no extra thread is needed.  A dead connection is handled like a socket
+ * error - the close callback is called with "Keepalive timeout" and the
+ * socket is reset.
+*/
+int twWs_EnableKeepalive(twWs * ws, uint32_t interval, uint32_t missThreshold);
+
+/**
+ * \brief Sends a keepalive ping if one is due, and drops the connection if
+ * the server has stopped answering.
+ *
+ * \param[in]     ws        The ::twWs structure to utilize.
+ *
+ * \return #TW_OK if the connection is alive, positive integral on error code
+ * (see twErrors.h) if it was dropped or the ping could not be sent.
+ *
+ * \note Called by twWs_Receive().  Only needed when the websocket may go a
+ * long time without being received on.
+*/
+int twWs_CheckKeepalive(twWs * ws);
+
+/**
+ * \brief Gets the round trip times measured on the current connection.
+ *
+ * \param[in]     ws        The ::twWs structure to query.
+ * \param[out]    rtt       Set to the round trip time statistics.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread.  Pongs to any ping sent with a NULL
+ * message are measured, whether or not keepalive is on.
+*/
+int twWs_GetRtt(twWs * ws, twWsRtt * rtt);
+
+/**
+ * \brief Takes a snapshot of a websocket's counters.
+ *
+ * \param[in]     ws        The ::twWs structure to query.
+ * \param[out]    stats     Set to the counters.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread.  Counters are read one at a time, so
+ * a snapshot taken while the websocket is busy may be slightly inconsistent
+ * between counters.
+*/
+int twWs_GetStats(twWs * ws, twWsStats * stats);
+
+/**
+ * \brief Takes a snapshot of the counters summed over every websocket in
+ * the process, including ones that have since been deleted.
+ *
+ * \param[out]    stats     Set to the totals.  sendLockWaitMax is the
+ *                          longest wait on any websocket.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread.
+*/
+int twWs_GetAggregateStats(twWsStats * stats);
+
 /**
  * \brief Check the websocket for data and drive the state machine of the
  * websocket.
@@ -266,6 +732,36 @@ int twWs_RegisterPongCallback(twWs * ws, ws_data_cb cb);
 */
 int twWs_Receive(twWs * ws, uint32_t timeout);
 
+/**
+ * \brief Drain the websocket, dispatching as many messages as are available
+ * until the socket would block or a budget runs out.
+ *
+ * \param[in]     ws                  The ::twWs structure to utilize.
+ * \param[in]     timeout             Time (in miliseconds) to wait for data on
+ *                                    the socket.  Only the first read waits,
+ *                                    later reads return immediately.
+ * \param[in]     maxMessages         Maximum number of messages to dispatch,
+ *                                    or 0 for no limit.
+ * \param[in]     maxMicros           Maximum time (in microseconds) to spend
+ *                                    draining, or 0 for no limit.
+ * \param[out]    messagesDispatched  Optional.  Receives the number of
+ *                                    messages handed to callbacks.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note recvMutex is taken once for the whole call, so bursts of messages
+ * are delivered without the per message overhead of twWs_Receive().
+ * \note twWs_Receive() is equivalent to a budget of one message.
+ * \note When the process wide receive budget (see twWsGovernor.h) has no
+ * room for the next frame, or to inflate a compressed one, the rest is left
+ * where it is and the call returns #TW_OK having waited no longer than
+ * \p timeout.  Check receivePaused to tell this from a quiet socket.  The
+ * budget is asked again once #WS_RECEIVE_PAUSE_TIME has passed, however
+ * often this is called in the meantime.
+*/
+int twWs_ReceiveBudget(twWs * ws, uint32_t timeout, uint32_t maxMessages, uint32_t maxMicros, uint32_t * messagesDispatched);
+
 /**
  * \brief Send a message over the websocket.
  *
@@ -279,22 +775,144 @@ int twWs_Receive(twWs * ws, uint32_t timeout);
  * twErrors.h) if an error was encountered.
  *
  * \note The message will be broken up into a series of multipart messages if
- * necessary.
+ * necessary, each no bigger than the send frame limit (see
+ * twWs_SetSendFrameLimit()).  Pings and pongs are sent between them without
+ * waiting for the whole message.
 */
 int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText);
 
+/**
+ * \brief Send a batch of messages over the websocket, packing their frames
+ * into as few writes as possible.
+ *
+ * \param[in]     ws        The ::twWs structure to utilize.
+ * \param[in]     bufs      An array of pointers to the message buffers.
+ * \param[in]     lengths   An array of message lengths.
+ * \param[in]     count     The number of messages in \p bufs.
+ * \param[in]     isText    If #TRUE, will be sent as text messages, if #FALSE
+ *                          will be sent as binary messages.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Each buffer is framed as its own message.  The send mutexes are
+ * taken once for the whole batch.
+ * \note If an error is returned some of the messages may already have been
+ * sent.
+*/
+int twWs_SendMessageBatch(twWs * ws, char ** bufs, uint32_t * lengths, uint32_t count, char isText);
+
+/**
+ * \brief Switches on asynchronous sending, where messages are queued by
+ * twWs_SendMessageAsync() and written out by a writer.
+ *
+ * \param[in]     ws            The ::twWs structure to utilize.
+ * \param[in]     queueDepth    The most messages that may be waiting, or 0
+ *                              to switch asynchronous sending off again.
+ * \param[in]     cb            A pointer to the function to call as each
+ *                              message completes.
+ * \param[in]     startWriter   #TRUE to start a thread for this websocket
+ *                              that writes messages as they are queued.
+ *                              #FALSE if the application will call
+ *                              twWs_DrainSendQueue() itself, for instance
+ *                              from the loop that receives on the websocket.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Not safe to call while other threads are sending, or from a
+ * completion callback.  When switching off, messages still queued are sent
+ * if connected and completed with an error if not.
+ * \note Writer threads need POSIX threads.
+*/
+int twWs_EnableAsyncSend(twWs * ws, uint32_t queueDepth, ws_send_cb cb, char startWriter);
+
+/**
+ * \brief Queue a message to be sent over the websocket and return without
+ * waiting for the network.
+ *
+ * \param[in]     ws        The ::twWs structure to utilize.
+ * \param[in]     buf       A pointer to the message buffer.
+ * \param[in]     length    The length of the message.
+ * \param[in]     isText    If #TRUE, will be sent as a text message, if
+ *                          #FALSE will be sent as a binary message.
+ * \param[in]     userData  Passed to the completion callback.
+ *
+ * \return #TW_OK if the message was queued, #TW_WEBSOCKET_SEND_QUEUE_FULL if
+ * the queue is full, positive integral on error code (see twErrors.h) if
+ * another error was encountered.
+ *
+ * \note Queuing never takes a lock, so any number of threads may send at
+ * once without waiting on each other or on the socket.
+ * \note \p buf is not copied.  It must stay valid until the completion
+ * callback is called with it.  The callback is only called for messages
+ * that were queued.
+ * \note The writer packs whatever has been queued into as few writes as
+ * possible, as twWs_SendMessageBatch() does.  Messages from one thread go
+ * out in the order they were queued.
+*/
+int twWs_SendMessageAsync(twWs * ws, char * buf, uint32_t length, char isText, void * userData);
+
+/**
+ * \brief Sends everything queued by twWs_SendMessageAsync(), calling the
+ * completion callback for each message.
+ *
+ * \param[in]     ws        The ::twWs structure to utilize.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Only needed when asynchronous sending was enabled without a writer
+ * thread.  Safe to call from any thread.
+*/
+int twWs_DrainSendQueue(twWs * ws);
+
+/**
+ * \brief Cork the websocket so outgoing frames are held and packed together
+ * instead of being written immediately.
+ *
+ * \param[in]     ws            The ::twWs structure to utilize.
+ * \param[in]     maxHoldTime   The longest time (in milliseconds) a frame may
+ *                              be held before it is flushed, or 0 to hold
+ *                              until twWs_Uncork() is called or the send
+ *                              buffer fills.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The hold time is enforced on the next send and by twWs_Receive(),
+ * so it is only as precise as the rate those are called at.
+ * \note Control frames are never held.  Sending one flushes anything corked
+ * ahead of it.
+*/
+int twWs_Cork(twWs * ws, uint32_t maxHoldTime);
+
+/**
+ * \brief Uncork the websocket, writing out any held frames.
+ *
+ * \param[in]     ws        The ::twWs structure to utilize.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWs_Uncork(twWs * ws);
+
 /**
  * \brief Send a Ping message over the websocket.
  *
  * \param[in]     ws        The ::twWs structure to utilize.
  * \param[in]     msg       Less than 126 byte NULL-terminated string to send
- *                          with the Ping.
+ *                          with the Ping, or NULL to send a timestamp and
+ *                          measure the round trip time from the Pong.
  *
  * \return #TW_OK if successful, positive integral on error code (see
  * twErrors.h) if an error was encountered.
  *
  * \note The \p msg data <b>must</b> be NULL-terminated and less than 126
  * bytes.
+ * \note If a message is being sent the Ping is slipped in at the next frame
+ * boundary rather than waiting for the whole message, and this returns
+ * without waiting for it to be written.
 */
 int twWs_SendPing(twWs * ws, char * msg);
 
@@ -310,6 +928,8 @@ int twWs_SendPing(twWs * ws, char * msg);
  *
  * \note The \p msg data <b>must</b> be NULL-terminated and less than 126
  * bytes.
+ * \note Sent ahead of the rest of any message in progress, as for
+ * twWs_SendPing().
 */
 int twWs_SendPong(twWs * ws, char * msg);
 
@@ -0,0 +1,368 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  permessage-deflate (RFC 7692) support for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsDeflate.h"
+#include "twErrors.h"
+#include "twLogger.h"
+#include "twWsSlab.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef ENABLE_WS_COMPRESSION
+#include "zlib.h"
+
+struct twWsDeflate {
+	z_stream tx;                            /* Compressor for outgoing messages */
+	z_stream rx;                            /* Decompressor for incoming messages */
+	char * outBuffer;                       /* Holds the last compressed message */
+	uint32_t outBufferSize;
+	twWsDeflateParams params;
+	int txBits;                             /* What the compressor was initialized with, 0 if it isn't */
+	int memLevel;
+};
+#endif
+
+#define DEFLATE_EXTENSION "permessage-deflate"
+
+/**
+* Negotiation
+**/
+int twWsDeflate_FormatOffer(const twWsDeflateParams * offer, char * buf, uint32_t length) {
+	int res = 0;
+	if (!offer || !buf || !length) {
+		TW_LOG(TW_ERROR, "twWsDeflate_FormatOffer: NULL offer or buffer");
+		return TW_INVALID_PARAM;
+	}
+	res = snprintf(buf, length, DEFLATE_EXTENSION "; client_max_window_bits=%d; server_max_window_bits=%d%s%s",
+		offer->clientMaxWindowBits, offer->serverMaxWindowBits,
+		offer->clientNoContextTakeover ? "; client_no_context_takeover" : "",
+		offer->serverNoContextTakeover ? "; server_no_context_takeover" : "");
+	if (res < 0 || (uint32_t)res >= length) {
+		TW_LOG(TW_ERROR, "twWsDeflate_FormatOffer: Buffer too small");
+		return TW_INVALID_PARAM;
+	}
+	return TW_OK;
+}
+
+int twWsDeflate_ParseResponse(const twWsDeflateParams * offer, const char * value, twWsDeflateParams * accepted) {
+	char tmp[256];
+	char * token = NULL;
+	char * next = NULL;
+	char first = TRUE;
+	int i = 0;
+	if (!offer || !value || !accepted) {
+		TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: NULL parameter");
+		return TW_INVALID_PARAM;
+	}
+	if (strlen(value) >= sizeof(tmp)) {
+		TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Extension header too long");
+		return TW_INVALID_PARAM;
+	}
+	/* Names are case insensitive, and none of the values we accept have letters */
+	for (i = 0; value[i]; i++) tmp[i] = (value[i] >= 'A' && value[i] <= 'Z') ? value[i] + 32 : value[i];
+	tmp[i] = 0x00;
+	/* Window sizes the server doesn't mention are the full 15 bits */
+	accepted->clientMaxWindowBits = offer->clientMaxWindowBits;
+	accepted->serverMaxWindowBits = 15;
+	accepted->clientNoContextTakeover = offer->clientNoContextTakeover;
+	accepted->serverNoContextTakeover = FALSE;
+	/* We only ever offer one extension, so a ',' means something we didn't ask for */
+	if (strchr(tmp, ',')) {
+		TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Server accepted more than one extension: %s", value);
+		return TW_INVALID_PARAM;
+	}
+	next = tmp;
+	while (next) {
+		char * eq = NULL;
+		char * end = NULL;
+		token = next;
+		next = strchr(token, ';');
+		if (next) *next++ = 0x00;
+		/* Trim */
+		while (*token == ' ' || *token == '\t') token++;
+		end = token + strlen(token);
+		while (end > token && (end[-1] == ' ' || end[-1] == '\t')) *--end = 0x00;
+		if (first) {
+			if (strcmp(token, DEFLATE_EXTENSION)) {
+				TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Server accepted an extension we didn't offer: %s", token);
+				return TW_INVALID_PARAM;
+			}
+			first = FALSE;
+			continue;
+		}
+		eq = strchr(token, '=');
+		if (eq) *eq++ = 0x00;
+		if (!strcmp(token, "server_no_context_takeover") && !eq) {
+			accepted->serverNoContextTakeover = TRUE;
+		} else if (!strcmp(token, "client_no_context_takeover") && !eq) {
+			accepted->clientNoContextTakeover = TRUE;
+		} else if (!strcmp(token, "server_max_window_bits") && eq) {
+			int bits = atoi(eq);
+			if (bits < 8 || bits > offer->serverMaxWindowBits) {
+				TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Invalid server_max_window_bits: %s", eq);
+				return TW_INVALID_PARAM;
+			}
+			accepted->serverMaxWindowBits = (int8_t)bits;
+		} else if (!strcmp(token, "client_max_window_bits") && eq) {
+			int bits = atoi(eq);
+			/* zlib can't compress within an 8 bit window, so 8 is a window we can't honour */
+			if (bits < 9 || bits > offer->clientMaxWindowBits) {
+				TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Invalid client_max_window_bits: %s", eq);
+				return TW_INVALID_PARAM;
+			}
+			accepted->clientMaxWindowBits = (int8_t)bits;
+		} else {
+			TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Unknown extension parameter: %s", token);
+			return TW_INVALID_PARAM;
+		}
+	}
+	if (first) {
+		TW_LOG(TW_ERROR, "twWsDeflate_ParseResponse: Empty extension header");
+		return TW_INVALID_PARAM;
+	}
+	return TW_OK;
+}
+
+#ifdef ENABLE_WS_COMPRESSION
+/**
+* Helper functions
+**/
+static voidpf slabAlloc(voidpf opaque, uInt items, uInt size) {
+	/* zlib's window, hash chains and state are big, so they are kept for the next context rather than given back to the heap */
+	(void)opaque;
+	return twWsSlab_Alloc((uint32_t)items * size, NULL);
+}
+
+static void slabFree(voidpf opaque, voidpf address) {
+	(void)opaque;
+	twWsSlab_Free(address);
+}
+
+static int checkParams(const twWsDeflateParams * params, int * memLevel) {
+	/* The response parser never agrees to compress with 8 bits */
+	if (*memLevel < 1 || *memLevel > 9) *memLevel = 8;
+	if (params->clientMaxWindowBits < 9 || params->clientMaxWindowBits > 15) {
+		TW_LOG(TW_ERROR, "twWsDeflate: Unsupported client_max_window_bits: %d", params->clientMaxWindowBits);
+		return TW_INVALID_PARAM;
+	}
+	return TW_OK;
+}
+
+static int rxBitsOf(const twWsDeflateParams * params) {
+	/* A larger window is always safe to inflate with */
+	return params->serverMaxWindowBits < 9 ? 9 : params->serverMaxWindowBits;
+}
+
+static int initCompressor(twWsDeflate * d, int txBits, int memLevel) {
+	memset(&d->tx, 0, sizeof(d->tx));
+	d->tx.zalloc = slabAlloc;
+	d->tx.zfree = slabFree;
+	d->txBits = 0;
+	/* Negative window bits - raw deflate, no zlib header or checksum */
+	if (deflateInit2(&d->tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -txBits, memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+		TW_LOG(TW_ERROR, "twWsDeflate: Error initializing compressor");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	d->txBits = txBits;
+	d->memLevel = memLevel;
+	return TW_OK;
+}
+
+static int initDecompressor(twWsDeflate * d, int rxBits) {
+	memset(&d->rx, 0, sizeof(d->rx));
+	d->rx.zalloc = slabAlloc;
+	d->rx.zfree = slabFree;
+	if (inflateInit2(&d->rx, -rxBits) != Z_OK) {
+		TW_LOG(TW_ERROR, "twWsDeflate: Error initializing decompressor");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	return TW_OK;
+}
+
+/**
+* Compression context
+**/
+int twWsDeflate_Create(const twWsDeflateParams * params, int memLevel, twWsDeflate ** entity) {
+	twWsDeflate * d = NULL;
+	int res = TW_OK;
+	if (!params || !entity) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Create: NULL parameter");
+		return TW_INVALID_PARAM;
+	}
+	res = checkParams(params, &memLevel);
+	if (res) return res;
+	d = (twWsDeflate *)TW_CALLOC(sizeof(twWsDeflate), 1);
+	if (!d) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Create: Error allocating compression context");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	d->params = *params;
+	res = initCompressor(d, params->clientMaxWindowBits, memLevel);
+	if (res) {
+		TW_FREE(d);
+		return res;
+	}
+	res = initDecompressor(d, rxBitsOf(params));
+	if (res) {
+		deflateEnd(&d->tx);
+		TW_FREE(d);
+		return res;
+	}
+	*entity = d;
+	return TW_OK;
+}
+
+int twWsDeflate_Reset(twWsDeflate * d, const twWsDeflateParams * params, int memLevel) {
+	int res = TW_OK;
+	if (!d || !params) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Reset: NULL parameter");
+		return TW_INVALID_PARAM;
+	}
+	res = checkParams(params, &memLevel);
+	if (res) return res;
+	/* zlib can't change a compressor's window or memory level in place, so only then is it rebuilt */
+	if (d->txBits != params->clientMaxWindowBits || d->memLevel != memLevel || deflateReset(&d->tx) != Z_OK) {
+		deflateEnd(&d->tx);
+		res = initCompressor(d, params->clientMaxWindowBits, memLevel);
+		if (res) return res;
+	}
+	if (inflateReset2(&d->rx, -rxBitsOf(params)) != Z_OK) {
+		inflateEnd(&d->rx);
+		res = initDecompressor(d, rxBitsOf(params));
+		if (res) return res;
+	}
+	d->params = *params;
+	return TW_OK;
+}
+
+void twWsDeflate_Delete(twWsDeflate * d) {
+	if (!d) return;
+	deflateEnd(&d->tx);
+	inflateEnd(&d->rx);
+	twWsSlab_Free(d->outBuffer);
+	TW_FREE(d);
+}
+
+int twWsDeflate_Compress(twWsDeflate * d, const char * in, uint32_t length, char ** out, uint32_t * outLength) {
+	uint32_t produced = 0;
+	int res = Z_OK;
+	if (!d || !in || !out || !outLength) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Compress: NULL parameter");
+		return TW_INVALID_PARAM;
+	}
+	d->tx.next_in = (Bytef *)in;
+	d->tx.avail_in = length;
+	while (TRUE) {
+		/* Room for the worst case plus the sync flush block in one go, so this normally runs once */
+		uint32_t needed = produced + (uint32_t)deflateBound(&d->tx, d->tx.avail_in) + 16;
+		if (needed > d->outBufferSize) {
+			char * tmp = (char *)twWsSlab_Realloc(d->outBuffer, produced, needed, &d->outBufferSize);
+			if (!tmp) {
+				TW_LOG(TW_ERROR, "twWsDeflate_Compress: Error allocating output buffer");
+				return TW_ERROR_ALLOCATING_MEMORY;
+			}
+			d->outBuffer = tmp;
+		}
+		d->tx.next_out = (Bytef *)d->outBuffer + produced;
+		d->tx.avail_out = d->outBufferSize - produced;
+		res = deflate(&d->tx, Z_SYNC_FLUSH);
+		produced = d->outBufferSize - d->tx.avail_out;
+		if (res != Z_OK && res != Z_BUF_ERROR) {
+			TW_LOG(TW_ERROR, "twWsDeflate_Compress: Compression failed. Error: %d", res);
+			return TW_INVALID_PARAM;
+		}
+		/* A sync flush is complete once it leaves output space unused */
+		if (!d->tx.avail_in && d->tx.avail_out) break;
+	}
+	/* Strip the empty block the sync flush ended with */
+	if (produced >= WS_DEFLATE_TRAILER_LENGTH && !memcmp(d->outBuffer + produced - WS_DEFLATE_TRAILER_LENGTH, WS_DEFLATE_TRAILER, WS_DEFLATE_TRAILER_LENGTH)) {
+		produced -= WS_DEFLATE_TRAILER_LENGTH;
+	}
+	if (d->params.clientNoContextTakeover) deflateReset(&d->tx);
+	*out = d->outBuffer;
+	*outLength = produced;
+	return TW_OK;
+}
+
+int twWsDeflate_Inflate(twWsDeflate * d, const char * in, uint32_t inLength, char * out, uint32_t outLength, uint32_t * consumed, uint32_t * produced) {
+	int res = Z_OK;
+	if (!d || !consumed || !produced) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Inflate: NULL parameter");
+		return TW_INVALID_PARAM;
+	}
+	d->rx.next_in = (Bytef *)in;
+	d->rx.avail_in = inLength;
+	d->rx.next_out = (Bytef *)out;
+	d->rx.avail_out = outLength;
+	res = inflate(&d->rx, Z_SYNC_FLUSH);
+	*consumed = inLength - d->rx.avail_in;
+	*produced = outLength - d->rx.avail_out;
+	if (res == Z_STREAM_END) {
+		/* The server ended the stream with a final block - start afresh for the next message */
+		inflateReset(&d->rx);
+		return TW_OK;
+	}
+	if (res != Z_OK && res != Z_BUF_ERROR) {
+		TW_LOG(TW_ERROR, "twWsDeflate_Inflate: Invalid compressed data. Error: %d", res);
+		return TW_INVALID_PARAM;
+	}
+	return TW_OK;
+}
+
+void twWsDeflate_EndMessage(twWsDeflate * d) {
+	if (d && d->params.serverNoContextTakeover) inflateReset(&d->rx);
+}
+
+#else
+
+/* Built without zlib - negotiation still parses, but a context can never be created */
+int twWsDeflate_Create(const twWsDeflateParams * params, int memLevel, twWsDeflate ** entity) {
+	(void)params;
+	(void)memLevel;
+	(void)entity;
+	TW_LOG(TW_ERROR, "twWsDeflate_Create: Websocket compression requires ENABLE_WS_COMPRESSION");
+	return TW_INVALID_PARAM;
+}
+
+int twWsDeflate_Reset(twWsDeflate * d, const twWsDeflateParams * params, int memLevel) {
+	(void)d;
+	(void)params;
+	(void)memLevel;
+	return TW_INVALID_PARAM;
+}
+
+void twWsDeflate_Delete(twWsDeflate * d) {
+	(void)d;
+}
+
+int twWsDeflate_Compress(twWsDeflate * d, const char * in, uint32_t length, char ** out, uint32_t * outLength) {
+	(void)d;
+	(void)in;
+	(void)length;
+	(void)out;
+	(void)outLength;
+	return TW_INVALID_PARAM;
+}
+
+int twWsDeflate_Inflate(twWsDeflate * d, const char * in, uint32_t inLength, char * out, uint32_t outLength, uint32_t * consumed, uint32_t * produced) {
+	(void)d;
+	(void)in;
+	(void)inLength;
+	(void)out;
+	(void)outLength;
+	(void)consumed;
+	(void)produced;
+	return TW_INVALID_PARAM;
+}
+
+void twWsDeflate_EndMessage(twWsDeflate * d) {
+	(void)d;
+}
+
+#endif
@@ -0,0 +1,165 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsDeflate.h
+ *
+ * \brief permessage-deflate (RFC 7692) support for websockets
+ *
+ * Contains the extension negotiation helpers and the streaming compression
+ * context used by twWebsocket.c.  Compression itself requires zlib and is
+ * only available when built with ENABLE_WS_COMPRESSION.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_DEFLATE_H
+#define TW_WS_DEFLATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Every compressed message ends with an empty stored block which the
+sender strips and the receiver appends before inflating the last frame.
+*/
+#define WS_DEFLATE_TRAILER "\x00\x00\xff\xff"
+#define WS_DEFLATE_TRAILER_LENGTH 4
+
+/**
+ * \brief Parameters of the permessage-deflate extension, either offered in
+ * the handshake request or accepted by the server.
+*/
+typedef struct twWsDeflateParams {
+	int8_t clientMaxWindowBits;             /**< LZ77 window (9-15) we compress with.  zlib has no 8 bit window to compress in. **/
+	int8_t serverMaxWindowBits;             /**< LZ77 window (8-15) the server compresses with. **/
+	char clientNoContextTakeover;           /**< TRUE if we reset our compressor after each message. **/
+	char serverNoContextTakeover;           /**< TRUE if the server resets its compressor after each message. **/
+} twWsDeflateParams;
+
+/**
+ * \brief Opaque compression context, one per connection.
+*/
+struct twWsDeflate;
+typedef struct twWsDeflate twWsDeflate;
+
+/**
+ * \brief Formats the value of the Sec-WebSocket-Extensions request header.
+ *
+ * \param[in]     offer     The parameters to offer.
+ * \param[out]    buf       Buffer to write the header value into.
+ * \param[in]     length    Size of \p buf.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsDeflate_FormatOffer(const twWsDeflateParams * offer, char * buf, uint32_t length);
+
+/**
+ * \brief Parses the value of the Sec-WebSocket-Extensions response header.
+ *
+ * \param[in]     offer     The parameters that were offered.
+ * \param[in]     value     The header value sent by the server.
+ * \param[out]    accepted  The parameters to use for the connection.
+ *
+ * \return #TW_OK if the server accepted permessage-deflate with parameters
+ * compatible with \p offer, positive integral on error code (see twErrors.h)
+ * if the response is invalid and the connection must be failed.
+ *
+ * \note A client_max_window_bits of 8 is refused, since we can't compress
+ * within that window.
+*/
+int twWsDeflate_ParseResponse(const twWsDeflateParams * offer, const char * value, twWsDeflateParams * accepted);
+
+/**
+ * \brief Creates a compression context for a connection.
+ *
+ * \param[in]     params    The negotiated parameters.
+ * \param[in]     memLevel  zlib memory level (1-9) for the compressor.  Lower
+ *                          levels use less memory at some cost in ratio.
+ * \param[out]    entity    A pointer to the newly allocated context.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The calling function retains ownership of \p entity and is
+ * responsible for freeing it via twWsDeflate_Delete().
+ * \note zlib's state, and the buffer compressed messages are written to,
+ * come from the websocket allocator (see twWsSlab.h).
+*/
+int twWsDeflate_Create(const twWsDeflateParams * params, int memLevel, twWsDeflate ** entity);
+
+/**
+ * \brief Readies a context from an earlier connection for a new one, so it
+ * doesn't have to be freed and created again.
+ *
+ * \param[in]     d         The context.
+ * \param[in]     params    The parameters negotiated for the new connection.
+ * \param[in]     memLevel  zlib memory level (1-9) for the compressor.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered, in which case \p d can only be
+ * deleted.
+ *
+ * \note Both directions start afresh.  The compressor is only rebuilt if
+ * its window or memory level has changed.
+*/
+int twWsDeflate_Reset(twWsDeflate * d, const twWsDeflateParams * params, int memLevel);
+
+/**
+ * \brief Frees a compression context.
+ *
+ * \param[in]     d         The context to delete.
+*/
+void twWsDeflate_Delete(twWsDeflate * d);
+
+/**
+ * \brief Compresses a complete message.
+ *
+ * \param[in]     d         The compression context.
+ * \param[in]     in        The message to compress.
+ * \param[in]     length    The length of \p in.
+ * \param[out]    out       Set to the compressed message, with the trailing
+ *                          empty block removed.  Owned by \p d and valid until
+ *                          the next call.
+ * \param[out]    outLength Set to the length of \p out.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsDeflate_Compress(twWsDeflate * d, const char * in, uint32_t length, char ** out, uint32_t * outLength);
+
+/**
+ * \brief Inflates as much of \p in as fits into \p out.
+ *
+ * \param[in]     d         The compression context.
+ * \param[in]     in        Compressed input.
+ * \param[in]     inLength  The length of \p in.
+ * \param[out]    out       Where to write inflated data.
+ * \param[in]     outLength Space available at \p out.
+ * \param[out]    consumed  Set to the number of bytes of \p in used.
+ * \param[out]    produced  Set to the number of bytes written to \p out.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if the input is not valid deflate data.
+ *
+ * \note If \p produced is less than \p outLength, all output available for
+ * the consumed input has been written.
+*/
+int twWsDeflate_Inflate(twWsDeflate * d, const char * in, uint32_t inLength, char * out, uint32_t outLength, uint32_t * consumed, uint32_t * produced);
+
+/**
+ * \brief Marks the end of an inflated message, resetting the decompressor if
+ * the server does not take over its context.
+ *
+ * \param[in]     d         The compression context.
+*/
+void twWsDeflate_EndMessage(twWsDeflate * d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
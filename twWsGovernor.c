@@ -0,0 +1,147 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Process wide budget for receive memory
+ */
+
+#include "twOSPort.h"
+#include "twWsGovernor.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+
+/* The governor's mutex is created by whichever thread first needs it */
+#if defined(_MSC_VER)
+#define WS_CAS_PTR(p, desired) (InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(desired), NULL) == NULL)
+#define WS_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#else
+#define WS_CAS_PTR(p, desired) __extension__ ({ void * expected = NULL; \
+	__atomic_compare_exchange_n((void **)(p), &expected, (void *)(desired), FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define WS_LOAD_PTR(p) __atomic_load_n((void **)(p), __ATOMIC_ACQUIRE)
+#endif
+
+/* All guarded by governorMutex */
+static TW_MUTEX governorMutex = NULL;
+static twWsGovernorClaim * claims = NULL;
+static uint64_t budget = WS_RECEIVE_BUDGET;
+static uint64_t reserved = 0;
+static uint64_t peak = 0;
+static uint64_t consumers = 0;
+static uint64_t paused = 0;
+static uint64_t pauses = 0;
+static twWsGovernorClaim * overrun = NULL;
+
+static TW_MUTEX governorLock() {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&governorMutex);
+	if (m) return m;
+	m = twMutex_Create();
+	if (!m) return NULL;
+	if (!WS_CAS_PTR(&governorMutex, m)) twMutex_Delete(m);
+	return (TW_MUTEX)WS_LOAD_PTR(&governorMutex);
+}
+
+static char mayOverrun(twWsGovernorClaim * claim) {
+	/*
+	TRUE if this claim is the one allowed past the budget.  Without one,
+	websockets part way through messages could wait on each other forever.
+	It goes to whichever waiting claim holds the most, so the message
+	nearest done finishes and gives its memory back, and keeps it until it
+	releases.  Only called when the budget is spent, so the scan is off the
+	common path.
+	*/
+	twWsGovernorClaim * c = NULL;
+	if (overrun) return overrun == claim;
+	overrun = claim;
+	for (c = claims; c; c = c->next) {
+		if (c->paused && c->bytes > overrun->bytes) overrun = c;
+	}
+	return overrun == claim;
+}
+
+int twWsGovernor_SetBudget(uint64_t bytes) {
+	TW_MUTEX m = governorLock();
+	if (!m) {
+		TW_LOG(TW_ERROR, "twWsGovernor_SetBudget: Error creating governor mutex");
+		return TW_ERROR_CREATING_MTX;
+	}
+	twMutex_Lock(m);
+	budget = bytes;
+	twMutex_Unlock(m);
+	return TW_OK;
+}
+
+char twWsGovernor_Reserve(twWsGovernorClaim * claim, uint32_t bytes) {
+	TW_MUTEX m = NULL;
+	if (!claim || !bytes) return TRUE;
+	if (!(m = governorLock())) return TRUE;
+	twMutex_Lock(m);
+	if (budget && reserved + bytes > budget && !mayOverrun(claim)) {
+		if (!claim->paused) {
+			claim->paused = TRUE;
+			paused++;
+			pauses++;
+		}
+		twMutex_Unlock(m);
+		return FALSE;
+	}
+	if (claim->paused) {
+		claim->paused = FALSE;
+		paused--;
+	}
+	if (!claim->bytes) {
+		claim->prev = NULL;
+		claim->next = claims;
+		if (claims) claims->prev = claim;
+		claims = claim;
+		consumers++;
+	}
+	claim->bytes += bytes;
+	reserved += bytes;
+	if (reserved > peak) peak = reserved;
+	twMutex_Unlock(m);
+	return TRUE;
+}
+
+void twWsGovernor_Release(twWsGovernorClaim * claim) {
+	TW_MUTEX m = NULL;
+	if (!claim || (!claim->bytes && !claim->paused)) return;
+	/* A claim only holds anything once the mutex exists */
+	m = (TW_MUTEX)WS_LOAD_PTR(&governorMutex);
+	twMutex_Lock(m);
+	if (claim->paused) {
+		claim->paused = FALSE;
+		paused--;
+	}
+	if (claim->bytes) {
+		if (claim->prev) claim->prev->next = claim->next;
+		else claims = claim->next;
+		if (claim->next) claim->next->prev = claim->prev;
+		claim->prev = NULL;
+		claim->next = NULL;
+		reserved -= claim->bytes;
+		claim->bytes = 0;
+		consumers--;
+	}
+	if (overrun == claim) overrun = NULL;
+	twMutex_Unlock(m);
+}
+
+int twWsGovernor_GetStats(twWsGovernorStats * stats) {
+	TW_MUTEX m = NULL;
+	if (!stats) {
+		TW_LOG(TW_ERROR, "twWsGovernor_GetStats: NULL stats pointer");
+		return TW_INVALID_PARAM;
+	}
+	memset(stats, 0, sizeof(twWsGovernorStats));
+	m = (TW_MUTEX)WS_LOAD_PTR(&governorMutex);
+	if (m) twMutex_Lock(m);
+	stats->budget = budget;
+	stats->reserved = reserved;
+	stats->peak = peak;
+	stats->consumers = consumers;
+	stats->paused = paused;
+	stats->pauses = pauses;
+	if (m) twMutex_Unlock(m);
+	return TW_OK;
+}
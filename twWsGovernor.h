@@ -0,0 +1,121 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsGovernor.h
+ *
+ * \brief Process wide budget for receive memory
+ *
+ * Each websocket holds on to the frames of a message until the last one has
+ * arrived, and on its own has no idea what the others are holding.  When a
+ * lot of big messages arrive at once that can add up to more than the
+ * device has.  The governor keeps a count, across every websocket, of the
+ * bytes of data frames that have been received, or are about to be, and not
+ * yet delivered, and twWs_Receive() reserves each frame's body against a
+ * budget before it reads it.
+ *
+ * When a frame doesn't fit, the websocket stops reading and leaves the rest
+ * in the socket, so the server is slowed by TCP flow control, until enough
+ * has been delivered elsewhere to make room.  Frames are only let in while
+ * the total stays within the budget, so a small frame can still get in
+ * while a big one waits.  So that messages part way through can't all end
+ * up waiting on each other, one websocket at a time, the waiting one
+ * holding the most, may go past the budget until its message is delivered.
+ * The total can go over the budget by no more than that one message.
+ *
+ * Compressed messages are counted as they arrive, and again as the buffers
+ * they are inflated into grow.  Control frames are never counted, but one
+ * that arrives behind a paused frame waits with it, so keepalive timeouts
+ * should allow for the longest pause expected.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_GOVERNOR_H
+#define TW_WS_GOVERNOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Initial budget (in bytes), 0 for none */
+#ifndef WS_RECEIVE_BUDGET
+#define WS_RECEIVE_BUDGET 0
+#endif
+
+/* Time (in milliseconds) a paused websocket waits before asking again */
+#ifndef WS_RECEIVE_PAUSE_TIME
+#define WS_RECEIVE_PAUSE_TIME 10
+#endif
+
+/**
+ * \brief One consumer's share of the budget.  Embedded in each ::twWs and
+ * only touched through the functions below.
+*/
+typedef struct twWsGovernorClaim {
+	uint64_t bytes;                         /**< Bytes reserved. **/
+	char paused;                            /**< TRUE if the last reservation was refused. **/
+	struct twWsGovernorClaim * prev;        /**< Links in the list of claims holding memory. **/
+	struct twWsGovernorClaim * next;
+} twWsGovernorClaim;
+
+/**
+ * \brief Governor statistics.
+*/
+typedef struct twWsGovernorStats {
+	uint64_t budget;                        /**< The budget, 0 if there is none. **/
+	uint64_t reserved;                      /**< Bytes reserved now. **/
+	uint64_t peak;                          /**< The most that has been reserved at once. **/
+	uint64_t consumers;                     /**< Claims holding memory now. **/
+	uint64_t paused;                        /**< Claims paused now. **/
+	uint64_t pauses;                        /**< Times a claim has been paused. **/
+} twWsGovernorStats;
+
+/**
+ * \brief Sets the budget.
+ *
+ * \param[in]     budget    Bytes that may be reserved at once, or 0 for no
+ *                          limit.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Lowering the budget below what is reserved doesn't take anything
+ * back.  Reservations are refused until enough has been released.
+*/
+int twWsGovernor_SetBudget(uint64_t budget);
+
+/**
+ * \brief Reserves memory for a claim.
+ *
+ * \param[in]     claim     The claim.
+ * \param[in]     bytes     Bytes to add to it.
+ *
+ * \return #TRUE if the bytes were reserved, #FALSE if the claim should wait
+ * and ask again.
+*/
+char twWsGovernor_Reserve(twWsGovernorClaim * claim, uint32_t bytes);
+
+/**
+ * \brief Releases everything a claim has reserved.
+ *
+ * \param[in]     claim     The claim.
+*/
+void twWsGovernor_Release(twWsGovernorClaim * claim);
+
+/**
+ * \brief Gets the governor's statistics.
+ *
+ * \param[out]    stats     Where to copy them.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsGovernor_GetStats(twWsGovernorStats * stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
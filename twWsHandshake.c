@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  HTTP upgrade handshake for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsHandshake.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#define WS_VERSION "13"
+
+/* Parser states */
+#define HS_VERSION 0
+#define HS_STATUS 1
+#define HS_REASON 2
+#define HS_LINE_START 3
+#define HS_NAME 4
+#define HS_NAME_END 5
+#define HS_VALUE_START 6
+#define HS_VALUE 7
+#define HS_DONE 8
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+#define TO_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + 32 : (c))
+
+/**
+* Request
+**/
+static void append(char * buf, uint32_t size, uint32_t * used, const char * s, uint32_t length) {
+	/* Only the length is tracked once the buffer is full, so the caller can tell how much it needed */
+	if (buf && *used + length < size) memcpy(buf + *used, s, length);
+	*used += length;
+}
+
+#define APPEND(s) append(buf, size, &used, s, sizeof(s) - 1)
+#define APPEND_STR(s) append(buf, size, &used, s, strlen(s))
+
+uint32_t twWsHandshake_FormatRequest(char * buf, uint32_t size, const char * resource, const char * host, uint32_t frameSize,
+                                     const char * extensions, const char * apiKey, uint32_t * keyOffset) {
+	char frameSizeStr[16];
+	uint32_t used = 0;
+	sprintf(frameSizeStr, "%u", frameSize);
+	APPEND("GET ");
+	APPEND_STR(resource);
+	APPEND(" HTTP/1.1\r\n"
+		"User-Agent: ThingWorx C SDK\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Host: ");
+	APPEND_STR(host);
+	APPEND("\r\n"
+		"Sec-WebSocket-Version: " WS_VERSION "\r\n"
+		"Sec-WebSocket-Key: ");
+	if (keyOffset) *keyOffset = used;
+	APPEND("                        ");
+	APPEND("\r\n"
+		"Max-Frame-Size: ");
+	APPEND_STR(frameSizeStr);
+	APPEND("\r\n");
+	if (extensions) {
+		APPEND("Sec-WebSocket-Extensions: ");
+		APPEND_STR(extensions);
+		APPEND("\r\n");
+	}
+	APPEND("appKey: ");
+	APPEND_STR(apiKey);
+	APPEND("\r\n\r\n");
+	if (buf && used < size) buf[used] = 0x00;
+	return used;
+}
+
+/**
+* Response
+**/
+void twWsHandshake_Reset(twWsHandshake * h) {
+	if (!h) return;
+	memset(h, 0, sizeof(twWsHandshake));
+	h->state = HS_VERSION;
+}
+
+static int endHeader(twWsHandshake * h, ws_handshake_header_cb cb, void * arg) {
+	/* Trim trailing whitespace and hand over the header */
+	while (h->valueLength && IS_SPACE(h->value[h->valueLength - 1])) h->valueLength--;
+	h->name[h->nameLength] = 0x00;
+	h->value[h->valueLength] = 0x00;
+	if (h->skipping) {
+		TW_LOG(TW_WARN, "twWsHandshake_Parse: Skipping header too long to keep: %s", h->name);
+	} else if (cb && cb(arg, h->name, h->value)) {
+		return WS_HANDSHAKE_FAILED;
+	}
+	h->nameLength = 0;
+	h->valueLength = 0;
+	h->skipping = FALSE;
+	h->state = HS_LINE_START;
+	return WS_HANDSHAKE_INCOMPLETE;
+}
+
+int twWsHandshake_Parse(twWsHandshake * h, const char * data, uint32_t length, uint32_t * consumed, ws_handshake_header_cb cb, void * arg) {
+	uint32_t i = 0;
+	if (consumed) *consumed = 0;
+	if (!h || (!data && length)) {
+		TW_LOG(TW_ERROR, "twWsHandshake_Parse: NULL parser or data");
+		return WS_HANDSHAKE_FAILED;
+	}
+	if (h->state == HS_DONE) return WS_HANDSHAKE_COMPLETE;
+	/* CRs are dropped wherever they appear - each line ends at its LF */
+	for (i = 0; i < length && h->state != HS_DONE; i++) {
+		char c = data[i];
+		if (++h->total > WS_HANDSHAKE_MAX_SIZE) {
+			TW_LOG(TW_ERROR, "twWsHandshake_Parse: Response headers are larger than %u bytes", WS_HANDSHAKE_MAX_SIZE);
+			return WS_HANDSHAKE_FAILED;
+		}
+		if (c == '\r') continue;
+		switch (h->state) {
+		case HS_VERSION:
+			if (c == ' ') h->state = HS_STATUS;
+			else if (c == '\n') {
+				TW_LOG(TW_ERROR, "twWsHandshake_Parse: Malformed status line");
+				return WS_HANDSHAKE_FAILED;
+			}
+			break;
+		case HS_STATUS:
+			if (c >= '0' && c <= '9' && h->status < 1000) {
+				h->status = h->status * 10 + (c - '0');
+				break;
+			}
+			if (h->status != 101) {
+				TW_LOG(TW_ERROR, "twWsHandshake_Parse: Error initializing web socket.  Response code: %u", h->status);
+				return WS_HANDSHAKE_FAILED;
+			}
+			h->state = (c == '\n') ? HS_LINE_START : HS_REASON;
+			break;
+		case HS_REASON:
+			if (c == '\n') h->state = HS_LINE_START;
+			break;
+		case HS_LINE_START:
+			/* A blank line ends the headers */
+			if (c == '\n') {
+				h->state = HS_DONE;
+				break;
+			}
+			if (IS_SPACE(c) || c == ':') {
+				TW_LOG(TW_ERROR, "twWsHandshake_Parse: Malformed header line");
+				return WS_HANDSHAKE_FAILED;
+			}
+			h->state = HS_NAME;
+			/* Fall through - keep the first character */
+		case HS_NAME:
+			if (c == ':') h->state = HS_VALUE_START;
+			else if (IS_SPACE(c)) h->state = HS_NAME_END;
+			else if (c == '\n') {
+				TW_LOG(TW_ERROR, "twWsHandshake_Parse: Header line without a value");
+				return WS_HANDSHAKE_FAILED;
+			} else if (h->nameLength < WS_HANDSHAKE_NAME_SIZE - 1) h->name[h->nameLength++] = TO_LOWER(c);
+			else h->skipping = TRUE;
+			break;
+		case HS_NAME_END:
+			if (c == ':') h->state = HS_VALUE_START;
+			else if (!IS_SPACE(c)) {
+				TW_LOG(TW_ERROR, "twWsHandshake_Parse: Malformed header line");
+				return WS_HANDSHAKE_FAILED;
+			}
+			break;
+		case HS_VALUE_START:
+			if (IS_SPACE(c)) break;
+			h->state = HS_VALUE;
+			/* Fall through - keep the first character */
+		case HS_VALUE:
+			if (c == '\n') {
+				if (endHeader(h, cb, arg) != WS_HANDSHAKE_INCOMPLETE) return WS_HANDSHAKE_FAILED;
+			} else if (h->valueLength < WS_HANDSHAKE_VALUE_SIZE - 1) h->value[h->valueLength++] = c;
+			else h->skipping = TRUE;
+			break;
+		}
+	}
+	if (consumed) *consumed = i;
+	return h->state == HS_DONE ? WS_HANDSHAKE_COMPLETE : WS_HANDSHAKE_INCOMPLETE;
+}
+
+char twWsHandshake_HasToken(const char * value, const char * token) {
+	uint32_t tokenLength = 0;
+	if (!value || !token) return FALSE;
+	tokenLength = strlen(token);
+	while (*value) {
+		uint32_t i = 0;
+		while (IS_SPACE(*value) || *value == ',') value++;
+		for (i = 0; i < tokenLength && value[i] && TO_LOWER(value[i]) == token[i]; i++);
+		if (i == tokenLength) {
+			/* Whole token only */
+			const char * end = value + i;
+			while (IS_SPACE(*end)) end++;
+			if (!*end || *end == ',') return TRUE;
+		}
+		while (*value && *value != ',') value++;
+	}
+	return FALSE;
+}
@@ -0,0 +1,132 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsHandshake.h
+ *
+ * \brief HTTP upgrade handshake for websockets
+ *
+ * Builds the upgrade request once per set of connection settings, leaving a
+ * slot for the key that changes on every connection, and parses the
+ * server's response a byte at a time as it arrives.  The parser resumes
+ * where it stopped on each call and stops exactly at the end of the
+ * headers, so frames the server sends straight after its response are left
+ * for the frame decoder.  Neither allocates.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_HANDSHAKE_H
+#define TW_WS_HANDSHAKE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Length of the base64 encoded Sec-WebSocket-Key */
+#define WS_HANDSHAKE_KEY_LENGTH 24
+
+/* Longest header name and value kept.  Longer headers are skipped. */
+#define WS_HANDSHAKE_NAME_SIZE 32
+#define WS_HANDSHAKE_VALUE_SIZE 256
+
+/* Most bytes of response headers accepted before giving up on the server */
+#ifndef WS_HANDSHAKE_MAX_SIZE
+#define WS_HANDSHAKE_MAX_SIZE 16384
+#endif
+
+/**
+ * \brief Results of twWsHandshake_Parse().
+*/
+enum ws_handshake_result {
+	WS_HANDSHAKE_INCOMPLETE,                /**< All the data was consumed and more is needed. **/
+	WS_HANDSHAKE_COMPLETE,                  /**< The headers are complete.  Any data after them was not consumed. **/
+	WS_HANDSHAKE_FAILED                     /**< The response was malformed, too big, not a 101, or rejected by the callback. **/
+};
+
+/**
+ * \brief Called with each response header.
+ *
+ * \param[in]     arg       As passed to twWsHandshake_Parse().
+ * \param[in]     name      The header name, in lower case.
+ * \param[in]     value     The value, without surrounding whitespace.
+ *
+ * \return 0 to carry on, non-zero to fail the handshake.
+*/
+typedef int32_t (*ws_handshake_header_cb)(void * arg, char * name, char * value);
+
+/**
+ * \brief Response parser state.
+*/
+typedef struct twWsHandshake {
+	char state;                             /**< Where in the response the parser is. **/
+	char skipping;                          /**< TRUE while skipping a header too long to keep. **/
+	uint16_t status;                        /**< The response status code, once read. **/
+	uint32_t total;                         /**< Bytes of response consumed so far. **/
+	uint32_t nameLength;
+	uint32_t valueLength;
+	char name[WS_HANDSHAKE_NAME_SIZE];      /**< The header being read. **/
+	char value[WS_HANDSHAKE_VALUE_SIZE];
+} twWsHandshake;
+
+/**
+ * \brief Writes an upgrade request with a blank key.
+ *
+ * \param[out]    buf             Where to write the request.  NULL to only
+ *                                work out the length.
+ * \param[in]     size            Size of \p buf.
+ * \param[in]     resource        The resource to request.
+ * \param[in]     host            The Host header.
+ * \param[in]     frameSize       The Max-Frame-Size header.
+ * \param[in]     extensions      The Sec-WebSocket-Extensions header, or NULL
+ *                                for none.
+ * \param[in]     apiKey          The appKey header.
+ * \param[out]    keyOffset       Set to where the #WS_HANDSHAKE_KEY_LENGTH
+ *                                byte key goes.
+ *
+ * \return The length of the request, not counting the terminating NUL.  If
+ * this is not less than \p size, \p buf was too small and nothing was
+ * written.
+*/
+uint32_t twWsHandshake_FormatRequest(char * buf, uint32_t size, const char * resource, const char * host, uint32_t frameSize,
+                                     const char * extensions, const char * apiKey, uint32_t * keyOffset);
+
+/**
+ * \brief Readies a parser for a new response.
+ *
+ * \param[in]     h         The parser.
+*/
+void twWsHandshake_Reset(twWsHandshake * h);
+
+/**
+ * \brief Parses the next piece of a response.
+ *
+ * \param[in]     h         The parser.
+ * \param[in]     data      Response bytes following those already parsed.
+ * \param[in]     length    Number of bytes in \p data.
+ * \param[out]    consumed  Set to the number of bytes parsed.  Less than
+ *                          \p length only once the headers are complete.
+ * \param[in]     cb        Called with each header as it completes.
+ * \param[in]     arg       Passed to \p cb.
+ *
+ * \return One of ::ws_handshake_result.
+*/
+int twWsHandshake_Parse(twWsHandshake * h, const char * data, uint32_t length, uint32_t * consumed, ws_handshake_header_cb cb, void * arg);
+
+/**
+ * \brief Tests if a header value's comma separated list contains a token,
+ * ignoring case.
+ *
+ * \param[in]     value     The header value.
+ * \param[in]     token     The token to look for, in lower case.
+ *
+ * \return #TRUE if found.
+*/
+char twWsHandshake_HasToken(const char * value, const char * token);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1005 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Event loop driving many websockets from one thread
+ */
+
+#ifdef __linux__
+/* For CPU affinity */
+#define _GNU_SOURCE
+#endif
+
+#include "twOSPort.h"
+#include "twWsReactor.h"
+#include "twErrors.h"
+#include "twLogger.h"
+#include "twWsTransport.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define REACTOR_DEFAULT_BUDGET 16
+#define REACTOR_MAX_EVENTS 256
+
+/* Most worker threads a reactor starts for connects and pings, which can block */
+#define REACTOR_MAX_WORKERS 4
+
+/* Work handed to a worker thread */
+#define REACTOR_JOB_NONE 0
+#define REACTOR_JOB_CONNECT 1
+#define REACTOR_JOB_PING 2
+
+/* A shard must be the busiest, by this ratio over the average, for this many rebalance intervals running before a connection moves */
+#define REBALANCE_RATIO_PERCENT 125
+#define REBALANCE_WINDOWS 3
+
+/* Monotonic clock from twWebsocket.c */
+uint64_t wsGetMicros();
+
+typedef struct twWsReactorEntry {
+	twWs * ws;
+	int fd;                                 /* Descriptor registered with epoll, -1 if none */
+	uint32_t connectTimeout;
+	uint32_t pingInterval;
+	uint32_t reconnectInterval;
+	uint64_t nextConnect;                   /* Timers are in wsGetMicros() time */
+	uint64_t nextPing;
+	char ready;                             /* Readable, or the budget ran out with data still buffered */
+	char hangup;                            /* The peer has gone - drain what is left then drop the connection */
+	char paused;                            /* Over the receive budget - the socket isn't watched until resume */
+	uint64_t resume;
+	char removed;
+	uint32_t holds;                         /* Removers waiting on a job - the entry isn't freed until they are done */
+#ifdef __linux__
+	char job;                               /* Work handed to a worker, REACTOR_JOB_NONE if none.  Set and cleared by the loop under mtx. */
+	char jobRunning;                        /* The rest are guarded by jobMtx */
+	char jobDone;
+	int jobResult;
+	pthread_t jobThread;
+	struct twWsReactorEntry * nextJob;
+#endif
+	uint64_t busy;                          /* Time spent servicing this poll, folded into load under the lock */
+	uint64_t load;                          /* Time spent servicing since the last rebalance */
+	struct twWsReactor * migrateTo;         /* Set by the rebalancer - the owning loop moves the entry */
+	struct twWsReactorEntry * next;
+} twWsReactorEntry;
+
+/*
+The entry list is guarded by mtx.  Only the thread in twWsReactor_Poll
+touches an entry's timers and flags, so it drops the lock while it services
+websockets.  Removed entries are parked on the graveyard until the start of
+the next poll, since the loop may still hold pointers to them, and for as
+long as a worker is still busy with them.
+
+Connecting and sending pings can block for as long as the network takes,
+so the loop queues them for worker threads, started as needed, and picks
+up the result once the worker wakes it.  jobMtx guards the queue and the
+workers, and is taken after mtx.
+*/
+struct twWsReactor {
+	TW_MUTEX mtx;
+	int epfd;
+	int wakefd;
+	uint32_t messageBudget;
+	twWsReactorEntry * entries;
+	twWsReactorEntry * graveyard;
+	uint32_t count;
+	twWsReactorEntry ** work;
+	uint32_t workSize;
+	char stopped;
+	uint64_t load;                          /* Time spent servicing since the last rebalance */
+	uint32_t pendingMigrations;
+	struct twWsReactorGroup * group;        /* The group this reactor is a shard of, if any */
+#ifdef __linux__
+	pthread_mutex_t jobMtx;
+	pthread_cond_t jobCond;                 /* Signalled whenever a job is queued or finished, or the workers are stopped */
+	twWsReactorEntry * jobs;
+	twWsReactorEntry * jobsTail;
+	uint32_t queued;
+	pthread_t workers[REACTOR_MAX_WORKERS];
+	uint32_t workerCount;
+	uint32_t idleWorkers;
+	char workersStopped;
+#endif
+};
+
+#ifdef __linux__
+
+/*
+A group shards websockets over several reactors, each run by its own thread.
+mtx is held while websockets are added, removed or moved between shards so
+a websocket is always found in exactly one of them.  Lock order is the
+group's mtx, then a reactor's.
+*/
+typedef struct twWsShard {
+	twWsReactor * reactor;
+	pthread_t thread;
+	int cpu;                                /* CPU to pin the thread to, -1 for none */
+	char started;
+} twWsShard;
+
+struct twWsReactorGroup {
+	TW_MUTEX mtx;
+	twWsShard * shards;
+	uint32_t shardCount;
+	uint32_t rebalanceInterval;
+	pthread_t rebalancer;
+	char rebalancerStarted;
+	char stopped;
+	uint64_t * loads;
+	uint32_t hotShard;
+	uint32_t hotWindows;
+};
+
+/**
+* Helper functions
+**/
+static int socketOf(twWs * ws) {
+	return twWsTransport_Fd(ws->transport);
+}
+
+static void watchSocket(twWsReactor * r, twWsReactorEntry * e) {
+	/* (Re)register the websocket's current socket.  Caller must hold mtx. */
+	struct epoll_event ev;
+	if (e->fd >= 0) epoll_ctl(r->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	e->fd = socketOf(e->ws);
+	e->hangup = FALSE;
+	if (e->fd < 0) return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = e;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, e->fd, &ev)) {
+		TW_LOG(TW_ERROR, "twWsReactor: Error watching socket %d.  Error: %d", e->fd, errno);
+		e->fd = -1;
+	}
+}
+
+static void unwatchSocket(twWsReactor * r, twWsReactorEntry * e) {
+	/* Caller must hold mtx */
+	if (e->fd >= 0) epoll_ctl(r->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+	e->fd = -1;
+}
+
+static void wakeReactor(twWsReactor * r) {
+	uint64_t one = 1;
+	if (write(r->wakefd, &one, sizeof(one)) < 0) TW_LOG(TW_DEBUG, "twWsReactor: Wake already pending");
+}
+
+static void freeEntries(twWsReactorEntry * e) {
+	while (e) {
+		twWsReactorEntry * next = e->next;
+		TW_FREE(e);
+		e = next;
+	}
+}
+
+static uint64_t reconnectTime(twWsReactorEntry * e, uint64_t now) {
+	/* A websocket with a reconnect policy has already worked out its own backoff */
+	if (e->ws->reconnect) return e->ws->nextReconnect > now ? e->ws->nextReconnect : now;
+	return now + (uint64_t)e->reconnectInterval * 1000;
+}
+
+static twWsReactorEntry * freeFinished(twWsReactorEntry * e) {
+	/* Free the graveyard entries nothing is using any more, returning the rest.  Caller must hold mtx. */
+	twWsReactorEntry * kept = NULL;
+	while (e) {
+		twWsReactorEntry * next = e->next;
+		if (e->job || e->holds) {
+			e->next = kept;
+			kept = e;
+		} else TW_FREE(e);
+		e = next;
+	}
+	return kept;
+}
+
+static int runJob(twWsReactorEntry * e) {
+	twWs * ws = e->ws;
+	int res = TW_OK;
+	if (e->job == REACTOR_JOB_CONNECT) {
+		TW_LOG(TW_DEBUG, "twWsReactor: Connecting websocket to %s:%d", ws->host, ws->port);
+		return twWs_Connect(ws, e->connectTimeout);
+	}
+	/* With keepalive on the websocket paces its own pings, we just make sure it gets to check */
+	if (!ws->keepaliveInterval) res = twWs_SendPing(ws, NULL);
+	else twWs_CheckKeepalive(ws);
+	return res;
+}
+
+static void * workerMain(void * arg) {
+	twWsReactor * r = (twWsReactor *)arg;
+	pthread_mutex_lock(&r->jobMtx);
+	while (!r->workersStopped) {
+		twWsReactorEntry * e = r->jobs;
+		int res = TW_OK;
+		if (!e) {
+			r->idleWorkers++;
+			pthread_cond_wait(&r->jobCond, &r->jobMtx);
+			r->idleWorkers--;
+			continue;
+		}
+		r->jobs = e->nextJob;
+		if (!r->jobs) r->jobsTail = NULL;
+		r->queued--;
+		e->jobRunning = TRUE;
+		e->jobThread = pthread_self();
+		pthread_mutex_unlock(&r->jobMtx);
+		res = runJob(e);
+		pthread_mutex_lock(&r->jobMtx);
+		e->jobRunning = FALSE;
+		e->jobResult = res;
+		e->jobDone = TRUE;
+		pthread_cond_broadcast(&r->jobCond);
+		wakeReactor(r);
+	}
+	pthread_mutex_unlock(&r->jobMtx);
+	return NULL;
+}
+
+static void queueJob(twWsReactor * r, twWsReactorEntry * e, char job) {
+	/* Only called by the loop, for an entry with no job */
+	char here = FALSE;
+	twMutex_Lock(r->mtx);
+	if (e->removed) {
+		/* Its remover didn't see a job to wait for */
+		twMutex_Unlock(r->mtx);
+		return;
+	}
+	e->job = job;
+	twMutex_Unlock(r->mtx);
+	pthread_mutex_lock(&r->jobMtx);
+	e->jobDone = FALSE;
+	e->nextJob = NULL;
+	if (r->jobsTail) r->jobsTail->nextJob = e;
+	else r->jobs = e;
+	r->jobsTail = e;
+	/* Start another worker if the ones there are all have something to do */
+	r->queued++;
+	if (r->idleWorkers < r->queued && r->workerCount < REACTOR_MAX_WORKERS) {
+		if (!pthread_create(&r->workers[r->workerCount], NULL, workerMain, r)) r->workerCount++;
+		else TW_LOG(TW_WARN, "twWsReactor: Error starting worker thread");
+	}
+	if (!r->workerCount) {
+		/* Nothing to hand it to, so do it here as a last resort */
+		r->jobs = NULL;
+		r->jobsTail = NULL;
+		r->queued = 0;
+		here = TRUE;
+	}
+	pthread_cond_broadcast(&r->jobCond);
+	pthread_mutex_unlock(&r->jobMtx);
+	if (here) {
+		int res = runJob(e);
+		pthread_mutex_lock(&r->jobMtx);
+		e->jobResult = res;
+		e->jobDone = TRUE;
+		pthread_mutex_unlock(&r->jobMtx);
+	}
+}
+
+static void finishJobs(twWsReactor * r, twWsReactorEntry * e, uint64_t now) {
+	/* Pick up the results of finished jobs.  Caller must hold mtx. */
+	for (; e; e = e->next) {
+		char job = e->job;
+		char done = FALSE;
+		int res = TW_OK;
+		if (!job) continue;
+		pthread_mutex_lock(&r->jobMtx);
+		done = e->jobDone;
+		res = e->jobResult;
+		pthread_mutex_unlock(&r->jobMtx);
+		if (!done) continue;
+		e->job = REACTOR_JOB_NONE;
+		if (e->removed) continue;
+		if (job == REACTOR_JOB_CONNECT) {
+			if (res) {
+				TW_LOG(TW_WARN, "twWsReactor: Error connecting websocket to %s:%d.  Error: %d", e->ws->host, e->ws->port, res);
+				e->nextConnect = reconnectTime(e, now);
+				continue;
+			}
+			watchSocket(r, e);
+			e->nextPing = now + (uint64_t)e->pingInterval * 1000;
+			/* The handshake may have brought frames with it */
+			e->ready = TRUE;
+		} else if (!twWs_IsConnected(e->ws)) {
+			/* The keepalive gave up on it */
+			unwatchSocket(r, e);
+			e->nextConnect = reconnectTime(e, now);
+		}
+	}
+}
+
+static char detachEntry(twWsReactor * r, twWs * ws, twWsReactorEntry ** held) {
+	/*
+	Move the websocket's entry to the graveyard.  If a worker has it, the
+	entry is held for the caller to pass to awaitJob().  Otherwise it may be
+	freed as soon as this returns.
+	*/
+	twWsReactorEntry ** link = NULL;
+	*held = NULL;
+	twMutex_Lock(r->mtx);
+	for (link = &r->entries; *link; link = &(*link)->next) {
+		twWsReactorEntry * e = *link;
+		if (e->ws != ws) continue;
+		*link = e->next;
+		r->count--;
+		unwatchSocket(r, e);
+		e->removed = TRUE;
+		e->next = r->graveyard;
+		r->graveyard = e;
+		if (e->job) {
+			e->holds++;
+			*held = e;
+		}
+		twMutex_Unlock(r->mtx);
+		return TRUE;
+	}
+	twMutex_Unlock(r->mtx);
+	return FALSE;
+}
+
+static void awaitJob(twWsReactor * r, twWsReactorEntry * e) {
+	/* Drop a job that hasn't started, or wait for one that has, unless this is the worker running it */
+	twWsReactorEntry ** link = NULL;
+	pthread_mutex_lock(&r->jobMtx);
+	for (link = &r->jobs; *link && *link != e; link = &(*link)->nextJob);
+	if (*link) {
+		*link = e->nextJob;
+		r->queued--;
+		if (r->jobsTail == e) {
+			twWsReactorEntry * last = NULL;
+			for (last = r->jobs; last && last->nextJob; last = last->nextJob);
+			r->jobsTail = last;
+		}
+		e->jobDone = TRUE;
+		e->jobResult = TW_OK;
+	} else if (!e->jobRunning || !pthread_equal(e->jobThread, pthread_self())) {
+		while (!e->jobDone) pthread_cond_wait(&r->jobCond, &r->jobMtx);
+	}
+	pthread_mutex_unlock(&r->jobMtx);
+	twMutex_Lock(r->mtx);
+	e->holds--;
+	twMutex_Unlock(r->mtx);
+	wakeReactor(r);
+}
+
+static void migrateEntries(twWsReactor * r) {
+	/*
+	Hand entries the rebalancer marked over to their new shard.  Only the
+	owning loop does this, between polls, so nothing is in progress on them.
+	*/
+	twWsReactorEntry ** link = NULL;
+	twWsReactorEntry * moving = NULL;
+	twMutex_Lock(r->group->mtx);
+	twMutex_Lock(r->mtx);
+	link = &r->entries;
+	while (*link) {
+		twWsReactorEntry * e = *link;
+		if (!e->migrateTo || e->job) {
+			/* A worker may still be using it, so it stays put */
+			e->migrateTo = NULL;
+			link = &e->next;
+			continue;
+		}
+		*link = e->next;
+		r->count--;
+		unwatchSocket(r, e);
+		e->next = moving;
+		moving = e;
+	}
+	r->pendingMigrations = 0;
+	twMutex_Unlock(r->mtx);
+	while (moving) {
+		twWsReactorEntry * e = moving;
+		twWsReactor * to = e->migrateTo;
+		moving = e->next;
+		TW_LOG(TW_DEBUG, "twWsReactor: Migrating websocket for %s:%d to a less loaded shard", e->ws->host, e->ws->port);
+		twMutex_Lock(to->mtx);
+		e->migrateTo = NULL;
+		e->load = 0;
+		/* A paused entry stays unwatched, or its readable socket would spin the new loop, until its pause is over */
+		e->ready = !e->paused;
+		if (twWs_IsConnected(e->ws) && !e->paused) watchSocket(to, e);
+		e->next = to->entries;
+		to->entries = e;
+		to->count++;
+		twMutex_Unlock(to->mtx);
+		wakeReactor(to);
+	}
+	twMutex_Unlock(r->group->mtx);
+}
+
+static void serviceEntry(twWsReactor * r, twWsReactorEntry * e, uint64_t now) {
+	twWs * ws = e->ws;
+	uint32_t dispatched = 0;
+	int res = TW_OK;
+	char removed = FALSE;
+	twMutex_Lock(r->mtx);
+	removed = e->removed;
+	twMutex_Unlock(r->mtx);
+	if (removed || e->job == REACTOR_JOB_CONNECT) return;
+	if (!twWs_IsConnected(ws)) {
+		e->ready = FALSE;
+		e->paused = FALSE;
+		/* Let a ping in progress finish first */
+		if (e->job || now < e->nextConnect) return;
+		/* The old socket may be replaced, so stop watching it first */
+		twMutex_Lock(r->mtx);
+		unwatchSocket(r, e);
+		twMutex_Unlock(r->mtx);
+		queueJob(r, e, REACTOR_JOB_CONNECT);
+		return;
+	}
+	if (e->paused && now >= e->resume) e->ready = TRUE;
+	if (e->ready) {
+		e->ready = FALSE;
+		res = twWs_ReceiveBudget(ws, 0, r->messageBudget, 0, &dispatched);
+		/* The peer has gone, but only drop the connection once everything it sent, close frame and all, has been drained */
+		if (!res && e->hangup && twWs_IsConnected(ws) && dispatched < r->messageBudget && !ws->receivePaused) {
+			TW_LOG(TW_WARN, "twWsReactor: Connection to %s:%d lost", ws->host, ws->port);
+			twWs_Disconnect(ws, SERVER_CLOSED, "Connection lost");
+		}
+		if (res || !twWs_IsConnected(ws)) {
+			twMutex_Lock(r->mtx);
+			unwatchSocket(r, e);
+			twMutex_Unlock(r->mtx);
+			e->nextConnect = reconnectTime(e, wsGetMicros());
+			return;
+		}
+		if (ws->receivePaused) {
+			/* The socket stays readable while its data waits, so stop watching it until it's time to ask again */
+			if (!e->paused) {
+				twMutex_Lock(r->mtx);
+				unwatchSocket(r, e);
+				twMutex_Unlock(r->mtx);
+				e->paused = TRUE;
+			}
+			e->resume = wsGetMicros() + (uint64_t)WS_RECEIVE_PAUSE_TIME * 1000;
+		} else if (e->paused) {
+			e->paused = FALSE;
+			twMutex_Lock(r->mtx);
+			if (!e->removed) watchSocket(r, e);
+			twMutex_Unlock(r->mtx);
+			/* What arrived while it wasn't watched won't be announced */
+			e->ready = TRUE;
+		}
+		/* Out of budget - there may be more in our buffers than epoll can see */
+		if (dispatched >= r->messageBudget) e->ready = TRUE;
+	}
+	if (e->pingInterval && now >= e->nextPing) {
+		e->nextPing = now + (uint64_t)e->pingInterval * 1000;
+		/* A ping waits for room to send it, so it is sent from a worker */
+		if (!e->job) queueJob(r, e, REACTOR_JOB_PING);
+		/* Quiet connections may not be received on for a long time */
+		twWs_CheckIdle(ws);
+	}
+}
+
+/**
+* Reactor functions
+**/
+int twWsReactor_Create(uint32_t messageBudget, twWsReactor ** entity) {
+	twWsReactor * r = NULL;
+	struct epoll_event ev;
+	if (!entity) {
+		TW_LOG(TW_ERROR, "twWsReactor_Create: NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	r = (twWsReactor *)TW_CALLOC(sizeof(twWsReactor), 1);
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReactor_Create: Error allocating reactor");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	r->epfd = -1;
+	r->wakefd = -1;
+	pthread_mutex_init(&r->jobMtx, NULL);
+	pthread_cond_init(&r->jobCond, NULL);
+	r->messageBudget = messageBudget ? messageBudget : REACTOR_DEFAULT_BUDGET;
+	r->mtx = twMutex_Create();
+	if (!r->mtx) {
+		TW_LOG(TW_ERROR, "twWsReactor_Create: Error creating mutex");
+		twWsReactor_Delete(r);
+		return TW_ERROR_CREATING_MTX;
+	}
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->epfd < 0 || r->wakefd < 0) {
+		TW_LOG(TW_ERROR, "twWsReactor_Create: Error creating epoll instance.  Error: %d", errno);
+		twWsReactor_Delete(r);
+		return TW_SOCKET_INIT_ERROR;
+	}
+	/* A NULL pointer marks the wake descriptor */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev)) {
+		TW_LOG(TW_ERROR, "twWsReactor_Create: Error watching wake descriptor.  Error: %d", errno);
+		twWsReactor_Delete(r);
+		return TW_SOCKET_INIT_ERROR;
+	}
+	*entity = r;
+	return TW_OK;
+}
+
+int twWsReactor_Delete(twWsReactor * r) {
+	uint32_t i = 0;
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReactor_Delete: NULL reactor pointer");
+		return TW_INVALID_PARAM;
+	}
+	/* Jobs still queued are dropped, the workers finish the ones they are on */
+	pthread_mutex_lock(&r->jobMtx);
+	r->workersStopped = TRUE;
+	pthread_cond_broadcast(&r->jobCond);
+	pthread_mutex_unlock(&r->jobMtx);
+	for (i = 0; i < r->workerCount; i++) pthread_join(r->workers[i], NULL);
+	pthread_cond_destroy(&r->jobCond);
+	pthread_mutex_destroy(&r->jobMtx);
+	if (r->epfd >= 0) close(r->epfd);
+	if (r->wakefd >= 0) close(r->wakefd);
+	freeEntries(r->entries);
+	freeEntries(r->graveyard);
+	TW_FREE(r->work);
+	if (r->mtx) twMutex_Delete(r->mtx);
+	TW_FREE(r);
+	return TW_OK;
+}
+
+int twWsReactor_Add(twWsReactor * r, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval) {
+	twWsReactorEntry * e = NULL;
+	if (!r || !ws) {
+		TW_LOG(TW_ERROR, "twWsReactor_Add: NULL reactor or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(r->mtx);
+	for (e = r->entries; e; e = e->next) {
+		if (e->ws == ws) {
+			TW_LOG(TW_ERROR, "twWsReactor_Add: Websocket is already registered");
+			twMutex_Unlock(r->mtx);
+			return TW_INVALID_PARAM;
+		}
+	}
+	e = (twWsReactorEntry *)TW_CALLOC(sizeof(twWsReactorEntry), 1);
+	if (!e) {
+		TW_LOG(TW_ERROR, "twWsReactor_Add: Error allocating reactor entry");
+		twMutex_Unlock(r->mtx);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	e->ws = ws;
+	e->fd = -1;
+	e->connectTimeout = connectTimeout;
+	e->pingInterval = pingInterval;
+	e->reconnectInterval = reconnectInterval;
+	/* Connect straight away, or pick up anything already buffered */
+	e->ready = TRUE;
+	if (twWs_IsConnected(ws)) {
+		watchSocket(r, e);
+		e->nextPing = wsGetMicros() + (uint64_t)pingInterval * 1000;
+	}
+	e->next = r->entries;
+	r->entries = e;
+	r->count++;
+	twMutex_Unlock(r->mtx);
+	wakeReactor(r);
+	return TW_OK;
+}
+
+int twWsReactor_Remove(twWsReactor * r, twWs * ws) {
+	twWsReactorEntry * held = NULL;
+	if (!r || !ws) {
+		TW_LOG(TW_ERROR, "twWsReactor_Remove: NULL reactor or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	if (detachEntry(r, ws, &held)) {
+		if (held) awaitJob(r, held);
+		return TW_OK;
+	}
+	TW_LOG(TW_WARN, "twWsReactor_Remove: Websocket is not registered");
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Poll(twWsReactor * r, uint32_t timeout) {
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	twWsReactorEntry * e = NULL;
+	uint64_t now = 0;
+	uint64_t wake = 0;
+	uint32_t count = 0;
+	uint32_t i = 0;
+	int n = 0;
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReactor_Poll: NULL reactor pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(r->mtx);
+	now = wsGetMicros();
+	/* Nothing from the last poll can still point at these, but a worker or remover may */
+	r->graveyard = freeFinished(r->graveyard);
+	/* Sleep no later than the next timer, and not at all if a websocket has data left over */
+	wake = now + (uint64_t)timeout * 1000;
+	for (e = r->entries; e; e = e->next) {
+		uint64_t due = wake;
+		/* A worker is connecting it, and will wake us when done */
+		if (e->job == REACTOR_JOB_CONNECT) continue;
+		if (e->ready) due = now;
+		else if (!twWs_IsConnected(e->ws)) due = e->nextConnect;
+		else if (e->pingInterval) due = e->nextPing;
+		if (e->paused && e->resume < due) due = e->resume;
+		if (due < wake) wake = due;
+	}
+	twMutex_Unlock(r->mtx);
+	n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, wake > now ? (int)((wake - now + 999) / 1000) : 0);
+	if (n < 0 && errno != EINTR) {
+		TW_LOG(TW_ERROR, "twWsReactor_Poll: Error waiting for events.  Error: %d", errno);
+		return TW_ERROR_READING_FROM_WEBSOCKET;
+	}
+	twMutex_Lock(r->mtx);
+	for (i = 0; n > 0 && i < (uint32_t)n; i++) {
+		e = (twWsReactorEntry *)events[i].data.ptr;
+		if (!e) {
+			uint64_t drained = 0;
+			if (read(r->wakefd, &drained, sizeof(drained)) < 0) TW_LOG(TW_TRACE, "twWsReactor_Poll: Wake descriptor empty");
+			continue;
+		}
+		e->ready = TRUE;
+		if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) e->hangup = TRUE;
+	}
+	now = wsGetMicros();
+	finishJobs(r, r->entries, now);
+	finishJobs(r, r->graveyard, now);
+	/* Take a snapshot of what needs servicing so the lock isn't held across callbacks */
+	if (r->workSize < r->count) {
+		twWsReactorEntry ** tmp = (twWsReactorEntry **)TW_REALLOC(r->work, r->count * sizeof(twWsReactorEntry *));
+		if (!tmp) {
+			TW_LOG(TW_ERROR, "twWsReactor_Poll: Error allocating work list");
+			twMutex_Unlock(r->mtx);
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		r->work = tmp;
+		r->workSize = r->count;
+	}
+	now = wsGetMicros();
+	for (e = r->entries; e; e = e->next) {
+		char due = e->ready;
+		if (e->job == REACTOR_JOB_CONNECT) continue;
+		if (!twWs_IsConnected(e->ws)) due = due || now >= e->nextConnect;
+		else if (e->pingInterval) due = due || now >= e->nextPing;
+		if (e->paused) due = due || now >= e->resume;
+		if (due) r->work[count++] = e;
+	}
+	twMutex_Unlock(r->mtx);
+	for (i = 0; i < count; i++) {
+		uint64_t start = wsGetMicros();
+		serviceEntry(r, r->work[i], now);
+		r->work[i]->busy = wsGetMicros() - start;
+	}
+	/* Account for the time spent, so the group can see which shards and connections are hot */
+	twMutex_Lock(r->mtx);
+	for (i = 0; i < count; i++) {
+		r->work[i]->load += r->work[i]->busy;
+		r->load += r->work[i]->busy;
+		r->work[i]->busy = 0;
+	}
+	n = r->pendingMigrations;
+	twMutex_Unlock(r->mtx);
+	if (n) migrateEntries(r);
+	return TW_OK;
+}
+
+int twWsReactor_Run(twWsReactor * r) {
+	int res = TW_OK;
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReactor_Run: NULL reactor pointer");
+		return TW_INVALID_PARAM;
+	}
+	while (!res) {
+		twMutex_Lock(r->mtx);
+		if (r->stopped) {
+			r->stopped = FALSE;
+			twMutex_Unlock(r->mtx);
+			break;
+		}
+		twMutex_Unlock(r->mtx);
+		res = twWsReactor_Poll(r, 1000);
+	}
+	return res;
+}
+
+int twWsReactor_Stop(twWsReactor * r) {
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReactor_Stop: NULL reactor pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(r->mtx);
+	r->stopped = TRUE;
+	twMutex_Unlock(r->mtx);
+	wakeReactor(r);
+	return TW_OK;
+}
+
+/**
+* Sharded reactor group
+**/
+static void * shardMain(void * arg) {
+	twWsShard * shard = (twWsShard *)arg;
+	if (shard->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(shard->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+			TW_LOG(TW_WARN, "twWsReactorGroup: Error pinning shard to CPU %d", shard->cpu);
+		}
+	}
+	twWsReactor_Run(shard->reactor);
+	return NULL;
+}
+
+static void rebalance(twWsReactorGroup * g) {
+	/* Move one connection off the busiest shard if it has stayed well above average */
+	uint64_t total = 0;
+	uint32_t hot = 0;
+	uint32_t cold = 0;
+	uint32_t i = 0;
+	twWsReactorEntry * e = NULL;
+	twWsReactorEntry * best = NULL;
+	for (i = 0; i < g->shardCount; i++) {
+		twWsReactor * r = g->shards[i].reactor;
+		twMutex_Lock(r->mtx);
+		g->loads[i] = r->load;
+		twMutex_Unlock(r->mtx);
+		total += g->loads[i];
+		if (g->loads[i] > g->loads[hot]) hot = i;
+		if (g->loads[i] < g->loads[cold]) cold = i;
+	}
+	if (hot != cold && g->loads[hot] * 100 * g->shardCount > total * REBALANCE_RATIO_PERCENT) {
+		g->hotWindows = (hot == g->hotShard) ? g->hotWindows + 1 : 1;
+		g->hotShard = hot;
+	} else g->hotWindows = 0;
+	if (g->hotWindows >= REBALANCE_WINDOWS) {
+		/* The connection that brings the two shards closest together without overshooting */
+		twWsReactor * r = g->shards[hot].reactor;
+		uint64_t gap = (g->loads[hot] - g->loads[cold]) / 2;
+		twMutex_Lock(r->mtx);
+		if (r->count > 1) {
+			for (e = r->entries; e; e = e->next) {
+				if (e->migrateTo || e->job || !e->load || e->load > gap) continue;
+				if (!best || e->load > best->load) best = e;
+			}
+		}
+		if (best) {
+			best->migrateTo = g->shards[cold].reactor;
+			r->pendingMigrations++;
+		}
+		twMutex_Unlock(r->mtx);
+		if (best) wakeReactor(r);
+		g->hotWindows = 0;
+	}
+	/* Start the next window */
+	for (i = 0; i < g->shardCount; i++) {
+		twWsReactor * r = g->shards[i].reactor;
+		twMutex_Lock(r->mtx);
+		r->load = 0;
+		for (e = r->entries; e; e = e->next) e->load = 0;
+		twMutex_Unlock(r->mtx);
+	}
+}
+
+static void * rebalancerMain(void * arg) {
+	twWsReactorGroup * g = (twWsReactorGroup *)arg;
+	uint32_t slept = 0;
+	while (TRUE) {
+		char stopped = FALSE;
+		twMutex_Lock(g->mtx);
+		stopped = g->stopped;
+		twMutex_Unlock(g->mtx);
+		if (stopped) break;
+		/* Sleep in short steps so stopping the group isn't held up */
+		twSleepMsec(50);
+		slept += 50;
+		if (slept < g->rebalanceInterval) continue;
+		slept = 0;
+		rebalance(g);
+	}
+	return NULL;
+}
+
+int twWsReactorGroup_Create(uint32_t shards, uint32_t messageBudget, char pinThreads, uint32_t rebalanceInterval, twWsReactorGroup ** entity) {
+	twWsReactorGroup * g = NULL;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t i = 0;
+	int res = TW_OK;
+	if (!entity) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Create: NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	if (cpus < 1) cpus = 1;
+	if (!shards) shards = (uint32_t)cpus;
+	g = (twWsReactorGroup *)TW_CALLOC(sizeof(twWsReactorGroup), 1);
+	if (!g) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Create: Error allocating reactor group");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	g->rebalanceInterval = rebalanceInterval;
+	g->mtx = twMutex_Create();
+	g->shards = (twWsShard *)TW_CALLOC(sizeof(twWsShard), shards);
+	g->loads = (uint64_t *)TW_CALLOC(sizeof(uint64_t), shards);
+	if (!g->mtx || !g->shards || !g->loads) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Create: Error allocating reactor group");
+		twWsReactorGroup_Delete(g);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	for (i = 0; i < shards; i++) {
+		res = twWsReactor_Create(messageBudget, &g->shards[i].reactor);
+		if (res) {
+			twWsReactorGroup_Delete(g);
+			return res;
+		}
+		g->shards[i].reactor->group = g;
+		g->shards[i].cpu = pinThreads ? (int)(i % cpus) : -1;
+		g->shardCount++;
+	}
+	for (i = 0; i < shards; i++) {
+		if (pthread_create(&g->shards[i].thread, NULL, shardMain, &g->shards[i])) {
+			TW_LOG(TW_ERROR, "twWsReactorGroup_Create: Error starting shard thread");
+			twWsReactorGroup_Delete(g);
+			return TW_UNKNOWN_ERROR;
+		}
+		g->shards[i].started = TRUE;
+	}
+	if (rebalanceInterval && shards > 1) {
+		if (pthread_create(&g->rebalancer, NULL, rebalancerMain, g)) {
+			TW_LOG(TW_ERROR, "twWsReactorGroup_Create: Error starting rebalancer thread");
+			twWsReactorGroup_Delete(g);
+			return TW_UNKNOWN_ERROR;
+		}
+		g->rebalancerStarted = TRUE;
+	}
+	*entity = g;
+	return TW_OK;
+}
+
+int twWsReactorGroup_Delete(twWsReactorGroup * g) {
+	uint32_t i = 0;
+	if (!g) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Delete: NULL group pointer");
+		return TW_INVALID_PARAM;
+	}
+	if (g->mtx) {
+		twMutex_Lock(g->mtx);
+		g->stopped = TRUE;
+		twMutex_Unlock(g->mtx);
+	}
+	if (g->rebalancerStarted) pthread_join(g->rebalancer, NULL);
+	for (i = 0; i < g->shardCount; i++) {
+		if (!g->shards[i].started) continue;
+		twWsReactor_Stop(g->shards[i].reactor);
+		pthread_join(g->shards[i].thread, NULL);
+	}
+	for (i = 0; i < g->shardCount; i++) twWsReactor_Delete(g->shards[i].reactor);
+	TW_FREE(g->shards);
+	TW_FREE(g->loads);
+	if (g->mtx) twMutex_Delete(g->mtx);
+	TW_FREE(g);
+	return TW_OK;
+}
+
+int twWsReactorGroup_Add(twWsReactorGroup * g, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval) {
+	uint32_t i = 0;
+	uint32_t best = 0;
+	uint32_t bestCount = 0;
+	int res = TW_OK;
+	if (!g || !ws) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Add: NULL group or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(g->mtx);
+	/* New connections go to the shard with the fewest, the rebalancer evens out the load after that */
+	for (i = 0; i < g->shardCount; i++) {
+		twWsReactor * r = g->shards[i].reactor;
+		twWsReactorEntry * e = NULL;
+		uint32_t count = 0;
+		twMutex_Lock(r->mtx);
+		for (e = r->entries; e; e = e->next) {
+			if (e->ws == ws) {
+				twMutex_Unlock(r->mtx);
+				twMutex_Unlock(g->mtx);
+				TW_LOG(TW_ERROR, "twWsReactorGroup_Add: Websocket is already registered");
+				return TW_INVALID_PARAM;
+			}
+		}
+		count = r->count;
+		twMutex_Unlock(r->mtx);
+		if (!i || count < bestCount) {
+			best = i;
+			bestCount = count;
+		}
+	}
+	res = twWsReactor_Add(g->shards[best].reactor, ws, connectTimeout, pingInterval, reconnectInterval);
+	twMutex_Unlock(g->mtx);
+	return res;
+}
+
+int twWsReactorGroup_Remove(twWsReactorGroup * g, twWs * ws) {
+	uint32_t i = 0;
+	if (!g || !ws) {
+		TW_LOG(TW_ERROR, "twWsReactorGroup_Remove: NULL group or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(g->mtx);
+	for (i = 0; i < g->shardCount; i++) {
+		twWsReactor * r = g->shards[i].reactor;
+		twWsReactorEntry * e = NULL;
+		char found = FALSE;
+		twMutex_Lock(r->mtx);
+		for (e = r->entries; e && !found; e = e->next) found = (e->ws == ws);
+		twMutex_Unlock(r->mtx);
+		if (found) {
+			/* Wait for the shard's workers without holding up the other shards */
+			detachEntry(r, ws, &e);
+			twMutex_Unlock(g->mtx);
+			if (e) awaitJob(r, e);
+			return TW_OK;
+		}
+	}
+	twMutex_Unlock(g->mtx);
+	TW_LOG(TW_WARN, "twWsReactorGroup_Remove: Websocket is not registered");
+	return TW_INVALID_PARAM;
+}
+
+#else
+
+/* epoll is Linux only.  Other platforms drive each websocket with twWs_Receive() */
+int twWsReactor_Create(uint32_t messageBudget, twWsReactor ** entity) {
+	TW_LOG(TW_ERROR, "twWsReactor_Create: The websocket reactor is only supported on Linux");
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Delete(twWsReactor * r) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Add(twWsReactor * r, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Remove(twWsReactor * r, twWs * ws) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Poll(twWsReactor * r, uint32_t timeout) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Run(twWsReactor * r) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactor_Stop(twWsReactor * r) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactorGroup_Create(uint32_t shards, uint32_t messageBudget, char pinThreads, uint32_t rebalanceInterval, twWsReactorGroup ** entity) {
+	TW_LOG(TW_ERROR, "twWsReactorGroup_Create: The websocket reactor is only supported on Linux");
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactorGroup_Delete(twWsReactorGroup * g) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactorGroup_Add(twWsReactorGroup * g, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval) {
+	return TW_INVALID_PARAM;
+}
+
+int twWsReactorGroup_Remove(twWsReactorGroup * g, twWs * ws) {
+	return TW_INVALID_PARAM;
+}
+
+#endif
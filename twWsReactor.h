@@ -0,0 +1,239 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsReactor.h
+ *
+ * \brief Event loop driving many websockets from one thread
+ *
+ * A reactor waits for any of its websockets to become readable and only then
+ * runs that websocket's receive state machine, so thousands of connections
+ * can be serviced without a thread each or round-robin polling.  Connecting,
+ * reconnecting and keepalive pings are scheduled by the same loop, but since
+ * they can block they are carried out by a few worker threads the reactor
+ * starts as it needs them, so a slow handshake or a full send buffer never
+ * holds up the other connections.
+ *
+ * A reactor group spreads websockets over several reactors, each run by its
+ * own thread, and moves connections off shards that stay busier than the
+ * rest.
+ *
+ * Readiness comes from epoll, so the reactor is only available on Linux.
+*/
+
+#include "twOSPort.h"
+#include "twWebsocket.h"
+
+#ifndef TW_WS_REACTOR_H
+#define TW_WS_REACTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Opaque reactor structure.
+*/
+struct twWsReactor;
+typedef struct twWsReactor twWsReactor;
+
+/**
+ * \brief Creates a reactor.
+ *
+ * \param[in]     messageBudget   The most messages dispatched from one
+ *                                websocket before the others get a turn.
+ *                                0 for the default of 16.
+ * \param[out]    entity          A pointer to the newly allocated reactor.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The calling function retains ownership of \p entity and is
+ * responsible for freeing it via twWsReactor_Delete().
+*/
+int twWsReactor_Create(uint32_t messageBudget, twWsReactor ** entity);
+
+/**
+ * \brief Frees a reactor.  Websockets still registered are removed but not
+ * disconnected or deleted.
+ *
+ * \param[in]     reactor   The reactor to delete.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note No thread may be inside twWsReactor_Poll() or twWsReactor_Run().
+ * \note Waits for connects and pings already in progress to finish.
+*/
+int twWsReactor_Delete(twWsReactor * reactor);
+
+/**
+ * \brief Registers a websocket with a reactor.
+ *
+ * \param[in]     reactor             The reactor to register with.
+ * \param[in]     ws                  The websocket.  It may already be
+ *                                    connected.  If not, the reactor
+ *                                    connects it.
+ * \param[in]     connectTimeout      Time (in milliseconds) allowed for each
+ *                                    connection attempt.
+ * \param[in]     pingInterval        Time (in milliseconds) between keepalive
+ *                                    pings, or 0 for none.  If keepalive is
+ *                                    enabled on \p ws, how often it is
+ *                                    checked instead.
+ * \param[in]     reconnectInterval   Time (in milliseconds) to wait after a
+ *                                    failed or dropped connection before
+ *                                    connecting again.  Not used if \p ws
+ *                                    has a reconnect policy - its backoff
+ *                                    is followed instead.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread, including from websocket callbacks.
+ * \note A websocket may only be registered with one reactor, and should not
+ * also be driven with twWs_Receive().
+ * \note Callbacks made while connecting, and by pings, run on a worker
+ * thread.  Messages are only received once the connect has finished.
+*/
+int twWsReactor_Add(twWsReactor * reactor, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval);
+
+/**
+ * \brief Removes a websocket from a reactor.  The websocket is left
+ * connected.
+ *
+ * \param[in]     reactor   The reactor to remove from.
+ * \param[in]     ws        The websocket to remove.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread, including from the websocket's own
+ * callbacks.  No new work is started on \p ws once this returns, and a
+ * connect or ping in progress on a worker thread is waited for.  When called
+ * from another thread, receiving in progress on the loop thread may still be
+ * finishing.  Stop the reactor, or remove from a callback, before deleting
+ * the websocket.
+*/
+int twWsReactor_Remove(twWsReactor * reactor, twWs * ws);
+
+/**
+ * \brief Runs one iteration of the event loop: waits for readiness or the
+ * next timer, then services every websocket that needs it.
+ *
+ * \param[in]     reactor   The reactor to run.
+ * \param[in]     timeout   The longest time (in milliseconds) to wait.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Only one thread may poll a reactor at a time.  Use several reactors
+ * to spread connections over several threads.
+*/
+int twWsReactor_Poll(twWsReactor * reactor, uint32_t timeout);
+
+/**
+ * \brief Runs the event loop until twWsReactor_Stop() is called.
+ *
+ * \param[in]     reactor   The reactor to run.
+ *
+ * \return #TW_OK once stopped, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsReactor_Run(twWsReactor * reactor);
+
+/**
+ * \brief Makes twWsReactor_Run() return, waking it if it is waiting.
+ *
+ * \param[in]     reactor   The reactor to stop.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread.
+*/
+int twWsReactor_Stop(twWsReactor * reactor);
+
+/**
+ * \brief Opaque reactor group structure.
+*/
+struct twWsReactorGroup;
+typedef struct twWsReactorGroup twWsReactorGroup;
+
+/**
+ * \brief Creates a reactor group and starts a thread running each of its
+ * reactors.
+ *
+ * \param[in]     shards              The number of reactors.  0 for one per
+ *                                    online CPU.
+ * \param[in]     messageBudget       Passed to twWsReactor_Create() for each
+ *                                    reactor.
+ * \param[in]     pinThreads          #TRUE to pin each reactor's thread to a
+ *                                    CPU of its own, so its connections stay
+ *                                    in that CPU's caches.
+ * \param[in]     rebalanceInterval   Time (in milliseconds) between checks
+ *                                    for an overloaded reactor, or 0 to never
+ *                                    move connections once added.
+ * \param[out]    entity              A pointer to the newly allocated group.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The calling function retains ownership of \p entity and is
+ * responsible for freeing it via twWsReactorGroup_Delete().
+ * \note Load is the time spent servicing each connection.  A connection is
+ * moved when one reactor has been well above the average for several
+ * intervals running, and only between receives, so its callbacks are never
+ * run by two threads at once.  They may however run on a different thread
+ * from one message to the next.
+*/
+int twWsReactorGroup_Create(uint32_t shards, uint32_t messageBudget, char pinThreads, uint32_t rebalanceInterval, twWsReactorGroup ** entity);
+
+/**
+ * \brief Stops a reactor group's threads and frees it.  Websockets still
+ * registered are removed but not disconnected or deleted.
+ *
+ * \param[in]     group   The group to delete.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Must not be called from a websocket callback.
+*/
+int twWsReactorGroup_Delete(twWsReactorGroup * group);
+
+/**
+ * \brief Registers a websocket with the reactor in a group that has the
+ * fewest connections.
+ *
+ * \param[in]     group   The group to register with.
+ *
+ * See twWsReactor_Add() for the other parameters.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread, including from websocket callbacks.
+*/
+int twWsReactorGroup_Add(twWsReactorGroup * group, twWs * ws, uint32_t connectTimeout, uint32_t pingInterval, uint32_t reconnectInterval);
+
+/**
+ * \brief Removes a websocket from whichever reactor in a group holds it.
+ * The websocket is left connected.
+ *
+ * \param[in]     group   The group to remove from.
+ * \param[in]     ws      The websocket to remove.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread, with the same caveats as
+ * twWsReactor_Remove().
+*/
+int twWsReactorGroup_Remove(twWsReactorGroup * group, twWs * ws);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Reconnect policy for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsReconnect.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+
+/* How often the reconnect thread looks for websockets that are due */
+#define RECONNECT_POLL_INTERVAL 50
+
+/* Monotonic clock from twWebsocket.c */
+uint64_t wsGetMicros();
+
+typedef struct twWsAddressEntry {
+	char host[128];
+	uint16_t port;
+	char addr[WS_RECONNECT_ADDRESS_SIZE];
+	uint64_t expires;                       /* wsGetMicros() time, 0 if the slot is free */
+} twWsAddressEntry;
+
+/*
+mtx guards the jitter generator, the budget and the address cache, and is
+only held briefly.  watchMutex guards the watched list and is held by the
+thread while it connects, so unwatching waits for an attempt to finish.
+*/
+struct twWsReconnect {
+	TW_MUTEX mtx;
+	uint64_t baseDelay;                     /* All times in microseconds */
+	uint64_t maxDelay;
+	uint64_t budgetInterval;                /* Time each attempt uses up of the budget, 0 for no budget */
+	uint64_t budgetBurst;                   /* How far ahead of now the budget may be spent */
+	uint64_t budgetTime;                    /* When the budget is next back to full */
+	uint64_t addressTtl;
+	uint64_t rng;
+	twWsAddressEntry cache[WS_RECONNECT_CACHE_SIZE];
+	TW_MUTEX watchMutex;
+	twWs ** watched;
+	uint32_t watchedCount;
+	uint32_t watchedSize;
+	uint32_t connectTimeout;
+#ifndef WIN32
+	pthread_t thread;
+#endif
+	char running;
+	volatile char stopped;
+};
+
+int twWsReconnect_Create(uint32_t baseDelay, uint32_t maxDelay, uint32_t budget, uint32_t budgetWindow, uint32_t addressTtl, twWsReconnect ** entity) {
+	twWsReconnect * r = NULL;
+	if (!entity || !baseDelay || maxDelay < baseDelay || (budget && !budgetWindow)) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Create: Invalid delays or budget, or NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	r = (twWsReconnect *)TW_CALLOC(sizeof(twWsReconnect), 1);
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Create: Error allocating policy");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	r->mtx = twMutex_Create();
+	r->watchMutex = twMutex_Create();
+	if (!r->mtx || !r->watchMutex) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Create: Error creating mutexes");
+		twWsReconnect_Delete(r);
+		return TW_ERROR_CREATING_MTX;
+	}
+	r->baseDelay = (uint64_t)baseDelay * 1000;
+	r->maxDelay = (uint64_t)maxDelay * 1000;
+	if (budget) {
+		r->budgetInterval = (uint64_t)budgetWindow * 1000 / budget;
+		r->budgetBurst = (uint64_t)budgetWindow * 1000 - r->budgetInterval;
+	}
+	r->addressTtl = (uint64_t)addressTtl * 1000;
+	/* Seeded per process and per policy so clients started together still pick different delays */
+	r->rng = wsGetMicros() ^ ((uint64_t)(size_t)r << 16) ^ 0x9E3779B97F4A7C15ULL;
+	*entity = r;
+	return TW_OK;
+}
+
+void twWsReconnect_Delete(twWsReconnect * r) {
+	if (!r) return;
+	twWsReconnect_Stop(r);
+	twMutex_Delete(r->mtx);
+	twMutex_Delete(r->watchMutex);
+	TW_FREE(r->watched);
+	TW_FREE(r);
+}
+
+uint32_t twWsReconnect_Backoff(twWsReconnect * r, uint32_t failures) {
+	uint64_t ceiling = 0;
+	uint64_t x = 0;
+	if (!r) return 0;
+	ceiling = r->baseDelay;
+	while (failures-- && ceiling < r->maxDelay) ceiling <<= 1;
+	if (ceiling > r->maxDelay) ceiling = r->maxDelay;
+	/* Full jitter - anywhere from 0 up to the ceiling */
+	twMutex_Lock(r->mtx);
+	r->rng ^= r->rng >> 12;
+	r->rng ^= r->rng << 25;
+	r->rng ^= r->rng >> 27;
+	x = r->rng * 0x2545F4914F6CDD1DULL;
+	twMutex_Unlock(r->mtx);
+	return (uint32_t)((x % (ceiling + 1)) / 1000);
+}
+
+char twWsReconnect_TakeAttempt(twWsReconnect * r, uint32_t * wait) {
+	/*
+	A leaky bucket kept as the time it is next empty: each attempt pushes
+	that time on by budgetInterval, and attempts are refused once it is
+	more than budgetBurst ahead of now.
+	*/
+	uint64_t now = 0;
+	char allowed = TRUE;
+	if (wait) *wait = 0;
+	if (!r || !r->budgetInterval) return TRUE;
+	now = wsGetMicros();
+	twMutex_Lock(r->mtx);
+	if (r->budgetTime < now) r->budgetTime = now;
+	if (r->budgetTime - now > r->budgetBurst) {
+		allowed = FALSE;
+		if (wait) *wait = (uint32_t)((r->budgetTime - now - r->budgetBurst + 999) / 1000);
+	} else r->budgetTime += r->budgetInterval;
+	twMutex_Unlock(r->mtx);
+	return allowed;
+}
+
+static twWsAddressEntry * findAddress(twWsReconnect * r, const char * host, uint16_t port) {
+	uint32_t i = 0;
+	for (i = 0; i < WS_RECONNECT_CACHE_SIZE; i++) {
+		if (r->cache[i].expires && r->cache[i].port == port && !strcmp(r->cache[i].host, host)) return &r->cache[i];
+	}
+	return NULL;
+}
+
+void twWsReconnect_Resolve(twWsReconnect * r, const char * host, uint16_t port, char * addr, uint32_t size) {
+	struct addrinfo hints;
+	struct addrinfo * res = NULL;
+	twWsAddressEntry * e = NULL;
+	uint64_t now = 0;
+	uint32_t i = 0;
+	if (!host || !addr || !size) return;
+	strncpy(addr, host, size - 1);
+	addr[size - 1] = 0x00;
+	if (!r || !r->addressTtl || strlen(host) >= sizeof(e->host)) return;
+	now = wsGetMicros();
+	twMutex_Lock(r->mtx);
+	e = findAddress(r, host, port);
+	if (e && now < e->expires) {
+		strncpy(addr, e->addr, size - 1);
+		twMutex_Unlock(r->mtx);
+		return;
+	}
+	twMutex_Unlock(r->mtx);
+	/* Resolve without the lock held - it can take a while */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) || !res) {
+		TW_LOG(TW_WARN, "twWsReconnect_Resolve: Error resolving %s", host);
+		return;
+	}
+	if (res->ai_family == AF_INET) inet_ntop(AF_INET, &((struct sockaddr_in *)res->ai_addr)->sin_addr, addr, size);
+	else if (res->ai_family == AF_INET6) inet_ntop(AF_INET6, &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr, addr, size);
+	freeaddrinfo(res);
+	twMutex_Lock(r->mtx);
+	e = findAddress(r, host, port);
+	/* Otherwise take a free slot, or the one that expires soonest */
+	for (i = 0; !e && i < WS_RECONNECT_CACHE_SIZE; i++) {
+		if (!r->cache[i].expires) e = &r->cache[i];
+	}
+	if (!e) {
+		e = &r->cache[0];
+		for (i = 1; i < WS_RECONNECT_CACHE_SIZE; i++) {
+			if (r->cache[i].expires < e->expires) e = &r->cache[i];
+		}
+	}
+	strcpy(e->host, host);
+	e->port = port;
+	strncpy(e->addr, addr, sizeof(e->addr) - 1);
+	e->addr[sizeof(e->addr) - 1] = 0x00;
+	e->expires = now + r->addressTtl;
+	twMutex_Unlock(r->mtx);
+}
+
+void twWsReconnect_Forget(twWsReconnect * r, const char * host, uint16_t port) {
+	twWsAddressEntry * e = NULL;
+	if (!r || !host) return;
+	twMutex_Lock(r->mtx);
+	e = findAddress(r, host, port);
+	if (e) e->expires = 0;
+	twMutex_Unlock(r->mtx);
+}
+
+/**
+* Reconnect thread
+**/
+#ifndef WIN32
+static void * reconnectMain(void * arg) {
+	twWsReconnect * r = (twWsReconnect *)arg;
+	while (!r->stopped) {
+		uint32_t i = 0;
+		twMutex_Lock(r->watchMutex);
+		for (i = 0; i < r->watchedCount && !r->stopped; i++) {
+			twWs * ws = r->watched[i];
+			if (twWs_IsConnected(ws) || wsGetMicros() < ws->nextReconnect) continue;
+			/* Failures are logged by twWs_Connect, and it schedules the next attempt itself */
+			twWs_Connect(ws, r->connectTimeout);
+		}
+		twMutex_Unlock(r->watchMutex);
+		twSleepMsec(RECONNECT_POLL_INTERVAL);
+	}
+	return NULL;
+}
+#endif
+
+int twWsReconnect_Start(twWsReconnect * r, uint32_t connectTimeout) {
+	if (!r) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Start: NULL policy pointer");
+		return TW_INVALID_PARAM;
+	}
+#ifndef WIN32
+	if (r->running) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Start: Already running");
+		return TW_INVALID_PARAM;
+	}
+	r->connectTimeout = connectTimeout;
+	r->stopped = FALSE;
+	r->running = TRUE;
+	if (pthread_create(&r->thread, NULL, reconnectMain, r)) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Start: Error starting reconnect thread");
+		r->running = FALSE;
+		return TW_UNKNOWN_ERROR;
+	}
+	return TW_OK;
+#else
+	TW_LOG(TW_ERROR, "twWsReconnect_Start: Reconnect threads are not supported on this platform");
+	return TW_INVALID_PARAM;
+#endif
+}
+
+void twWsReconnect_Stop(twWsReconnect * r) {
+#ifndef WIN32
+	if (!r || !r->running) return;
+	r->stopped = TRUE;
+	pthread_join(r->thread, NULL);
+	r->running = FALSE;
+#endif
+}
+
+int twWsReconnect_Watch(twWsReconnect * r, twWs * ws) {
+	if (!r || !ws) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Watch: NULL policy or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(r->watchMutex);
+	if (r->watchedCount == r->watchedSize) {
+		uint32_t size = r->watchedSize ? r->watchedSize * 2 : 8;
+		twWs ** tmp = (twWs **)TW_REALLOC(r->watched, size * sizeof(twWs *));
+		if (!tmp) {
+			twMutex_Unlock(r->watchMutex);
+			TW_LOG(TW_ERROR, "twWsReconnect_Watch: Error allocating watch list");
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		r->watched = tmp;
+		r->watchedSize = size;
+	}
+	r->watched[r->watchedCount++] = ws;
+	twMutex_Unlock(r->watchMutex);
+	return TW_OK;
+}
+
+int twWsReconnect_Unwatch(twWsReconnect * r, twWs * ws) {
+	uint32_t i = 0;
+	if (!r || !ws) {
+		TW_LOG(TW_ERROR, "twWsReconnect_Unwatch: NULL policy or ws pointer");
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(r->watchMutex);
+	for (i = 0; i < r->watchedCount; i++) {
+		if (r->watched[i] == ws) {
+			r->watched[i] = r->watched[--r->watchedCount];
+			break;
+		}
+	}
+	twMutex_Unlock(r->watchMutex);
+	return TW_OK;
+}
@@ -0,0 +1,187 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsReconnect.h
+ *
+ * \brief Reconnect policy for websockets
+ *
+ * A send or receive call that hits an error only drops the socket.  Without
+ * a policy the next twWs_Connect() connects again straight away, resolving
+ * the host again each time.  When a server restarts, every client does so
+ * in the same second.
+ *
+ * With a policy attached by twWs_SetReconnectPolicy(), the next
+ * twWs_Connect() after a connection drops, for whatever reason, is held
+ * back by exponential backoff with full jitter, so a fleet spreads its
+ * attempts out.  A budget caps attempts across every websocket sharing the
+ * policy, and resolved addresses are cached for a while on transports
+ * without TLS.  The reconnecting itself can be left to a reactor, to the
+ * application, or to a thread the policy runs.
+*/
+
+#include "twOSPort.h"
+#include "twWebsocket.h"
+
+#ifndef TW_WS_RECONNECT_H
+#define TW_WS_RECONNECT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returned by twWs_Connect() while a policy is holding back the next attempt */
+#ifndef TW_WEBSOCKET_RECONNECT_BACKOFF
+#define TW_WEBSOCKET_RECONNECT_BACKOFF 321
+#endif
+
+/* Largest numeric address kept by the cache, IPv6 included */
+#define WS_RECONNECT_ADDRESS_SIZE 46
+
+/* Hosts the address cache holds.  The least recently resolved is replaced. */
+#ifndef WS_RECONNECT_CACHE_SIZE
+#define WS_RECONNECT_CACHE_SIZE 8
+#endif
+
+/**
+ * \brief Opaque policy structure.
+*/
+struct twWsReconnect;
+typedef struct twWsReconnect twWsReconnect;
+
+/**
+ * \brief Creates a reconnect policy.  One policy may be shared by any number
+ * of websockets.
+ *
+ * \param[in]     baseDelay       Most time (in milliseconds) to wait before
+ *                                the first attempt after a drop.  Doubles
+ *                                with each failed attempt.
+ * \param[in]     maxDelay        Cap (in milliseconds) on the doubling.
+ * \param[in]     budget          Most attempts, across all websockets using
+ *                                the policy, in each \p budgetWindow.  0 for
+ *                                no limit.
+ * \param[in]     budgetWindow    Time (in milliseconds) over which \p budget
+ *                                is spread.
+ * \param[in]     addressTtl      Time (in milliseconds) a resolved address is
+ *                                reused, or 0 to resolve on every attempt.
+ *                                Only used for transports without TLS,
+ *                                which needs the host name.
+ * \param[out]    entity          A pointer to the newly allocated policy.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The calling function retains ownership of \p entity and is
+ * responsible for freeing it via twWsReconnect_Delete().
+ * \note The actual wait is a random time between 0 and the current delay,
+ * so clients that dropped together don't come back together.
+*/
+int twWsReconnect_Create(uint32_t baseDelay, uint32_t maxDelay, uint32_t budget, uint32_t budgetWindow, uint32_t addressTtl, twWsReconnect ** entity);
+
+/**
+ * \brief Stops the policy's thread, if running, and frees a policy.
+ *
+ * \param[in]     r         The policy to delete.
+ *
+ * \note No websocket may still be using the policy.
+*/
+void twWsReconnect_Delete(twWsReconnect * r);
+
+/**
+ * \brief Picks how long to wait before the next attempt.
+ *
+ * \param[in]     r         The policy.
+ * \param[in]     failures  Attempts that have failed since the last
+ *                          successful connection.
+ *
+ * \return The wait, in milliseconds.
+*/
+uint32_t twWsReconnect_Backoff(twWsReconnect * r, uint32_t failures);
+
+/**
+ * \brief Takes an attempt from the budget.
+ *
+ * \param[in]     r         The policy.
+ * \param[out]    wait      If the budget is spent, set to the time (in
+ *                          milliseconds) until an attempt is next available.
+ *
+ * \return #TRUE if an attempt may be made now.
+*/
+char twWsReconnect_TakeAttempt(twWsReconnect * r, uint32_t * wait);
+
+/**
+ * \brief Looks up a host's address, from the cache if it is fresh.
+ *
+ * \param[in]     r         The policy.
+ * \param[in]     host      The host to look up.
+ * \param[in]     port      The port, which is part of the cache key.
+ * \param[out]    addr      Set to the numeric address, or to \p host if it
+ *                          can't be resolved or caching is off.
+ * \param[in]     size      Size of \p addr.
+*/
+void twWsReconnect_Resolve(twWsReconnect * r, const char * host, uint16_t port, char * addr, uint32_t size);
+
+/**
+ * \brief Drops a host from the address cache, so the next attempt resolves
+ * it again.  Called when connecting to the cached address fails.
+ *
+ * \param[in]     r         The policy.
+ * \param[in]     host      The host.
+ * \param[in]     port      The port.
+*/
+void twWsReconnect_Forget(twWsReconnect * r, const char * host, uint16_t port);
+
+/**
+ * \brief Starts a thread that reconnects watched websockets whenever they
+ * are disconnected and their backoff has passed.
+ *
+ * \param[in]     r                 The policy.
+ * \param[in]     connectTimeout    Time (in milliseconds) allowed for each
+ *                                  attempt.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Needs POSIX threads.  Websockets registered with a reactor should
+ * not also be watched - the reactor already honours the policy.
+*/
+int twWsReconnect_Start(twWsReconnect * r, uint32_t connectTimeout);
+
+/**
+ * \brief Stops the reconnect thread and waits for it to exit.
+ *
+ * \param[in]     r         The policy.
+*/
+void twWsReconnect_Stop(twWsReconnect * r);
+
+/**
+ * \brief Adds a websocket to those the reconnect thread looks after.
+ *
+ * \param[in]     r         The policy.  Must be the websocket's policy.
+ * \param[in]     ws        The websocket.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsReconnect_Watch(twWsReconnect * r, twWs * ws);
+
+/**
+ * \brief Removes a websocket from those the reconnect thread looks after.
+ * Waits for an attempt in progress on it to finish.
+ *
+ * \param[in]     r         The policy.
+ * \param[in]     ws        The websocket.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Must not be called from the websocket's connect callback.
+*/
+int twWsReconnect_Unwatch(twWsReconnect * r, twWs * ws);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
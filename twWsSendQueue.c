@@ -0,0 +1,230 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Lock-free outbound message queue for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsSendQueue.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#define QUEUE_LOAD(p) ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define QUEUE_STORE(p, v) InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define QUEUE_CAS(p, expected, desired) \
+	(InterlockedCompareExchange((volatile LONG *)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#else
+#define QUEUE_LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define QUEUE_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define QUEUE_CAS(p, expected, desired) \
+	__atomic_compare_exchange_n(p, &(expected), desired, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#endif
+
+/* How long an idle writer sleeps before checking the queue anyway */
+#define WRITER_IDLE_WAIT 100
+
+/*
+A bounded ring in the style of Vyukov's queue.  Each slot's sequence number
+says whose turn it is: equal to a position means the slot is free for the
+producer that claims that position, one more means it holds that position's
+message.  Producers claim positions by advancing tail with CAS, so no two
+write the same slot, and publish by storing the sequence number last.
+*/
+typedef struct twWsSendSlot {
+	volatile uint32_t seq;
+	twWsSendItem item;
+} twWsSendSlot;
+
+struct twWsSendQueue {
+	twWsSendSlot * slots;
+	uint32_t mask;
+	volatile uint32_t tail;                 /* Next position a producer claims */
+	uint32_t head;                          /* Next position the consumer takes, only it touches this */
+	volatile uint32_t idle;                 /* TRUE while the writer is, or is about to be, asleep */
+#ifndef WIN32
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	pthread_t thread;
+	pthread_t writerId;                     /* Set by the writer itself, so it can recognise its own callbacks */
+#endif
+	char running;
+	char stopped;
+	ws_writer_cb fn;
+	void * arg;
+};
+
+/**
+* Queue functions
+**/
+int twWsSendQueue_Create(uint32_t depth, twWsSendQueue ** entity) {
+	twWsSendQueue * q = NULL;
+	uint32_t size = 2;
+	uint32_t i = 0;
+	if (!entity || !depth || depth > 0x80000000) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_Create: Invalid depth or NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	while (size < depth) size <<= 1;
+	q = (twWsSendQueue *)TW_CALLOC(sizeof(twWsSendQueue), 1);
+	if (!q) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_Create: Error allocating queue");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	q->slots = (twWsSendSlot *)TW_CALLOC(sizeof(twWsSendSlot), size);
+	if (!q->slots) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_Create: Error allocating queue slots");
+		TW_FREE(q);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	for (i = 0; i < size; i++) q->slots[i].seq = i;
+	q->mask = size - 1;
+#ifndef WIN32
+	pthread_mutex_init(&q->mtx, NULL);
+	pthread_cond_init(&q->cond, NULL);
+#endif
+	*entity = q;
+	return TW_OK;
+}
+
+void twWsSendQueue_Delete(twWsSendQueue * q) {
+	if (!q) return;
+	twWsSendQueue_StopWriter(q);
+#ifndef WIN32
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->mtx);
+#endif
+	TW_FREE(q->slots);
+	TW_FREE(q);
+}
+
+int twWsSendQueue_Push(twWsSendQueue * q, const twWsSendItem * item) {
+	twWsSendSlot * slot = NULL;
+	uint32_t pos = QUEUE_LOAD(&q->tail);
+	while (TRUE) {
+		int32_t diff = 0;
+		slot = &q->slots[pos & q->mask];
+		diff = (int32_t)(QUEUE_LOAD(&slot->seq) - pos);
+		if (diff == 0) {
+			/* On failure pos is reloaded with the current tail */
+			if (QUEUE_CAS(&q->tail, pos, pos + 1)) break;
+#if defined(_MSC_VER)
+			pos = QUEUE_LOAD(&q->tail);
+#endif
+		} else if (diff < 0) {
+			/* The consumer hasn't freed this slot from the last lap */
+			return TW_WEBSOCKET_SEND_QUEUE_FULL;
+		} else {
+			pos = QUEUE_LOAD(&q->tail);
+		}
+	}
+	slot->item = *item;
+	QUEUE_STORE(&slot->seq, pos + 1);
+#ifndef WIN32
+	if (QUEUE_LOAD(&q->idle)) {
+		pthread_mutex_lock(&q->mtx);
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->mtx);
+	}
+#endif
+	return TW_OK;
+}
+
+char twWsSendQueue_Pop(twWsSendQueue * q, twWsSendItem * item) {
+	twWsSendSlot * slot = &q->slots[q->head & q->mask];
+	if (QUEUE_LOAD(&slot->seq) != q->head + 1) return FALSE;
+	*item = slot->item;
+	/* Free the slot for the producer one lap on */
+	QUEUE_STORE(&slot->seq, q->head + q->mask + 1);
+	q->head++;
+	return TRUE;
+}
+
+#ifndef WIN32
+static char hasWork(twWsSendQueue * q) {
+	return QUEUE_LOAD(&q->slots[q->head & q->mask].seq) == q->head + 1;
+}
+
+static void * writerMain(void * arg) {
+	twWsSendQueue * q = (twWsSendQueue *)arg;
+	q->writerId = pthread_self();
+	while (TRUE) {
+		struct timespec ts;
+		q->fn(q->arg);
+		pthread_mutex_lock(&q->mtx);
+		/* Advertise that we are going to sleep before the last look, so a push can't slip in unseen */
+		QUEUE_STORE(&q->idle, TRUE);
+		if (!q->stopped && !hasWork(q)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += WRITER_IDLE_WAIT * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&q->cond, &q->mtx, &ts);
+		}
+		QUEUE_STORE(&q->idle, FALSE);
+		if (q->stopped) {
+			pthread_mutex_unlock(&q->mtx);
+			break;
+		}
+		pthread_mutex_unlock(&q->mtx);
+	}
+	return NULL;
+}
+#endif
+
+int twWsSendQueue_StartWriter(twWsSendQueue * q, ws_writer_cb fn, void * arg) {
+	if (!q || !fn) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_StartWriter: NULL queue or function pointer");
+		return TW_INVALID_PARAM;
+	}
+#ifndef WIN32
+	if (q->running) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_StartWriter: Writer already running");
+		return TW_INVALID_PARAM;
+	}
+	q->fn = fn;
+	q->arg = arg;
+	q->stopped = FALSE;
+	q->running = TRUE;
+	if (pthread_create(&q->thread, NULL, writerMain, q)) {
+		TW_LOG(TW_ERROR, "twWsSendQueue_StartWriter: Error starting writer thread");
+		q->running = FALSE;
+		return TW_UNKNOWN_ERROR;
+	}
+	return TW_OK;
+#else
+	TW_LOG(TW_ERROR, "twWsSendQueue_StartWriter: Writer threads are not supported on this platform");
+	return TW_INVALID_PARAM;
+#endif
+}
+
+void twWsSendQueue_StopWriter(twWsSendQueue * q) {
+#ifndef WIN32
+	if (!q || !q->running) return;
+	pthread_mutex_lock(&q->mtx);
+	q->stopped = TRUE;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mtx);
+	pthread_join(q->thread, NULL);
+	q->running = FALSE;
+#endif
+}
+
+char twWsSendQueue_IsWriter(twWsSendQueue * q) {
+#ifndef WIN32
+	return q && q->running && pthread_equal(q->writerId, pthread_self());
+#else
+	return FALSE;
+#endif
+}
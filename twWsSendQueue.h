@@ -0,0 +1,136 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsSendQueue.h
+ *
+ * \brief Lock-free outbound message queue for websockets
+ *
+ * A bounded ring that any number of threads push messages onto without
+ * taking a lock, drained by a single consumer - usually a writer thread the
+ * queue runs itself.  Used by twWebsocket.c for asynchronous sends.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_SEND_QUEUE_H
+#define TW_WS_SEND_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Returned when a message is pushed onto a full queue */
+#ifndef TW_WEBSOCKET_SEND_QUEUE_FULL
+#define TW_WEBSOCKET_SEND_QUEUE_FULL 320
+#endif
+
+/**
+ * \brief A queued outbound message.
+*/
+typedef struct twWsSendItem {
+	char * buf;                             /**< The message.  Still owned by the producer. **/
+	uint32_t length;                        /**< Length of the message. **/
+	char isText;                            /**< TRUE for a text message, FALSE for binary. **/
+	void * userData;                        /**< Passed back when the message completes. **/
+} twWsSendItem;
+
+/**
+ * \brief Opaque queue structure.
+*/
+struct twWsSendQueue;
+typedef struct twWsSendQueue twWsSendQueue;
+
+/**
+ * \brief Function the writer thread runs whenever the queue may have work.
+*/
+typedef void (*ws_writer_cb) (void * arg);
+
+/**
+ * \brief Creates a queue.
+ *
+ * \param[in]     depth     The most messages the queue holds.  Rounded up to
+ *                          a power of 2.
+ * \param[out]    entity    A pointer to the newly allocated queue.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note The calling function retains ownership of \p entity and is
+ * responsible for freeing it via twWsSendQueue_Delete().
+*/
+int twWsSendQueue_Create(uint32_t depth, twWsSendQueue ** entity);
+
+/**
+ * \brief Stops the writer thread, if running, and frees a queue.  Messages
+ * still queued are dropped.
+ *
+ * \param[in]     q         The queue to delete.
+*/
+void twWsSendQueue_Delete(twWsSendQueue * q);
+
+/**
+ * \brief Adds a message to the queue and wakes the writer if it is idle.
+ *
+ * \param[in]     q         The queue.
+ * \param[in]     item      The message.  Copied into the queue.
+ *
+ * \return #TW_OK if successful, #TW_WEBSOCKET_SEND_QUEUE_FULL if there is no
+ * room.
+ *
+ * \note Safe to call from any number of threads at once.  Never blocks.
+*/
+int twWsSendQueue_Push(twWsSendQueue * q, const twWsSendItem * item);
+
+/**
+ * \brief Takes the oldest message off the queue.
+ *
+ * \param[in]     q         The queue.
+ * \param[out]    item      Set to the message.
+ *
+ * \return #TRUE if a message was taken, #FALSE if the queue is empty.
+ *
+ * \note Only one thread may pop from a queue at a time.
+*/
+char twWsSendQueue_Pop(twWsSendQueue * q, twWsSendItem * item);
+
+/**
+ * \brief Starts a thread that calls \p fn whenever messages are pushed,
+ * until twWsSendQueue_StopWriter() is called.
+ *
+ * \param[in]     q         The queue.
+ * \param[in]     fn        The function to run.  It should pop until the
+ *                          queue is empty.
+ * \param[in]     arg       Passed to \p fn.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Writer threads need POSIX threads.
+*/
+int twWsSendQueue_StartWriter(twWsSendQueue * q, ws_writer_cb fn, void * arg);
+
+/**
+ * \brief Stops the writer thread and waits for it to exit.
+ *
+ * \param[in]     q         The queue.
+ *
+ * \note Must not be called from the writer thread.
+*/
+void twWsSendQueue_StopWriter(twWsSendQueue * q);
+
+/**
+ * \brief Tests if the caller is the queue's writer thread.
+ *
+ * \param[in]     q         The queue.
+ *
+ * \return #TRUE if called from the writer thread.
+*/
+char twWsSendQueue_IsWriter(twWsSendQueue * q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
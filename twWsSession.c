@@ -0,0 +1,137 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  TLS session cache for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsSession.h"
+#include "twTls.h"
+#include "twLogger.h"
+
+#include <string.h>
+
+/* The cache's mutex is created by whichever thread first needs it */
+#if defined(_MSC_VER)
+#define WS_CAS_PTR(p, desired) (InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(desired), NULL) == NULL)
+#define WS_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#else
+#define WS_CAS_PTR(p, desired) __extension__ ({ void * expected = NULL; \
+	__atomic_compare_exchange_n((void **)(p), &expected, (void *)(desired), FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define WS_LOAD_PTR(p) __atomic_load_n((void **)(p), __ATOMIC_ACQUIRE)
+#endif
+
+/* Monotonic clock from twWebsocket.c */
+uint64_t wsGetMicros();
+
+typedef struct twWsSessionEntry {
+	char host[128];
+	uint16_t port;
+	char * data;                            /* Allocated at WS_SESSION_MAX_SIZE the first time the slot is used */
+	uint32_t length;
+	uint64_t stored;                        /* wsGetMicros() time, 0 if the slot is free */
+} twWsSessionEntry;
+
+static TW_MUTEX sessionMutex = NULL;
+static twWsSessionEntry sessions[WS_SESSION_CACHE_SIZE];
+
+static TW_MUTEX sessionLock() {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&sessionMutex);
+	if (m) return m;
+	m = twMutex_Create();
+	if (!m) return NULL;
+	if (!WS_CAS_PTR(&sessionMutex, m)) twMutex_Delete(m);
+	return (TW_MUTEX)WS_LOAD_PTR(&sessionMutex);
+}
+
+static twWsSessionEntry * findSession(const char * host, uint16_t port) {
+	uint32_t i = 0;
+	for (i = 0; i < WS_SESSION_CACHE_SIZE; i++) {
+		if (sessions[i].stored && sessions[i].port == port && !strcmp(sessions[i].host, host)) return &sessions[i];
+	}
+	return NULL;
+}
+
+uint32_t twWsSession_Load(const char * host, uint16_t port, char * buf, uint32_t size) {
+	TW_MUTEX m = NULL;
+	twWsSessionEntry * e = NULL;
+	uint32_t length = 0;
+	if (!host || !buf || !(m = sessionLock())) return 0;
+	twMutex_Lock(m);
+	e = findSession(host, port);
+	if (e && wsGetMicros() - e->stored > (uint64_t)WS_SESSION_LIFETIME * 1000000) {
+		/* Too old for the server to still have it */
+		e->stored = 0;
+		e = NULL;
+	}
+	if (e && e->length <= size) {
+		memcpy(buf, e->data, e->length);
+		length = e->length;
+	}
+	twMutex_Unlock(m);
+	return length;
+}
+
+void twWsSession_Store(const char * host, uint16_t port, const char * data, uint32_t length) {
+	TW_MUTEX m = NULL;
+	twWsSessionEntry * e = NULL;
+	uint32_t i = 0;
+	if (!host || !data || !length || length > WS_SESSION_MAX_SIZE || strlen(host) >= sizeof(e->host)) return;
+	if (!(m = sessionLock())) return;
+	twMutex_Lock(m);
+	e = findSession(host, port);
+	/* Otherwise take a free slot, or the oldest */
+	for (i = 0; !e && i < WS_SESSION_CACHE_SIZE; i++) {
+		if (!sessions[i].stored) e = &sessions[i];
+	}
+	if (!e) {
+		e = &sessions[0];
+		for (i = 1; i < WS_SESSION_CACHE_SIZE; i++) {
+			if (sessions[i].stored < e->stored) e = &sessions[i];
+		}
+	}
+	if (!e->data) e->data = (char *)TW_CALLOC(WS_SESSION_MAX_SIZE, 1);
+	if (!e->data) {
+		TW_LOG(TW_WARN, "twWsSession_Store: Error allocating storage for session with %s:%d", host, port);
+		e->stored = 0;
+	} else {
+		strcpy(e->host, host);
+		e->port = port;
+		memcpy(e->data, data, length);
+		e->length = length;
+		e->stored = wsGetMicros();
+		/* A clock that starts at 0 mustn't make the slot look free */
+		if (!e->stored) e->stored = 1;
+	}
+	twMutex_Unlock(m);
+}
+
+void twWsSession_Forget(const char * host, uint16_t port) {
+	TW_MUTEX m = NULL;
+	twWsSessionEntry * e = NULL;
+	if (!host || !(m = sessionLock())) return;
+	twMutex_Lock(m);
+	e = findSession(host, port);
+	if (e) e->stored = 0;
+	twMutex_Unlock(m);
+}
+
+void twWsSession_Clear() {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&sessionMutex);
+	uint32_t i = 0;
+	if (!m) return;
+	twMutex_Lock(m);
+	for (i = 0; i < WS_SESSION_CACHE_SIZE; i++) {
+		TW_FREE(sessions[i].data);
+		memset(&sessions[i], 0, sizeof(twWsSessionEntry));
+	}
+	twMutex_Unlock(m);
+}
+
+#ifdef WS_TLS_RESUMPTION
+char twWsSession_StillHeld(struct twTlsClient * client, const char * data, uint32_t length) {
+	char current[WS_SESSION_MAX_SIZE];
+	if (!length || length > sizeof(current)) return FALSE;
+	return (uint32_t)WS_TLS_GET_SESSION(client, current, sizeof(current)) == length && !memcmp(current, data, length);
+}
+#endif
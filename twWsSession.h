@@ -0,0 +1,118 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsSession.h
+ *
+ * \brief TLS session cache for websockets
+ *
+ * A full TLS handshake costs both ends a public key operation.  When a
+ * server fails over and thousands of clients come back at once, that is
+ * what stretches recovery out.  The session a connection ends up with is
+ * kept here, keyed by host and port and shared by every websocket in the
+ * process, and offered to the server on the next connection to the same
+ * place so it can resume it with an abbreviated handshake.
+ *
+ * Getting a session out of the TLS client and offering one back are up to
+ * the TLS port, which defines:
+ *
+ * - WS_TLS_GET_SESSION(client, buf, size): copies the connected client's
+ *   session into \c buf and evaluates to its length, or 0 if there isn't one
+ *   or it doesn't fit.
+ * - WS_TLS_SET_SESSION(client, data, length): offers a session for the
+ *   client's next handshake.  A length of 0 offers none.
+ * - WS_TLS_SESSION_RESUMED(client, data, length): optional.  TRUE if the
+ *   last handshake resumed the session offered.  Without it, a session is
+ *   taken to be resumed if the client still has the one offered, which is
+ *   how session IDs behave.
+ *
+ * Without the first two, nothing is cached and every connection does a
+ * full handshake, as before.
+*/
+
+#include "twOSPort.h"
+#include "twTls.h"
+
+#ifndef TW_WS_SESSION_H
+#define TW_WS_SESSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(WS_TLS_GET_SESSION) && defined(WS_TLS_SET_SESSION)
+#define WS_TLS_RESUMPTION
+#ifndef WS_TLS_SESSION_RESUMED
+#define WS_TLS_SESSION_RESUMED(client, data, length) twWsSession_StillHeld((client), (data), (length))
+#endif
+#endif
+
+/* Largest session kept.  Room for a session ticket, not just an ID. */
+#ifndef WS_SESSION_MAX_SIZE
+#define WS_SESSION_MAX_SIZE 2048
+#endif
+
+/* Hosts the cache holds.  The least recently stored is replaced. */
+#ifndef WS_SESSION_CACHE_SIZE
+#define WS_SESSION_CACHE_SIZE 16
+#endif
+
+/* Time (in seconds) a session is offered for after it was stored */
+#ifndef WS_SESSION_LIFETIME
+#define WS_SESSION_LIFETIME 7200
+#endif
+
+/**
+ * \brief Looks up the session last stored for a host and port.
+ *
+ * \param[in]     host      The host.
+ * \param[in]     port      The port.
+ * \param[out]    buf       Where to copy the session.
+ * \param[in]     size      Size of \p buf.
+ *
+ * \return The length of the session, or 0 if there is none that is still
+ * fresh.
+*/
+uint32_t twWsSession_Load(const char * host, uint16_t port, char * buf, uint32_t size);
+
+/**
+ * \brief Stores a session for a host and port, replacing any stored before.
+ *
+ * \param[in]     host      The host.
+ * \param[in]     port      The port.
+ * \param[in]     data      The session.
+ * \param[in]     length    Length of \p data.  Sessions longer than
+ *                          #WS_SESSION_MAX_SIZE are not kept.
+*/
+void twWsSession_Store(const char * host, uint16_t port, const char * data, uint32_t length);
+
+/**
+ * \brief Drops the session for a host and port, so the next connection does
+ * a full handshake.
+ *
+ * \param[in]     host      The host.
+ * \param[in]     port      The port.
+*/
+void twWsSession_Forget(const char * host, uint16_t port);
+
+/**
+ * \brief Drops every session and frees the cache.
+ *
+ * \note No websocket may be connecting while this runs.
+*/
+void twWsSession_Clear();
+
+#ifdef WS_TLS_RESUMPTION
+/**
+ * \brief The default WS_TLS_SESSION_RESUMED(), true if the client's current
+ * session is the one offered.
+*/
+char twWsSession_StillHeld(struct twTlsClient * client, const char * data, uint32_t length);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
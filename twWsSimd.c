@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Vectorized payload kernels for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsSimd.h"
+
+#include <string.h>
+
+#ifndef WS_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WS_SIMD_AVX2
+#define WS_SIMD_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WS_SIMD_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WS_SIMD_NEON
+#endif
+#endif
+
+/**
+* Masking
+**/
+void twWsSimd_Mask(char * dst, const char * src, uint32_t length, const unsigned char * key, uint32_t offset) {
+	unsigned char k[8];
+	uint32_t word = 0;
+	uint64_t wide = 0;
+	uint32_t i = 0;
+	/* Rotate the key so byte 0 of it lines up with src[0], then every word of the payload uses the same key word */
+	for (i = 0; i < 8; i++) k[i] = key[(offset + i) & 3];
+	memcpy(&word, k, 4);
+	memcpy(&wide, k, 8);
+	i = 0;
+#if defined(WS_SIMD_AVX2)
+	{
+		__m256i m = _mm256_set1_epi32((int)word);
+		for (; i + 32 <= length; i += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+			_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, m));
+		}
+	}
+#endif
+#if defined(WS_SIMD_SSE2)
+	{
+		__m128i m = _mm_set1_epi32((int)word);
+		for (; i + 16 <= length; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, m));
+		}
+	}
+#elif defined(WS_SIMD_NEON)
+	{
+		uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(word));
+		for (; i + 16 <= length; i += 16) {
+			vst1q_u8((uint8_t *)(dst + i), veorq_u8(vld1q_u8((const uint8_t *)(src + i)), m));
+		}
+	}
+#endif
+	/* Portable path, and whatever is left over from the vector loops */
+	for (; i + 8 <= length; i += 8) {
+		uint64_t v;
+		memcpy(&v, src + i, 8);
+		v ^= wide;
+		memcpy(dst + i, &v, 8);
+	}
+	for (; i < length; i++) dst[i] = src[i] ^ k[i & 3];
+}
+
+/**
+* UTF-8 validation
+**/
+
+/*
+State is the number of continuation bytes still expected in the low byte,
+and the range the next one must fall in above that.  The range is only
+narrower than 0x80-0xBF straight after a lead byte, where it rules out
+overlong forms, surrogates and code points past U+10FFFF.
+*/
+#define UTF8_STATE(need, lo, hi) ((uint32_t)(need) | ((uint32_t)(lo) << 8) | ((uint32_t)(hi) << 16))
+
+static uint32_t skipAscii(const unsigned char * buf, uint32_t length) {
+	/* Returns the offset of the first byte with the top bit set, or somewhere shortly before it */
+	uint32_t i = 0;
+#if defined(WS_SIMD_AVX2)
+	for (; i + 32 <= length; i += 32) {
+		if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)))) return i;
+	}
+#endif
+#if defined(WS_SIMD_SSE2)
+	for (; i + 16 <= length; i += 16) {
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(buf + i)))) return i;
+	}
+#elif defined(WS_SIMD_NEON)
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t v = vld1q_u8(buf + i);
+		uint64x2_t top = vreinterpretq_u64_u8(vshrq_n_u8(v, 7));
+		if (vgetq_lane_u64(top, 0) | vgetq_lane_u64(top, 1)) return i;
+	}
+#endif
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+		memcpy(&w, buf + i, 8);
+		if (w & 0x8080808080808080ULL) return i;
+	}
+	return i;
+}
+
+char twWsSimd_ValidateUtf8(uint32_t * state, const char * buf, uint32_t length) {
+	const unsigned char * p = (const unsigned char *)buf;
+	uint32_t need = *state & 0xff;
+	unsigned char lo = (unsigned char)(*state >> 8);
+	unsigned char hi = (unsigned char)(*state >> 16);
+	uint32_t i = 0;
+	while (i < length) {
+		unsigned char c = 0;
+		if (!need) {
+			i += skipAscii(p + i, length - i);
+			if (i >= length) break;
+		}
+		c = p[i++];
+		if (need) {
+			if (c < lo || c > hi) return FALSE;
+			need--;
+			lo = 0x80;
+			hi = 0xBF;
+		} else if (c < 0x80) {
+			continue;
+		} else if (c < 0xC2) {
+			/* Stray continuation byte, or an overlong 2 byte form */
+			return FALSE;
+		} else if (c < 0xE0) {
+			need = 1;
+			lo = 0x80;
+			hi = 0xBF;
+		} else if (c < 0xF0) {
+			need = 2;
+			lo = (c == 0xE0) ? 0xA0 : 0x80;
+			hi = (c == 0xED) ? 0x9F : 0xBF;
+		} else if (c < 0xF5) {
+			need = 3;
+			lo = (c == 0xF0) ? 0x90 : 0x80;
+			hi = (c == 0xF4) ? 0x8F : 0xBF;
+		} else {
+			return FALSE;
+		}
+	}
+	*state = need ? UTF8_STATE(need, lo, hi) : 0;
+	return TRUE;
+}
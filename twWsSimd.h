@@ -0,0 +1,61 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsSimd.h
+ *
+ * \brief Vectorized payload kernels for websockets
+ *
+ * Contains the bulk byte processing used on the websocket send and receive
+ * paths.  Each kernel uses AVX2, SSE2 or NEON when the compiler targets them
+ * and falls back to portable word-at-a-time C otherwise.  Define WS_NO_SIMD
+ * to force the portable versions.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_SIMD_H
+#define TW_WS_SIMD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief Masks (or unmasks) a websocket payload.
+ *
+ * \param[out]    dst       Where to write the masked bytes.  May be the same
+ *                          as \p src.
+ * \param[in]     src       The bytes to mask.
+ * \param[in]     length    The number of bytes to mask.
+ * \param[in]     key       The 4 byte mask key, in the order it is sent.
+ * \param[in]     offset    Position of \p src within the payload, so a
+ *                          payload can be masked in pieces.
+*/
+void twWsSimd_Mask(char * dst, const char * src, uint32_t length, const unsigned char * key, uint32_t offset);
+
+/**
+ * \brief Validates UTF-8 incrementally, so a message can be checked a frame
+ * at a time.
+ *
+ * \param[in,out] state     Validator state.  Set to 0 at the start of each
+ *                          message.
+ * \param[in]     buf       The next piece of the message.
+ * \param[in]     length    The length of \p buf.
+ *
+ * \return #TRUE if the message is valid so far, #FALSE if it can't be valid
+ * UTF-8 whatever follows.
+ *
+ * \note A code point may be split across calls.  The message as a whole is
+ * only valid if \p state is 0 after its last piece.
+ * \note Runs of ASCII are checked a vector at a time, so mostly ASCII text
+ * such as JSON validates at close to memcpy speed.
+*/
+char twWsSimd_ValidateUtf8(uint32_t * state, const char * buf, uint32_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
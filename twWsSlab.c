@@ -0,0 +1,334 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Shared buffer allocator for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsSlab.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+
+/* Threads keep blocks of their own where there is a thread exit hook to hand them back with */
+#if !defined(WIN32) && WS_SLAB_THREAD_CACHE_DEPTH > 0
+#define WS_SLAB_THREAD_CACHE
+#include <pthread.h>
+#endif
+
+/* The allocator's mutex is created by whichever thread first needs it */
+#if defined(_MSC_VER)
+#define WS_CAS_PTR(p, desired) (InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(desired), NULL) == NULL)
+#define WS_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define SLAB_ADD(p, n) InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(n))
+#define SLAB_SUB(p, n) InterlockedExchangeAdd64((volatile LONGLONG *)(p), -(LONGLONG)(n))
+#define SLAB_LOAD(p) ((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0))
+#else
+#define WS_CAS_PTR(p, desired) __extension__ ({ void * expected = NULL; \
+	__atomic_compare_exchange_n((void **)(p), &expected, (void *)(desired), FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define WS_LOAD_PTR(p) __atomic_load_n((void **)(p), __ATOMIC_ACQUIRE)
+#define SLAB_ADD(p, n) __atomic_fetch_add((p), (uint64_t)(n), __ATOMIC_RELAXED)
+#define SLAB_SUB(p, n) __atomic_fetch_sub((p), (uint64_t)(n), __ATOMIC_RELAXED)
+#define SLAB_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+/* Every block starts with this.  The caller's memory follows it. */
+typedef union twWsSlabBlock {
+	struct {
+		union twWsSlabBlock * next;     /* On a free list */
+		uint32_t size;                  /* Bytes taken from the system, this header included */
+		uint32_t cls;                   /* Size class, WS_SLAB_CLASSES for blocks too big for one */
+	} h;
+	uint64_t align[2];
+} twWsSlabBlock;
+
+#define BLOCK_DATA(b) ((void *)((b) + 1))
+#define DATA_BLOCK(p) ((twWsSlabBlock *)(p) - 1)
+#define CLASS_SIZE(cls) ((uint32_t)WS_SLAB_MIN_SIZE << (cls))
+
+static TW_MUTEX slabMutex = NULL;
+static twWsSlabBlock * shared[WS_SLAB_CLASSES];
+
+/* Guarded by slabMutex */
+static uint64_t held = 0;
+static uint64_t peak = 0;
+static uint64_t limit = WS_SLAB_LIMIT;
+static uint64_t systemAllocs = 0;
+static uint64_t systemFrees = 0;
+static uint64_t failures = 0;
+
+/* Updated without the lock, from thread caches */
+static uint64_t inUse = 0;
+static uint64_t allocs = 0;
+
+static TW_MUTEX slabLock() {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+	if (m) return m;
+	m = twMutex_Create();
+	if (!m) return NULL;
+	if (!WS_CAS_PTR(&slabMutex, m)) twMutex_Delete(m);
+	return (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+}
+
+static uint32_t slabClass(uint32_t size) {
+	uint32_t cls = 0;
+	while (cls < WS_SLAB_CLASSES && CLASS_SIZE(cls) < size) cls++;
+	return cls;
+}
+
+static twWsSlabBlock * releaseShared(uint64_t target) {
+	/* Unlink shared blocks, biggest first, until no more than target is held.  Caller holds slabMutex and frees them after unlocking. */
+	twWsSlabBlock * released = NULL;
+	uint32_t cls = WS_SLAB_CLASSES;
+	while (cls-- > 0 && held > target) {
+		while (shared[cls] && held > target) {
+			twWsSlabBlock * b = shared[cls];
+			shared[cls] = b->h.next;
+			held -= b->h.size;
+			systemFrees++;
+			b->h.next = released;
+			released = b;
+		}
+	}
+	return released;
+}
+
+static void freeReleased(twWsSlabBlock * b) {
+	while (b) {
+		twWsSlabBlock * next = b->h.next;
+		TW_FREE(b);
+		b = next;
+	}
+}
+
+#ifdef WS_SLAB_THREAD_CACHE
+typedef struct twWsSlabCache {
+	twWsSlabBlock * heads[WS_SLAB_CLASSES];
+	uint32_t counts[WS_SLAB_CLASSES];
+} twWsSlabCache;
+
+static __thread twWsSlabCache * threadCache = NULL;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t cacheKey;
+static char cacheKeyCreated = FALSE;
+
+static void moveCache(twWsSlabCache * c) {
+	/* Hand a thread's blocks over to the shared lists.  Caller holds slabMutex. */
+	uint32_t cls = 0;
+	for (cls = 0; cls < WS_SLAB_CLASSES; cls++) {
+		while (c->heads[cls]) {
+			twWsSlabBlock * b = c->heads[cls];
+			c->heads[cls] = b->h.next;
+			b->h.next = shared[cls];
+			shared[cls] = b;
+		}
+		c->counts[cls] = 0;
+	}
+}
+
+static void flushCache(twWsSlabCache * c) {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+	if (!m) return;
+	twMutex_Lock(m);
+	moveCache(c);
+	twMutex_Unlock(m);
+}
+
+static void destroyCache(void * arg) {
+	/* Runs as a thread exits */
+	twWsSlabCache * c = (twWsSlabCache *)arg;
+	threadCache = NULL;
+	flushCache(c);
+	TW_FREE(c);
+}
+
+static void createCacheKey() {
+	cacheKeyCreated = !pthread_key_create(&cacheKey, destroyCache);
+}
+
+static twWsSlabCache * getCache() {
+	twWsSlabCache * c = threadCache;
+	if (c) return c;
+	pthread_once(&cacheKeyOnce, createCacheKey);
+	if (!cacheKeyCreated) return NULL;
+	c = (twWsSlabCache *)TW_CALLOC(sizeof(twWsSlabCache), 1);
+	if (!c) return NULL;
+	if (pthread_setspecific(cacheKey, c)) {
+		TW_FREE(c);
+		return NULL;
+	}
+	threadCache = c;
+	return c;
+}
+
+static uint32_t cacheDepth(uint32_t cls) {
+	uint32_t depth = WS_SLAB_THREAD_CACHE_BYTES / CLASS_SIZE(cls);
+	return depth < WS_SLAB_THREAD_CACHE_DEPTH ? depth : WS_SLAB_THREAD_CACHE_DEPTH;
+}
+#endif
+
+void * twWsSlab_Alloc(uint32_t size, uint32_t * capacity) {
+	TW_MUTEX m = NULL;
+	twWsSlabBlock * b = NULL;
+	twWsSlabBlock * released = NULL;
+	uint32_t cls = slabClass(size);
+	uint32_t total = 0;
+#ifdef WS_SLAB_THREAD_CACHE
+	twWsSlabCache * c = threadCache;
+	if (cls < WS_SLAB_CLASSES && c && c->heads[cls]) {
+		b = c->heads[cls];
+		c->heads[cls] = b->h.next;
+		c->counts[cls]--;
+	}
+#endif
+	if (!b) {
+		if (cls == WS_SLAB_CLASSES && size > 0xFFFFFFFF - sizeof(twWsSlabBlock)) return NULL;
+		total = sizeof(twWsSlabBlock) + (cls < WS_SLAB_CLASSES ? CLASS_SIZE(cls) : size);
+		if (!(m = slabLock())) {
+			TW_LOG(TW_ERROR, "twWsSlab_Alloc: Error creating allocator mutex");
+			return NULL;
+		}
+		twMutex_Lock(m);
+		if (cls < WS_SLAB_CLASSES && shared[cls]) {
+			b = shared[cls];
+			shared[cls] = b->h.next;
+		} else {
+			/* Make room under the cap from what other classes have kept, then reserve the block */
+#ifdef WS_SLAB_THREAD_CACHE
+			/* This thread's own blocks can be given back too.  It has none of this class. */
+			if (limit && held + total > limit && c) moveCache(c);
+#endif
+			if (limit && held + total > limit) released = releaseShared(limit > total ? limit - total : 0);
+			if (limit && held + total > limit) {
+				failures++;
+				twMutex_Unlock(m);
+				freeReleased(released);
+				TW_LOG(TW_WARN, "twWsSlab_Alloc: Allocating %u bytes would exceed the limit of %llu", size, (unsigned long long)limit);
+				return NULL;
+			}
+			held += total;
+			if (held > peak) peak = held;
+			systemAllocs++;
+		}
+		twMutex_Unlock(m);
+		freeReleased(released);
+		if (!b) {
+			b = (twWsSlabBlock *)TW_CALLOC(total, 1);
+			if (!b) {
+				twMutex_Lock(m);
+				held -= total;
+				systemAllocs--;
+				failures++;
+				twMutex_Unlock(m);
+				return NULL;
+			}
+			b->h.size = total;
+			b->h.cls = cls;
+		}
+	}
+	b->h.next = NULL;
+	SLAB_ADD(&inUse, b->h.size);
+	SLAB_ADD(&allocs, 1);
+	if (capacity) *capacity = b->h.size - sizeof(twWsSlabBlock);
+	return BLOCK_DATA(b);
+}
+
+void * twWsSlab_Realloc(void * p, uint32_t keep, uint32_t size, uint32_t * capacity) {
+	uint32_t current = p ? DATA_BLOCK(p)->h.size - sizeof(twWsSlabBlock) : 0;
+	void * n = NULL;
+	if (p && current >= size) {
+		if (capacity) *capacity = current;
+		return p;
+	}
+	n = twWsSlab_Alloc(size, capacity);
+	if (!n) return NULL;
+	if (p) {
+		memcpy(n, p, keep < current ? keep : current);
+		twWsSlab_Free(p);
+	}
+	return n;
+}
+
+void twWsSlab_Free(void * p) {
+	TW_MUTEX m = NULL;
+	twWsSlabBlock * b = NULL;
+	if (!p) return;
+	b = DATA_BLOCK(p);
+	SLAB_SUB(&inUse, b->h.size);
+#ifdef WS_SLAB_THREAD_CACHE
+	if (b->h.cls < WS_SLAB_CLASSES) {
+		twWsSlabCache * c = getCache();
+		if (c && c->counts[b->h.cls] < cacheDepth(b->h.cls)) {
+			b->h.next = c->heads[b->h.cls];
+			c->heads[b->h.cls] = b;
+			c->counts[b->h.cls]++;
+			return;
+		}
+	}
+#endif
+	/* Every block was allocated under the mutex, so it exists */
+	m = (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+	twMutex_Lock(m);
+	if (b->h.cls < WS_SLAB_CLASSES) {
+		b->h.next = shared[b->h.cls];
+		shared[b->h.cls] = b;
+		b = NULL;
+	} else {
+		held -= b->h.size;
+		systemFrees++;
+	}
+	twMutex_Unlock(m);
+	if (b) TW_FREE(b);
+}
+
+int twWsSlab_SetLimit(uint64_t bytes) {
+	TW_MUTEX m = slabLock();
+	twWsSlabBlock * released = NULL;
+	if (!m) {
+		TW_LOG(TW_ERROR, "twWsSlab_SetLimit: Error creating allocator mutex");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	twMutex_Lock(m);
+	limit = bytes;
+	if (limit && held > limit) released = releaseShared(limit);
+	twMutex_Unlock(m);
+	freeReleased(released);
+	return TW_OK;
+}
+
+int twWsSlab_GetStats(twWsSlabStats * stats) {
+	TW_MUTEX m = NULL;
+	if (!stats) {
+		TW_LOG(TW_ERROR, "twWsSlab_GetStats: NULL stats pointer");
+		return TW_INVALID_PARAM;
+	}
+	memset(stats, 0, sizeof(twWsSlabStats));
+	m = (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+	if (m) twMutex_Lock(m);
+	stats->limit = limit;
+	stats->held = held;
+	stats->peak = peak;
+	stats->systemAllocs = systemAllocs;
+	stats->systemFrees = systemFrees;
+	stats->failures = failures;
+	if (m) twMutex_Unlock(m);
+	stats->inUse = SLAB_LOAD(&inUse);
+	stats->allocs = SLAB_LOAD(&allocs);
+	/* inUse moves without the lock, so the two can briefly disagree */
+	stats->cached = stats->held > stats->inUse ? stats->held - stats->inUse : 0;
+	return TW_OK;
+}
+
+void twWsSlab_Trim() {
+	TW_MUTEX m = (TW_MUTEX)WS_LOAD_PTR(&slabMutex);
+	twWsSlabBlock * released = NULL;
+	if (!m) return;
+#ifdef WS_SLAB_THREAD_CACHE
+	if (threadCache) flushCache(threadCache);
+#endif
+	twMutex_Lock(m);
+	released = releaseShared(0);
+	twMutex_Unlock(m);
+	freeReleased(released);
+}
@@ -0,0 +1,142 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsSlab.h
+ *
+ * \brief Shared buffer allocator for websockets
+ *
+ * Every websocket needs frame, reassembly, read ahead, send staging and
+ * handshake buffers, and on a gateway that reconnects all day they would
+ * otherwise be taken from and given back to the heap over and over, which
+ * fragments it.  They come from here instead.  Requests are rounded up to a
+ * power of two size class and blocks that are freed are kept, per class, to
+ * be handed out again, so once every class in use has been populated the
+ * websockets stop calling malloc at all.
+ *
+ * Each thread keeps a few blocks of each class to itself, so most allocations
+ * and frees don't touch the shared lock.  The rest are shared by every
+ * websocket in the process.  Memory taken from the system, whether in use or
+ * kept, can be capped with twWsSlab_SetLimit(), and twWsSlab_GetStats()
+ * reports how much there is and the most there has been.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_SLAB_H
+#define TW_WS_SLAB_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Smallest size class.  Must be a power of two. */
+#ifndef WS_SLAB_MIN_SIZE
+#define WS_SLAB_MIN_SIZE 512
+#endif
+
+/* Number of size classes, each twice the last.  Bigger requests go straight to the system. */
+#ifndef WS_SLAB_CLASSES
+#define WS_SLAB_CLASSES 12
+#endif
+
+/* Most blocks of one class a thread keeps to itself */
+#ifndef WS_SLAB_THREAD_CACHE_DEPTH
+#define WS_SLAB_THREAD_CACHE_DEPTH 8
+#endif
+
+/* Most bytes of one class a thread keeps to itself.  Classes bigger than this are only kept shared. */
+#ifndef WS_SLAB_THREAD_CACHE_BYTES
+#define WS_SLAB_THREAD_CACHE_BYTES 65536
+#endif
+
+/* Initial cap (in bytes) on memory taken from the system, 0 for none */
+#ifndef WS_SLAB_LIMIT
+#define WS_SLAB_LIMIT 0
+#endif
+
+/**
+ * \brief Allocator statistics.  All sizes are in bytes and include the
+ * allocator's own header on each block.
+*/
+typedef struct twWsSlabStats {
+	uint64_t limit;                         /**< The cap, 0 if there is none. **/
+	uint64_t held;                          /**< Memory taken from the system and not yet given back. **/
+	uint64_t peak;                          /**< The most that has been held at once. **/
+	uint64_t inUse;                         /**< Memory in blocks that are allocated. **/
+	uint64_t cached;                        /**< Memory in blocks kept for reuse, by threads or shared. **/
+	uint64_t allocs;                        /**< Blocks handed out. **/
+	uint64_t systemAllocs;                  /**< Blocks that had to be taken from the system. **/
+	uint64_t systemFrees;                   /**< Blocks given back to the system. **/
+	uint64_t failures;                      /**< Allocations refused, because of the cap or because the system had nothing. **/
+} twWsSlabStats;
+
+/**
+ * \brief Allocates a block of at least \p size bytes.  Its contents are
+ * undefined.
+ *
+ * \param[in]     size      Bytes needed.
+ * \param[out]    capacity  If not NULL, set to the usable size of the block,
+ *                          which may be more than was asked for.
+ *
+ * \return The block, or NULL if it couldn't be allocated.
+*/
+void * twWsSlab_Alloc(uint32_t size, uint32_t * capacity);
+
+/**
+ * \brief Makes sure a block holds at least \p size bytes, moving it to a
+ * bigger one if it has to.
+ *
+ * \param[in]     p         The block, or NULL to allocate a new one.
+ * \param[in]     keep      Bytes at the start of the block to carry over.
+ * \param[in]     size      Bytes needed.
+ * \param[out]    capacity  If not NULL, set to the usable size of the block.
+ *
+ * \return The block, or NULL if it couldn't be allocated, in which case \p p
+ * is left as it was.
+*/
+void * twWsSlab_Realloc(void * p, uint32_t keep, uint32_t size, uint32_t * capacity);
+
+/**
+ * \brief Frees a block from twWsSlab_Alloc() or twWsSlab_Realloc().  Any
+ * thread may free a block.
+ *
+ * \param[in]     p         The block.  NULL is ignored.
+*/
+void twWsSlab_Free(void * p);
+
+/**
+ * \brief Sets the cap on memory taken from the system.  Allocations that
+ * would go over it fail, after giving back shared blocks of other classes
+ * to make room.  Lowering the cap below what is held doesn't free anything
+ * in use.
+ *
+ * \param[in]     limit     The cap in bytes, 0 for none.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsSlab_SetLimit(uint64_t limit);
+
+/**
+ * \brief Gets the allocator's statistics.
+ *
+ * \param[out]    stats     Where to copy them.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsSlab_GetStats(twWsSlabStats * stats);
+
+/**
+ * \brief Gives every shared block, and those the calling thread keeps, back
+ * to the system.  Blocks other threads keep stay with them until they exit.
+*/
+void twWsSlab_Trim();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Binary event tracer for the websocket hot paths
+ */
+
+#include "twOSPort.h"
+#include "twWsTrace.h"
+#include "twErrors.h"
+#include "twLogger.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <intrin.h>
+#elif !defined(WIN32)
+#include <time.h>
+#endif
+
+#define TRACE_MAGIC "TWWSTRC1"
+
+/*
+A dump is a file header, then for each thread a ring header followed by its
+events, oldest first.  Everything is written in the host's byte order.
+*/
+typedef struct twWsTraceEvent {
+	uint64_t tsc;                           /* Cycle counter when recorded */
+	uint64_t ws;                            /* Address of the websocket */
+	uint64_t b;
+	uint32_t a;
+	uint16_t type;
+	uint16_t reserved;
+} twWsTraceEvent;
+
+typedef struct twWsTraceFileHeader {
+	char magic[8];
+	uint64_t ticksPerSecond;                /* Cycle counter rate, measured when the dump was taken */
+	uint32_t rings;
+	uint32_t eventSize;
+} twWsTraceFileHeader;
+
+typedef struct twWsTraceRingHeader {
+	uint32_t thread;                        /* Numbered in the order threads first recorded */
+	uint32_t count;
+} twWsTraceRingHeader;
+
+#ifdef ENABLE_WS_TRACE
+
+#if defined(_MSC_VER)
+#define TRACE_TLS __declspec(thread)
+#define TRACE_LOAD_ACQUIRE(p) InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0)
+#define TRACE_STORE_RELEASE(p, v) InterlockedExchange64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#define TRACE_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define TRACE_CAS_PTR(p, expected, desired) \
+	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (PVOID)(desired), (PVOID)(expected)) == (PVOID)(expected))
+#define TRACE_NEXT_ID(p) ((uint32_t)InterlockedIncrement((volatile LONG *)(p)) - 1)
+#else
+#define TRACE_TLS __thread
+#define TRACE_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TRACE_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define TRACE_LOAD_PTR(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TRACE_CAS_PTR(p, expected, desired) \
+	__atomic_compare_exchange_n(p, &(expected), desired, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define TRACE_NEXT_ID(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#endif
+
+/*
+Only the owning thread writes a ring.  head counts every event it has ever
+recorded and is published after the event is written, so a reader that
+loads head sees complete events below it - apart from the oldest ones, which
+the writer may be overwriting while the reader copies.  The reader checks
+head again afterwards and drops any that could have been.
+*/
+typedef struct twWsTraceRing {
+	twWsTraceEvent events[WS_TRACE_RING_SIZE];
+	uint64_t head;
+	uint32_t thread;
+	struct twWsTraceRing * next;            /* All rings, newest first, pushed with CAS and never removed */
+} twWsTraceRing;
+
+static TRACE_TLS twWsTraceRing * threadRing = NULL;
+static twWsTraceRing * allRings = NULL;
+static uint32_t nextThreadId = 0;
+
+/* Cycle counter and clock when the first ring was created, to work out the counter's rate */
+static uint64_t baseTicks = 0;
+static uint64_t baseNanos = 0;
+
+static uint64_t traceTicks() {
+#if defined(_MSC_VER)
+	return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	/* No cycle counter we can read - fall back to the clock, in nanoseconds */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t traceNanos() {
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static twWsTraceRing * createRing() {
+	twWsTraceRing * ring = (twWsTraceRing *)TW_CALLOC(sizeof(twWsTraceRing), 1);
+	twWsTraceRing * head = NULL;
+	if (!ring) return NULL;
+	ring->thread = TRACE_NEXT_ID(&nextThreadId);
+	/* Whichever thread is first sets the base.  A race here only skews the rate estimate slightly. */
+	if (!ring->thread) {
+		baseNanos = traceNanos();
+		baseTicks = traceTicks();
+	}
+	head = (twWsTraceRing *)TRACE_LOAD_PTR(&allRings);
+	do {
+		ring->next = head;
+	} while (!TRACE_CAS_PTR(&allRings, head, ring));
+	return ring;
+}
+
+void twWsTrace_Record(uint16_t type, const void * ws, uint32_t a, uint64_t b) {
+	twWsTraceRing * ring = threadRing;
+	twWsTraceEvent * e = NULL;
+	if (!ring) {
+		ring = createRing();
+		if (!ring) return;
+		threadRing = ring;
+	}
+	e = &ring->events[ring->head & (WS_TRACE_RING_SIZE - 1)];
+	e->tsc = traceTicks();
+	e->ws = (uint64_t)(size_t)ws;
+	e->a = a;
+	e->b = b;
+	e->type = type;
+	TRACE_STORE_RELEASE(&ring->head, ring->head + 1);
+}
+
+int twWsTrace_Dump(const char * path) {
+	twWsTraceFileHeader fh;
+	twWsTraceRing * first = NULL;
+	twWsTraceRing * ring = NULL;
+	twWsTraceEvent * copy = NULL;
+	uint64_t nanos = 0;
+	FILE * f = NULL;
+	int res = TW_OK;
+	if (!path) {
+		TW_LOG(TW_ERROR, "twWsTrace_Dump: NULL path");
+		return TW_INVALID_PARAM;
+	}
+	copy = (twWsTraceEvent *)TW_CALLOC(sizeof(twWsTraceEvent), WS_TRACE_RING_SIZE);
+	if (!copy) {
+		TW_LOG(TW_ERROR, "twWsTrace_Dump: Error allocating event buffer");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	f = fopen(path, "wb");
+	if (!f) {
+		TW_LOG(TW_ERROR, "twWsTrace_Dump: Error opening %s", path);
+		TW_FREE(copy);
+		return TW_INVALID_PARAM;
+	}
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+	fh.eventSize = sizeof(twWsTraceEvent);
+	/* Rings are only ever pushed in front, so the list from here on can't change under us */
+	first = (twWsTraceRing *)TRACE_LOAD_PTR(&allRings);
+	for (ring = first; ring; ring = ring->next) fh.rings++;
+	nanos = traceNanos();
+	if (nanos > baseNanos) fh.ticksPerSecond = (uint64_t)((double)(traceTicks() - baseTicks) * 1e9 / (double)(nanos - baseNanos));
+	if (fwrite(&fh, sizeof(fh), 1, f) != 1) res = TW_UNKNOWN_ERROR;
+	for (ring = first; ring && !res; ring = ring->next) {
+		twWsTraceRingHeader rh;
+		uint64_t head = TRACE_LOAD_ACQUIRE(&ring->head);
+		uint64_t start = head > WS_TRACE_RING_SIZE ? head - WS_TRACE_RING_SIZE : 0;
+		uint64_t after = 0;
+		uint64_t i = 0;
+		for (i = start; i < head; i++) copy[i - start] = ring->events[i & (WS_TRACE_RING_SIZE - 1)];
+		/* Anything the writer has lapped since we loaded head, or is writing now, may be torn */
+		after = TRACE_LOAD_ACQUIRE(&ring->head);
+		if (after + 1 > WS_TRACE_RING_SIZE + start) {
+			uint64_t skip = after + 1 - WS_TRACE_RING_SIZE - start;
+			if (skip > head - start) skip = head - start;
+			memmove(copy, copy + skip, (size_t)(head - start - skip) * sizeof(twWsTraceEvent));
+			start += skip;
+		}
+		rh.thread = ring->thread;
+		rh.count = (uint32_t)(head - start);
+		if (fwrite(&rh, sizeof(rh), 1, f) != 1 || (rh.count && fwrite(copy, sizeof(twWsTraceEvent), rh.count, f) != rh.count)) res = TW_UNKNOWN_ERROR;
+	}
+	if (fclose(f)) res = TW_UNKNOWN_ERROR;
+	if (res) TW_LOG(TW_ERROR, "twWsTrace_Dump: Error writing %s", path);
+	TW_FREE(copy);
+	return res;
+}
+
+#else
+
+/* Built without tracing - WS_TRACE() compiles to nothing, so there is never anything to dump */
+void twWsTrace_Record(uint16_t type, const void * ws, uint32_t a, uint64_t b) {
+	(void)type;
+	(void)ws;
+	(void)a;
+	(void)b;
+}
+
+int twWsTrace_Dump(const char * path) {
+	(void)path;
+	TW_LOG(TW_ERROR, "twWsTrace_Dump: Tracing requires ENABLE_WS_TRACE");
+	return TW_INVALID_PARAM;
+}
+
+#endif
+
+/**
+* Decoding
+**/
+typedef struct twWsTraceDecoded {
+	twWsTraceEvent e;
+	uint32_t thread;
+} twWsTraceDecoded;
+
+static const char * eventNames[WS_TRACE_EVENT_COUNT] = {
+	"?",
+	"read",
+	"read-empty",
+	"read-error",
+	"write",
+	"write-blocked",
+	"lock-wait",
+	"header-incomplete",
+	"frame-header",
+	"body-incomplete",
+	"frame-received",
+	"fragment-received",
+	"message-received",
+	"frame-sent",
+	"control-sent",
+	"control-queued",
+	"message-sent",
+	"batch-sent"
+};
+
+static int compareEvents(const void * x, const void * y) {
+	const twWsTraceDecoded * l = (const twWsTraceDecoded *)x;
+	const twWsTraceDecoded * r = (const twWsTraceDecoded *)y;
+	if (l->e.tsc != r->e.tsc) return l->e.tsc < r->e.tsc ? -1 : 1;
+	return l->thread < r->thread ? -1 : l->thread > r->thread;
+}
+
+int twWsTrace_Decode(const char * inPath, const char * outPath) {
+	twWsTraceFileHeader fh;
+	twWsTraceDecoded * events = NULL;
+	uint32_t count = 0;
+	uint32_t capacity = 0;
+	uint32_t i = 0;
+	FILE * in = NULL;
+	FILE * out = stdout;
+	int res = TW_OK;
+	if (!inPath) {
+		TW_LOG(TW_ERROR, "twWsTrace_Decode: NULL input path");
+		return TW_INVALID_PARAM;
+	}
+	in = fopen(inPath, "rb");
+	if (!in) {
+		TW_LOG(TW_ERROR, "twWsTrace_Decode: Error opening %s", inPath);
+		return TW_INVALID_PARAM;
+	}
+	if (fread(&fh, sizeof(fh), 1, in) != 1 || memcmp(fh.magic, TRACE_MAGIC, sizeof(fh.magic)) || fh.eventSize != sizeof(twWsTraceEvent)) {
+		TW_LOG(TW_ERROR, "twWsTrace_Decode: %s is not a trace dump from this platform", inPath);
+		fclose(in);
+		return TW_INVALID_PARAM;
+	}
+	/* Gather every thread's events so they can be put in one timeline */
+	for (i = 0; i < fh.rings && !res; i++) {
+		twWsTraceRingHeader rh;
+		uint32_t j = 0;
+		if (fread(&rh, sizeof(rh), 1, in) != 1) {
+			res = TW_INVALID_PARAM;
+			break;
+		}
+		if (count + rh.count > capacity) {
+			twWsTraceDecoded * grown = NULL;
+			capacity = count + rh.count;
+			grown = (twWsTraceDecoded *)TW_REALLOC(events, capacity * sizeof(twWsTraceDecoded));
+			if (!grown) {
+				res = TW_ERROR_ALLOCATING_MEMORY;
+				break;
+			}
+			events = grown;
+		}
+		for (j = 0; j < rh.count; j++) {
+			if (fread(&events[count].e, sizeof(twWsTraceEvent), 1, in) != 1) {
+				res = TW_INVALID_PARAM;
+				break;
+			}
+			events[count++].thread = rh.thread;
+		}
+	}
+	fclose(in);
+	if (res) {
+		TW_LOG(TW_ERROR, "twWsTrace_Decode: Error reading %s", inPath);
+		TW_FREE(events);
+		return res;
+	}
+	if (outPath) {
+		out = fopen(outPath, "w");
+		if (!out) {
+			TW_LOG(TW_ERROR, "twWsTrace_Decode: Error opening %s", outPath);
+			TW_FREE(events);
+			return TW_INVALID_PARAM;
+		}
+	}
+	if (count) qsort(events, count, sizeof(twWsTraceDecoded), compareEvents);
+	fprintf(out, "# %u events, %u threads, %llu ticks per second\n", count, fh.rings, (unsigned long long)fh.ticksPerSecond);
+	fprintf(out, "# microseconds thread websocket event a b\n");
+	for (i = 0; i < count; i++) {
+		twWsTraceEvent * e = &events[i].e;
+		/* Times are relative to the first event */
+		uint64_t ticks = e->tsc - events[0].e.tsc;
+		double micros = fh.ticksPerSecond ? (double)ticks * 1e6 / (double)fh.ticksPerSecond : (double)ticks;
+		fprintf(out, "%14.3f %3u %#llx %s %u %llu\n", micros, events[i].thread, (unsigned long long)e->ws,
+			e->type < WS_TRACE_EVENT_COUNT ? eventNames[e->type] : eventNames[0], e->a, (unsigned long long)e->b);
+	}
+	if (outPath && fclose(out)) res = TW_UNKNOWN_ERROR;
+	TW_FREE(events);
+	return res;
+}
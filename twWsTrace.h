@@ -0,0 +1,114 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsTrace.h
+ *
+ * \brief Binary event tracer for the websocket hot paths
+ *
+ * Frame and socket events are recorded as fixed size binary records into a
+ * ring owned by the recording thread, stamped with the CPU's cycle counter.
+ * Recording takes no lock and formats nothing, so the per-frame timeline of
+ * a busy connection can be captured without disturbing it.  Rings are
+ * written to a file with twWsTrace_Dump() and turned into text afterwards
+ * with twWsTrace_Decode().
+ *
+ * Tracing is only compiled in when built with ENABLE_WS_TRACE.  Otherwise
+ * WS_TRACE() expands to nothing and its arguments are never evaluated.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_TRACE_H
+#define TW_WS_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Events each thread keeps, oldest overwritten first.  Must be a power of 2. */
+#ifndef WS_TRACE_RING_SIZE
+#define WS_TRACE_RING_SIZE 8192
+#endif
+
+/**
+ * \brief Event types.  The meaning of each event's two values is given
+ * alongside.
+*/
+enum ws_trace_event {
+	WS_TRACE_READ = 1,                      /**< a: bytes asked for, b: bytes read. **/
+	WS_TRACE_READ_EMPTY,                    /**< a: bytes asked for. **/
+	WS_TRACE_READ_ERROR,                    /**< a: bytes asked for, b: the error returned. **/
+	WS_TRACE_WRITE,                         /**< a: bytes written. **/
+	WS_TRACE_WRITE_BLOCKED,                 /**< a: bytes to write, b: bytes written, or the error returned. **/
+	WS_TRACE_LOCK_WAIT,                     /**< b: microseconds spent waiting for the frame mutex. **/
+	WS_TRACE_HEADER_INCOMPLETE,             /**< b: header bytes still needed. **/
+	WS_TRACE_FRAME_HEADER,                  /**< a: first two header bytes, b: payload length. **/
+	WS_TRACE_BODY_INCOMPLETE,               /**< b: payload bytes still needed. **/
+	WS_TRACE_FRAME_RECEIVED,                /**< a: opcode, b: payload length. **/
+	WS_TRACE_FRAGMENT_RECEIVED,             /**< a: first header byte, b: message length so far. **/
+	WS_TRACE_MESSAGE_RECEIVED,              /**< a: opcode, compressed (0x100) and loaned (0x200) flags, b: message length. **/
+	WS_TRACE_FRAME_SENT,                    /**< a: first header byte, b: payload length. **/
+	WS_TRACE_CONTROL_SENT,                  /**< a: opcode, b: payload length. **/
+	WS_TRACE_CONTROL_QUEUED,                /**< a: opcode, b: payload length. **/
+	WS_TRACE_MESSAGE_SENT,                  /**< a: frames, b: message length. **/
+	WS_TRACE_BATCH_SENT,                    /**< a: frames, b: messages. **/
+	WS_TRACE_EVENT_COUNT
+};
+
+#ifdef ENABLE_WS_TRACE
+#define WS_TRACE(type, ws, a, b) twWsTrace_Record((uint16_t)(type), (ws), (uint32_t)(a), (uint64_t)(b))
+#else
+/* sizeof keeps variables only traced from looking unused, without evaluating anything */
+#define WS_TRACE(type, ws, a, b) ((void)sizeof(a), (void)sizeof(b))
+#endif
+
+/**
+ * \brief Records an event in the calling thread's ring.  Use WS_TRACE()
+ * rather than calling this directly.
+ *
+ * \param[in]     type      One of ::ws_trace_event.
+ * \param[in]     ws        The websocket the event belongs to.  Only its
+ *                          address is recorded.
+ * \param[in]     a         First value, see ::ws_trace_event.
+ * \param[in]     b         Second value, see ::ws_trace_event.
+ *
+ * \note The first event on a thread allocates its ring.  The ring is kept
+ * after the thread exits so its events still appear in dumps.
+*/
+void twWsTrace_Record(uint16_t type, const void * ws, uint32_t a, uint64_t b);
+
+/**
+ * \brief Writes every thread's ring to a file.
+ *
+ * \param[in]     path      The file to write.  Overwritten if it exists.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Safe to call from any thread while others are recording.  Events
+ * overwritten while the dump is being taken are left out.
+ * \note Requires the SDK to be built with ENABLE_WS_TRACE.
+*/
+int twWsTrace_Dump(const char * path);
+
+/**
+ * \brief Converts a file written by twWsTrace_Dump() to text, one line per
+ * event in time order across all threads.
+ *
+ * \param[in]     inPath    The dump to read.
+ * \param[in]     outPath   The text file to write, or NULL for stdout.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Does not need ENABLE_WS_TRACE, so dumps can be decoded by any build.
+*/
+int twWsTrace_Decode(const char * inPath, const char * outPath);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
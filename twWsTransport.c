@@ -0,0 +1,592 @@
+/*
+ *  Copyright (C) 2015 ThingWorx Inc.
+ *
+ *  Byte stream transports for websockets
+ */
+
+#include "twOSPort.h"
+#include "twWsTransport.h"
+#include "twErrors.h"
+#include "twLogger.h"
+#include "twTls.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Monotonic clock from twWebsocket.c */
+uint64_t wsGetMicros();
+
+static int allocTransport(const twWsTransportOps * ops, void * impl, twWsTransport ** entity) {
+	twWsTransport * t = (twWsTransport *)TW_CALLOC(sizeof(twWsTransport), 1);
+	if (!t) {
+		TW_LOG(TW_ERROR, "twWsTransport: Error allocating %s transport", ops->name);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	t->ops = ops;
+	t->impl = impl;
+	*entity = t;
+	return TW_OK;
+}
+
+/**
+* TLS
+**/
+static int tlsConnect(twWsTransport * t, const char * host, uint16_t port, uint32_t timeout) {
+	/* The TLS client applies its own connect timeout */
+	(void)timeout;
+	return twTlsClient_Reconnect(t->tls, host, port);
+}
+
+static int tlsRead(twWsTransport * t, char * buf, uint32_t length, uint32_t timeout) {
+	return twTlsClient_Read(t->tls, buf, length, timeout);
+}
+
+static int tlsWrite(twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout) {
+	return twTlsClient_Write(t->tls, (char *)buf, length, timeout);
+}
+
+static void tlsClose(twWsTransport * t) {
+	twTlsClient_Close(t->tls);
+}
+
+static int tlsFd(twWsTransport * t) {
+	if (!t->tls->connection) return -1;
+	return t->tls->connection->sock;
+}
+
+static void tlsDestroy(twWsTransport * t) {
+	twTlsClient_Delete(t->tls);
+}
+
+/* Each TLS write is a record, so gathering saves nothing over writing the pieces in turn */
+static const twWsTransportOps tlsOps = { "TLS", tlsConnect, tlsRead, tlsWrite, NULL, tlsClose, tlsFd, tlsDestroy };
+
+int twWsTransport_CreateTls(const char * host, uint16_t port, twWsTransport ** entity) {
+	struct twTlsClient * tls = NULL;
+	int err = TW_OK;
+	if (!host || !entity) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreateTls: NULL host or entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	err = twTlsClient_Create(host, port, 0, &tls);
+	if (err) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreateTls: Error creating TLS client for %s:%d", host, port);
+		return err;
+	}
+	err = allocTransport(&tlsOps, NULL, entity);
+	if (err) {
+		twTlsClient_Delete(tls);
+		return err;
+	}
+	(*entity)->tls = tls;
+	return TW_OK;
+}
+
+#ifndef WIN32
+
+/**
+* TCP and Unix domain sockets
+**/
+typedef struct wsSocket {
+	int fd;
+	int family;                             /* AF_UNIX, or AF_UNSPEC for TCP */
+} wsSocket;
+
+static void socketClose(twWsTransport * t) {
+	wsSocket * s = (wsSocket *)t->impl;
+	if (s->fd >= 0) close(s->fd);
+	s->fd = -1;
+}
+
+static int connectWithin(int fd, const struct sockaddr * sa, socklen_t length, uint32_t timeout, uint64_t deadline) {
+	/* Connect without blocking past the deadline, or at all if timeout is 0.  Returns 0 once connected, -1 with errno set if not. */
+	int flags = fcntl(fd, F_GETFL, 0);
+	int err = 0;
+	socklen_t errLength = sizeof(err);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) return -1;
+	if (connect(fd, sa, length)) {
+		struct pollfd p;
+		int n = 0;
+		if (errno != EINPROGRESS) return -1;
+		do {
+			uint64_t now = wsGetMicros();
+			if (timeout && now >= deadline) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			p.fd = fd;
+			p.events = POLLOUT;
+			p.revents = 0;
+			n = poll(&p, 1, timeout ? (int)((deadline - now + 999) / 1000) : -1);
+		} while (n < 0 ? errno == EINTR : !n);
+		if (n < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLength)) return -1;
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+	/* Reads and writes do their own waiting */
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static int socketConnect(twWsTransport * t, const char * host, uint16_t port, uint32_t timeout) {
+	wsSocket * s = (wsSocket *)t->impl;
+	uint64_t deadline = wsGetMicros() + (uint64_t)timeout * 1000;
+	int one = 1;
+	socketClose(t);
+	if (s->family == AF_UNIX) {
+		struct sockaddr_un sa;
+		if (strlen(host) >= sizeof(sa.sun_path)) {
+			TW_LOG(TW_ERROR, "twWsTransport: Socket path is too long: %s", host);
+			return TW_INVALID_PARAM;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, host);
+		s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (s->fd >= 0 && connectWithin(s->fd, (struct sockaddr *)&sa, sizeof(sa), timeout, deadline)) socketClose(t);
+	} else {
+		struct addrinfo hints;
+		struct addrinfo * res = NULL;
+		struct addrinfo * ai = NULL;
+		char service[8];
+		sprintf(service, "%u", port);
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, service, &hints, &res) || !res) {
+			TW_LOG(TW_ERROR, "twWsTransport: Error resolving %s", host);
+			return TW_SOCKET_INIT_ERROR;
+		}
+		/* Every address shares the one timeout */
+		for (ai = res; ai && s->fd < 0; ai = ai->ai_next) {
+			s->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (s->fd >= 0 && connectWithin(s->fd, ai->ai_addr, ai->ai_addrlen, timeout, deadline)) socketClose(t);
+		}
+		freeaddrinfo(res);
+		/* Frames are already coalesced into as few writes as possible, so Nagle would only add delay */
+		if (s->fd >= 0) setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	if (s->fd < 0) {
+		TW_LOG(TW_ERROR, "twWsTransport: Error connecting to %s:%d.  Error: %d", host, port, errno);
+		return TW_SOCKET_INIT_ERROR;
+	}
+#ifdef SO_NOSIGPIPE
+	setsockopt(s->fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	return TW_OK;
+}
+
+static int socketRead(twWsTransport * t, char * buf, uint32_t length, uint32_t timeout) {
+	wsSocket * s = (wsSocket *)t->impl;
+	ssize_t n = 0;
+	if (s->fd < 0) return -1;
+	if (timeout) {
+		struct pollfd p;
+		p.fd = s->fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		n = poll(&p, 1, (int)timeout);
+		if (n <= 0) return (n < 0 && errno != EINTR) ? -1 : 0;
+	}
+	n = recv(s->fd, buf, length, MSG_DONTWAIT);
+	if (n > 0) return (int)n;
+	/* A read of nothing means the peer has closed the connection */
+	if (n == 0) return -1;
+	return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+static int socketWritev(twWsTransport * t, const twWsIoVec * iov, uint32_t count, uint32_t timeout) {
+	/* Keeps handing the kernel what is left until it has all gone or the time is up */
+	wsSocket * s = (wsSocket *)t->impl;
+	uint64_t deadline = wsGetMicros() + (uint64_t)timeout * 1000;
+	uint32_t total = 0;
+	uint32_t i = 0;
+	uint32_t offset = 0;                    /* Bytes of iov[i] already sent */
+	if (s->fd < 0) return -1;
+	while (i < count && offset == iov[i].length) i++;
+	while (i < count) {
+		struct iovec vec[WS_TRANSPORT_MAX_IOV];
+		struct msghdr msg;
+		uint32_t n = 0;
+		uint32_t j = 0;
+		ssize_t sent = 0;
+		for (j = i; j < count && n < WS_TRANSPORT_MAX_IOV; j++) {
+			uint32_t skip = (j == i) ? offset : 0;
+			if (iov[j].length == skip) continue;
+			vec[n].iov_base = (void *)(iov[j].data + skip);
+			vec[n].iov_len = iov[j].length - skip;
+			n++;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = n;
+		sent = sendmsg(s->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			struct pollfd p;
+			uint64_t now = wsGetMicros();
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+			if (now >= deadline) break;
+			p.fd = s->fd;
+			p.events = POLLOUT;
+			p.revents = 0;
+			poll(&p, 1, (int)((deadline - now + 999) / 1000));
+			continue;
+		}
+		total += (uint32_t)sent;
+		/* Step past what went */
+		while (i < count && (uint32_t)sent >= iov[i].length - offset) {
+			sent -= iov[i].length - offset;
+			offset = 0;
+			i++;
+		}
+		if (i < count) offset += (uint32_t)sent;
+	}
+	if (i < count && !total) return -1;
+	return (int)total;
+}
+
+static int socketWrite(twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout) {
+	twWsIoVec v;
+	v.data = buf;
+	v.length = length;
+	return socketWritev(t, &v, 1, timeout);
+}
+
+static int socketFd(twWsTransport * t) {
+	return ((wsSocket *)t->impl)->fd;
+}
+
+static void socketDestroy(twWsTransport * t) {
+	TW_FREE(t->impl);
+}
+
+static const twWsTransportOps tcpOps = { "TCP", socketConnect, socketRead, socketWrite, socketWritev, socketClose, socketFd, socketDestroy };
+static const twWsTransportOps unixOps = { "Unix", socketConnect, socketRead, socketWrite, socketWritev, socketClose, socketFd, socketDestroy };
+
+static int createSocket(const twWsTransportOps * ops, int family, twWsTransport ** entity) {
+	wsSocket * s = NULL;
+	int err = TW_OK;
+	if (!entity) {
+		TW_LOG(TW_ERROR, "twWsTransport: NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	s = (wsSocket *)TW_CALLOC(sizeof(wsSocket), 1);
+	if (!s) {
+		TW_LOG(TW_ERROR, "twWsTransport: Error allocating %s transport", ops->name);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	s->fd = -1;
+	s->family = family;
+	err = allocTransport(ops, s, entity);
+	if (err) TW_FREE(s);
+	return err;
+}
+
+int twWsTransport_CreateTcp(twWsTransport ** entity) {
+	return createSocket(&tcpOps, AF_UNSPEC, entity);
+}
+
+int twWsTransport_CreateUnix(twWsTransport ** entity) {
+	return createSocket(&unixOps, AF_UNIX, entity);
+}
+
+/**
+* In-process pipe
+**/
+typedef struct wsPipeRing {
+	char * data;
+	uint32_t head;
+	uint32_t count;
+} wsPipeRing;
+
+/* Shared by both ends.  Each end reads ring[side] and writes ring[!side]. */
+typedef struct wsPipe {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;                    /* Signalled whenever data is added or taken, or the pipe closes */
+	uint32_t size;
+	wsPipeRing ring[2];
+	char closed;
+	uint32_t ends;                          /* Ends not yet deleted */
+} wsPipe;
+
+typedef struct wsPipeEnd {
+	wsPipe * pipe;
+	int side;
+} wsPipeEnd;
+
+static char pipeWait(wsPipe * p, uint64_t deadline) {
+	/* Caller holds mtx.  Returns FALSE once the deadline has passed. */
+	struct timespec ts;
+	uint64_t now = wsGetMicros();
+	uint64_t wait = 0;
+	if (now >= deadline) return FALSE;
+	wait = deadline - now;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += wait / 1000000;
+	ts.tv_nsec += (long)(wait % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&p->cond, &p->mtx, &ts);
+	return TRUE;
+}
+
+static int pipeConnect(twWsTransport * t, const char * host, uint16_t port, uint32_t timeout) {
+	wsPipeEnd * e = (wsPipeEnd *)t->impl;
+	wsPipe * p = e->pipe;
+	/* There is nowhere to connect to - this just empties the pipe */
+	(void)host;
+	(void)port;
+	(void)timeout;
+	pthread_mutex_lock(&p->mtx);
+	p->ring[0].head = p->ring[0].count = 0;
+	p->ring[1].head = p->ring[1].count = 0;
+	p->closed = FALSE;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mtx);
+	return TW_OK;
+}
+
+static int pipeRead(twWsTransport * t, char * buf, uint32_t length, uint32_t timeout) {
+	wsPipeEnd * e = (wsPipeEnd *)t->impl;
+	wsPipe * p = e->pipe;
+	wsPipeRing * r = &p->ring[e->side];
+	uint64_t deadline = wsGetMicros() + (uint64_t)timeout * 1000;
+	uint32_t taken = 0;
+	pthread_mutex_lock(&p->mtx);
+	while (!r->count && !p->closed && pipeWait(p, deadline));
+	if (!r->count) {
+		pthread_mutex_unlock(&p->mtx);
+		return p->closed ? -1 : 0;
+	}
+	while (taken < length && r->count) {
+		uint32_t chunk = p->size - r->head;
+		if (chunk > r->count) chunk = r->count;
+		if (chunk > length - taken) chunk = length - taken;
+		memcpy(buf + taken, r->data + r->head, chunk);
+		taken += chunk;
+		r->head = (r->head + chunk) % p->size;
+		r->count -= chunk;
+	}
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mtx);
+	return (int)taken;
+}
+
+static int pipeWritev(twWsTransport * t, const twWsIoVec * iov, uint32_t count, uint32_t timeout) {
+	wsPipeEnd * e = (wsPipeEnd *)t->impl;
+	wsPipe * p = e->pipe;
+	wsPipeRing * r = &p->ring[!e->side];
+	uint64_t deadline = wsGetMicros() + (uint64_t)timeout * 1000;
+	uint32_t total = 0;
+	uint32_t i = 0;
+	pthread_mutex_lock(&p->mtx);
+	for (i = 0; i < count && !p->closed; i++) {
+		uint32_t done = 0;
+		while (done < iov[i].length && !p->closed) {
+			uint32_t space = p->size - r->count;
+			uint32_t tail = (r->head + r->count) % p->size;
+			uint32_t chunk = p->size - tail;
+			if (!space) {
+				/* Full - wait for the reader */
+				if (!pipeWait(p, deadline)) break;
+				continue;
+			}
+			if (chunk > space) chunk = space;
+			if (chunk > iov[i].length - done) chunk = iov[i].length - done;
+			memcpy(r->data + tail, iov[i].data + done, chunk);
+			r->count += chunk;
+			done += chunk;
+			pthread_cond_broadcast(&p->cond);
+		}
+		total += done;
+		if (done < iov[i].length) break;
+	}
+	pthread_mutex_unlock(&p->mtx);
+	if (i < count && !total) return -1;
+	return (int)total;
+}
+
+static int pipeWrite(twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout) {
+	twWsIoVec v;
+	v.data = buf;
+	v.length = length;
+	return pipeWritev(t, &v, 1, timeout);
+}
+
+static void pipeClose(twWsTransport * t) {
+	wsPipe * p = ((wsPipeEnd *)t->impl)->pipe;
+	pthread_mutex_lock(&p->mtx);
+	p->closed = TRUE;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mtx);
+}
+
+static int pipeFd(twWsTransport * t) {
+	(void)t;
+	return -1;
+}
+
+static void freePipe(wsPipe * p) {
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mtx);
+	TW_FREE(p->ring[0].data);
+	TW_FREE(p->ring[1].data);
+	TW_FREE(p);
+}
+
+static void pipeDestroy(twWsTransport * t) {
+	/* The last end out frees the pipe */
+	wsPipeEnd * e = (wsPipeEnd *)t->impl;
+	wsPipe * p = e->pipe;
+	uint32_t ends = 0;
+	pthread_mutex_lock(&p->mtx);
+	ends = --p->ends;
+	pthread_mutex_unlock(&p->mtx);
+	TW_FREE(e);
+	if (!ends) freePipe(p);
+}
+
+static const twWsTransportOps pipeOps = { "pipe", pipeConnect, pipeRead, pipeWrite, pipeWritev, pipeClose, pipeFd, pipeDestroy };
+
+static int createPipeEnd(wsPipe * p, int side, twWsTransport ** entity) {
+	wsPipeEnd * e = (wsPipeEnd *)TW_CALLOC(sizeof(wsPipeEnd), 1);
+	if (!e) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreatePipe: Error allocating pipe end");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	e->pipe = p;
+	e->side = side;
+	if (allocTransport(&pipeOps, e, entity)) {
+		TW_FREE(e);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	p->ends++;
+	return TW_OK;
+}
+
+int twWsTransport_CreatePipe(uint32_t size, twWsTransport ** client, twWsTransport ** server) {
+	wsPipe * p = NULL;
+	if (!client || !server) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreatePipe: NULL entity pointer");
+		return TW_INVALID_PARAM;
+	}
+	*client = NULL;
+	*server = NULL;
+	p = (wsPipe *)TW_CALLOC(sizeof(wsPipe), 1);
+	if (!p) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreatePipe: Error allocating pipe");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	p->size = size ? size : WS_PIPE_DEFAULT_SIZE;
+	p->ring[0].data = (char *)TW_CALLOC(p->size, 1);
+	p->ring[1].data = (char *)TW_CALLOC(p->size, 1);
+	pthread_mutex_init(&p->mtx, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	if (!p->ring[0].data || !p->ring[1].data) {
+		TW_LOG(TW_ERROR, "twWsTransport_CreatePipe: Error allocating pipe buffers");
+		freePipe(p);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	if (createPipeEnd(p, 0, client)) {
+		freePipe(p);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	if (createPipeEnd(p, 1, server)) {
+		twWsTransport_Delete(*client);
+		*client = NULL;
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	return TW_OK;
+}
+
+#else
+
+/* Only TLS is supported on Windows */
+int twWsTransport_CreateTcp(twWsTransport ** entity) {
+	TW_LOG(TW_ERROR, "twWsTransport_CreateTcp: Plain TCP transports are not supported on this platform");
+	return TW_INVALID_PARAM;
+}
+
+int twWsTransport_CreateUnix(twWsTransport ** entity) {
+	TW_LOG(TW_ERROR, "twWsTransport_CreateUnix: Unix domain sockets are not supported on this platform");
+	return TW_INVALID_PARAM;
+}
+
+int twWsTransport_CreatePipe(uint32_t size, twWsTransport ** client, twWsTransport ** server) {
+	TW_LOG(TW_ERROR, "twWsTransport_CreatePipe: Pipes are not supported on this platform");
+	return TW_INVALID_PARAM;
+}
+
+#endif
+
+/**
+* Dispatch
+**/
+void twWsTransport_Delete(twWsTransport * t) {
+	if (!t) return;
+	t->ops->close(t);
+	t->ops->destroy(t);
+	TW_FREE(t);
+}
+
+int twWsTransport_Connect(twWsTransport * t, const char * host, uint16_t port, uint32_t timeout) {
+	if (!t || !host) return TW_INVALID_PARAM;
+	return t->ops->connect(t, host, port, timeout);
+}
+
+int twWsTransport_Read(twWsTransport * t, char * buf, uint32_t length, uint32_t timeout) {
+	if (!t) return -1;
+	return t->ops->read(t, buf, length, timeout);
+}
+
+int twWsTransport_Write(twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout) {
+	if (!t) return -1;
+	return t->ops->write(t, buf, length, timeout);
+}
+
+int twWsTransport_Writev(twWsTransport * t, const twWsIoVec * iov, uint32_t count, uint32_t timeout) {
+	int total = 0;
+	uint32_t i = 0;
+	if (!t) return -1;
+	if (t->ops->writev) return t->ops->writev(t, iov, count, timeout);
+	for (i = 0; i < count; i++) {
+		int n = 0;
+		if (!iov[i].length) continue;
+		n = t->ops->write(t, iov[i].data, iov[i].length, timeout);
+		if (n > 0) total += n;
+		if (n != (int)iov[i].length) return total ? total : -1;
+	}
+	return total;
+}
+
+void twWsTransport_Close(twWsTransport * t) {
+	if (t) t->ops->close(t);
+}
+
+int twWsTransport_Fd(twWsTransport * t) {
+	if (!t) return -1;
+	return t->ops->fd(t);
+}
@@ -0,0 +1,195 @@
+/***************************************
+ *  Copyright (C) 2015 ThingWorx Inc.  *
+ ***************************************/
+
+/**
+ * \file twWsTransport.h
+ *
+ * \brief Byte stream transports for websockets
+ *
+ * A websocket moves its frames over a transport, which is a table of
+ * operations and the state they work on.  TLS is the default.  Plain TCP
+ * and Unix domain sockets skip the cost of encryption on hops that don't
+ * need it, such as a proxy on the same host, and an in-process pipe
+ * connects a websocket to a server in the same process, so the frame layer
+ * can be tested and benchmarked without a network.  Other transports can
+ * be plugged in by filling in a ::twWsTransportOps.
+*/
+
+#include "twOSPort.h"
+
+#ifndef TW_WS_TRANSPORT_H
+#define TW_WS_TRANSPORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of each direction of an in-process pipe */
+#ifndef WS_PIPE_DEFAULT_SIZE
+#define WS_PIPE_DEFAULT_SIZE 65536
+#endif
+
+/* Most pieces twWsTransport_Writev() hands to the operating system at once */
+#ifndef WS_TRANSPORT_MAX_IOV
+#define WS_TRANSPORT_MAX_IOV 16
+#endif
+
+struct twWsTransport;
+struct twTlsClient;
+
+/**
+ * \brief One piece of a gathered write.
+*/
+typedef struct twWsIoVec {
+	const char * data;
+	uint32_t length;
+} twWsIoVec;
+
+/**
+ * \brief Transport operations.  Reads and writes follow twTlsClient_Read()
+ * and twTlsClient_Write(): they return the number of bytes transferred, 0
+ * if a read timed out with nothing to read, or a negative number on error.
+ * A write that returns less than it was given has failed.
+*/
+typedef struct twWsTransportOps {
+	const char * name;                      /**< For logging. **/
+	int (*connect)(struct twWsTransport * t, const char * host, uint16_t port, uint32_t timeout);  /**< Closes any current connection and opens a new one within timeout milliseconds, 0 for no limit.  Returns #TW_OK or an error code. **/
+	int (*read)(struct twWsTransport * t, char * buf, uint32_t length, uint32_t timeout);
+	int (*write)(struct twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout);
+	int (*writev)(struct twWsTransport * t, const twWsIoVec * iov, uint32_t count, uint32_t timeout);  /**< May be NULL, in which case each piece is written in turn. **/
+	void (*close)(struct twWsTransport * t);
+	int (*fd)(struct twWsTransport * t);    /**< Descriptor that polls readable when there is data, or -1 if there is none. **/
+	void (*destroy)(struct twWsTransport * t);  /**< Frees the transport's state.  Called after close. **/
+} twWsTransportOps;
+
+/**
+ * \brief A transport.
+*/
+typedef struct twWsTransport {
+	const twWsTransportOps * ops;
+	void * impl;                            /**< The implementation's state. **/
+	struct twTlsClient * tls;               /**< The TLS client, for TLS transports only. **/
+} twWsTransport;
+
+/**
+ * \brief Creates a TLS transport.  This is what twWs_Create() uses.
+ *
+ * \param[in]     host      The host to connect to.
+ * \param[in]     port      The port to connect to.
+ * \param[out]    entity    A pointer to the newly allocated transport.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+*/
+int twWsTransport_CreateTls(const char * host, uint16_t port, twWsTransport ** entity);
+
+/**
+ * \brief Creates a plain TCP transport.
+ *
+ * \param[out]    entity    A pointer to the newly allocated transport.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Nothing is encrypted.  Only for hops that are already private.
+*/
+int twWsTransport_CreateTcp(twWsTransport ** entity);
+
+/**
+ * \brief Creates a Unix domain socket transport.  The websocket's host is
+ * taken as the path of the socket and its port is ignored.
+ *
+ * \param[out]    entity    A pointer to the newly allocated transport.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Not supported on Windows.
+*/
+int twWsTransport_CreateUnix(twWsTransport ** entity);
+
+/**
+ * \brief Creates the two ends of an in-process pipe.  What is written to
+ * one end is read from the other.
+ *
+ * \param[in]     size      Bytes each direction holds, or 0 for
+ *                          #WS_PIPE_DEFAULT_SIZE.  A write waits, up to its
+ *                          timeout, for the reader to make room.
+ * \param[out]    client    The end to give a websocket.
+ * \param[out]    server    The end to serve it from.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Closing either end makes reads at the other fail once they have
+ * drained what was sent.  Connecting an end reopens the pipe, emptied.
+ * \note A pipe has no descriptor, so it can't be driven by a reactor.
+ * \note Not supported on Windows.
+*/
+int twWsTransport_CreatePipe(uint32_t size, twWsTransport ** client, twWsTransport ** server);
+
+/**
+ * \brief Frees a transport, closing it first.
+ *
+ * \param[in]     t         The transport to delete.
+*/
+void twWsTransport_Delete(twWsTransport * t);
+
+/**
+ * \brief Connects a transport, closing any current connection first.
+ *
+ * \param[in]     t         The transport.
+ * \param[in]     host      The host, or for Unix domain sockets the path.
+ * \param[in]     port      The port.
+ * \param[in]     timeout   The longest time (in milliseconds) to wait for
+ *                          the connection, or 0 for no limit.
+ *
+ * \return #TW_OK if successful, positive integral on error code (see
+ * twErrors.h) if an error was encountered.
+ *
+ * \note Resolving a host name isn't covered by the timeout.  The TLS
+ * transport uses the TLS client's own connect timeout instead.
+*/
+int twWsTransport_Connect(twWsTransport * t, const char * host, uint16_t port, uint32_t timeout);
+
+/**
+ * \brief Reads whatever is available, waiting up to \p timeout milliseconds
+ * for something to arrive.
+ *
+ * \return The number of bytes read, 0 on timeout, negative on error.
+*/
+int twWsTransport_Read(twWsTransport * t, char * buf, uint32_t length, uint32_t timeout);
+
+/**
+ * \brief Writes all of \p buf, waiting up to \p timeout milliseconds for
+ * room.
+ *
+ * \return The number of bytes written, negative on error.
+*/
+int twWsTransport_Write(twWsTransport * t, const char * buf, uint32_t length, uint32_t timeout);
+
+/**
+ * \brief Writes several buffers, in order, as if they were one.
+ *
+ * \return The number of bytes written, negative on error.
+*/
+int twWsTransport_Writev(twWsTransport * t, const twWsIoVec * iov, uint32_t count, uint32_t timeout);
+
+/**
+ * \brief Closes the connection.  The transport can be connected again.
+*/
+void twWsTransport_Close(twWsTransport * t);
+
+/**
+ * \brief Gets the descriptor to poll for the transport being readable.
+ *
+ * \return The descriptor, or -1 if there is none.
+*/
+int twWsTransport_Fd(twWsTransport * t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif